@@ -4,6 +4,7 @@
  * (c) 2014 Open Garages - Craig Smith <craig@theialabs.com>
  */
 
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -12,12 +13,24 @@
 #include <signal.h>
 #include <getopt.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <net/if.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/isotp.h>
 
 #include "uds-server.h"
 
@@ -29,41 +42,517 @@
 #define DATA_ALPHA     0
 #define DATA_ALPHANUM  1
 #define DATA_BINARY    2
+#define RX_BATCH_MAX   256 // Upper limit for frames drained per wakeup
+#define RX_BATCH_DEF   32
+#define EPOLL_TIMEOUT  20  // ms
+#define TX_BATCH_MAX   64  // Frames per sendmmsg()
+#define TX_RETRIES     10  // ENOBUFS backoffs in a row before frames are dropped
+#define TX_BACKOFF_US  100 // First ENOBUFS backoff, doubles on every retry
+#define TX_DEFER_MAX   4096 // Frames that can wait in the deferred queue
+#define GM_DTC_INTERVAL_US 1000000 // Gap between streamed GM DTC frames
 
-/* Globals */
-int running = 0;
+/* Periodic data */
+#define PERIODIC_MAX   1024 // Concurrent periodic DID subscriptions
+#define PERIODIC_GM    0    // GM 0xAA, UUDT frames with the DID in byte 0
+#define PERIODIC_UDS   1    // UDS 0x2A, single frames on the response ID
+#define RATE_SLOW      0
+#define RATE_MEDIUM    1
+#define RATE_FAST      2
+#define PERIODIC_RATES 3
+#define WHEEL_TICK_US  1000
+#define WHEEL_BITS     8
+#define WHEEL_SLOTS    (1 << WHEEL_BITS) // Level 0, one tick per slot
+#define WHEEL_L1_SLOTS 64                // Level 1, WHEEL_SLOTS ticks per slot
+#define ISOTP_MAX_SESSIONS 16
+#define ISOTP_MAX_PDU  4095 // Largest length without the escape sequence
+#define ISOTP_BUF_SIZE 65535 // Session and reassembly buffers
+#define ISOTP_N_BS_MS  1000 // How long we wait for the tester's FC
+#define ISOTP_IDLE     0
+#define ISOTP_WAIT_FC  1
+#define ISOTP_SENDING  2
+#define ISOTP_RX_POOL  8
+#define ISOTP_N_CR_MS  1000 // How long we wait for the tester's next CF
+#define ISOTP_RX_BS    0    // Block size we ask for, 0 = no further FC
+#define ISOTP_RX_STMIN 0    // STmin we ask for
+#define ISOTP_FC_CTS      0
+#define ISOTP_FC_WAIT     1
+#define ISOTP_FC_OVERFLOW 2
+#define MAX_ECUS       512
+#define MAX_IFACES     8   // One event loop thread each
+#define OBD_MAX_ECUS   8   // 0x7E0-0x7E7 answering on 0x7E8-0x7EF
+#define OBD_FUNC_ID    0x7DF
+
+/* ECU definition images */
+#define IMAGE_MAGIC    "UDSIMG1"
+#define IMAGE_VERSION  2
+#define IMAGE_SUFFIX   ".img" // Compiled image is cached next to the text file
+#define IMAGE_DID_MAX  (ISOTP_MAX_PDU - 3) // 0x62 plus the DID
+#define IMAGE_PID_MAX  5
+
+/* Memory images for ReadMemoryByAddress */
+#define MEM_REGIONS_MAX 16
+
+/* Upload and download transfers */
+#define XFER_MAX       16   // Running at once per interface
+#define XFER_BLOCK_LEN 4095 // maxNumberOfBlockLength, largest unescaped ISO-TP PDU
+#define XFER_S3_MS     5000 // S3server, a transfer with no request this long is dropped
+#define XFER_UPLOAD    0
+#define XFER_DOWNLOAD  1
+#define XFER_WRITERS   2    // Threads writing downloads to disk
+#define XFER_BUFS      64   // Downloaded blocks waiting for the disk
+#define WRITE_QUEUE    512
+#define WRITE_OPEN     0
+#define WRITE_DATA     1
+#define WRITE_CLOSE    2
+
+/* DTC store */
+#define DTC_STATUS_BITS 8
+#define DTC_PERMANENT   0x100 // Extra bitmap for OBD mode 0A, survives clearing
+#define DTC_CHUNK       64    // Bitmap words combined at a time
+#define DTC_PENDING     0x04  // ISO 14229 status bits
+#define DTC_CONFIRMED   0x08
+#define DTC_CLEARED     0x50  // testNotCompletedSinceLastClear and ThisOperationCycle
+#define DTC_STRESS_MAX  1048576
+
+/* Response cache */
+#define RCACHE_KEY_MAX 4     // Longest request payload that is cached
+#define RX_FILTER_MAX  512 // Kernel limit for CAN_RAW_FILTER entries
+
+/* ISO-TP backends */
+#define ISOTP_USER     0 // Our own stack on the raw socket
+#define ISOTP_KERNEL   1 // CAN_ISOTP sockets, one pair per ECU
+#define ISOTP_KERNEL_PDU 8200 // Largest PDU CAN_ISOTP sends, unless the module says otherwise
+
+/* epoll event sources, the index goes in the low 32 bits */
+#define EV_CAN         1
+#define EV_TX_TIMER    2
+#define EV_ISOTP       3 // Physical CAN_ISOTP socket of an ECU
+#define EV_ISOTP_FUNC  4 // Functional CAN_ISOTP socket of an ECU
+#define EV_PERIODIC    5
+#define EV_KEY(type, idx) (((unsigned long long)(type) << 32) | (unsigned int)(idx))
+
+/*
+ * Globals
+ *
+ * Anything marked __thread belongs to the event loop of one interface,
+ * the rest is configuration or ECU state shared by all of them.  The
+ * big per loop tables are __thread pointers into the loop's loop_state.
+ */
+volatile int running = 0;
 int verbose = 0;
 int no_flow_control = 0;
 int fuzz_level = 0;
 int keep_spec = 0;
+int can_fd = 0;
+int use_kernel_isotp = 0;
+int isotp_kernel_pdu_max = ISOTP_KERNEL_PDU;
+int obd_ecus = 1;           // ECUs answering functional OBD requests
+int func_jitter_ms = 0;     // Max random delay before each of them answers
+__thread int isotp_backend = ISOTP_USER;
+__thread int loop_id = 0;  // Index of our interface in loops[]
 FILE *plogfp = NULL;
+FILE *recfp = NULL;         // -R, every frame in and out
+char *replay_file = NULL;   // -P, answer from a recording
 char *vin = VIN;
-struct timeval start_tv;
-int pending_data;
-struct can_frame gm_data_by_id;
-long gm_lastcms = 0;
 
-/* This is for flow control packets */
-char gBuffer[255];
-int gBufSize;
-int gBufLengthRemaining;
-int gBufCounter;
+/* ISO-TP sessions, one per pending multi-frame response */
+struct isotp_session {
+  int state;
+  int rx_id;      // Tester's request ID, FC frames arrive here
+  int tx_id;      // Our response ID
+  int ext;        // Extended address or -1
+  unsigned char *buf;
+  unsigned char *src;      // Payload being sent, buf or a read-only mapping
+  int src_off;             // PDU offset src starts at, the bytes before it only go in the FF
+  struct canfd_frame *cfs; // Prebuilt consecutive frames, NULL to build them from src
+  struct dtc_store *dtcs;  // DTC report streamed from the store instead of src
+  int dtc_mask;
+  unsigned int dtc_gen;    // Store generation the report was counted at
+  int dtc_rec;             // Last report record looked up
+  int dtc_i;               // and the DTC it is
+  int size;
+  int offset;     // Next byte to send
+  int sn;         // Next sequence number
+  int bs;         // Block size from the last FC
+  int block;      // CFs sent in the current block
+  long stmin_us;  // STmin from the last FC
+  long long next_us; // When the next paced CF is due
+  long long start_us;
+  long deadline;  // ms, when we give up waiting for FC
+};
+__thread unsigned char (*isotp_tx_bufs)[ISOTP_BUF_SIZE];
+__thread struct isotp_session *isotp_sessions;
+__thread unsigned long isotp_tx_bytes = 0;
+__thread unsigned long isotp_tx_frames = 0;
+__thread unsigned long isotp_tx_msgs = 0;
+__thread unsigned long isotp_kernel_pdus_rx = 0;
+__thread unsigned long isotp_kernel_pdus_tx = 0;
+__thread unsigned long isotp_kernel_busy = 0;
+__thread unsigned char *isotp_kernel_buf;
+__thread long long isotp_tx_us = 0;  // Time spent on multi-frame transfers
+__thread int tx_timer_fd = -1;       // Paced consecutive frames and deferred frames
+__thread long long tx_timer_armed = 0;
+
+/* Reassembly of multi-frame requests, buffers come from a fixed pool */
+struct isotp_rx {
+  int in_use;
+  int rx_id;      // Tester's request ID
+  int tx_id;      // Where our FC frames go
+  unsigned char *buf;
+  int size;
+  int offset;
+  int sn;         // Next expected sequence number
+  int block;      // CFs since our last FC
+  long deadline;  // ms, when we give up waiting for the next CF
+};
+__thread unsigned char (*isotp_rx_bufs)[ISOTP_BUF_SIZE];
+__thread struct isotp_rx *isotp_rxs;
+
+/* The request being handled, reassembled if it spanned several frames */
+struct isotp_pdu {
+  int id;
+  struct ecu *ecu;
+  unsigned char *data; // Payload without PCI
+  int len;
+};
+__thread struct isotp_pdu cur_req;
+
+/*
+ * Compiled ECU definitions.  One flat block that is either built from
+ * the text file or mmap()ed from its cached copy; all references are
+ * offsets from the start so it can be used in place.  DIDs and PIDs are
+ * sorted so lookups are a binary search over small fixed entries.
+ */
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;      // Whole image in bytes
+  uint32_t ecu_count;
+  uint32_t ecu_off;
+  uint64_t src_size;  // Text file the image was built from, to tell
+  int64_t src_mtime;  // if the cached copy is stale (mtime in ns)
+};
+struct image_ecu {
+  uint16_t req_id;
+  uint16_t resp_id;
+  uint16_t func_id;   // 0 if none
+  uint16_t pad;
+  uint32_t name_off;  // NUL terminated
+  uint32_t did_off;
+  uint32_t did_count;
+  uint32_t pid_off;
+  uint32_t pid_count;
+  uint32_t dtc_off;
+  uint32_t dtc_count;
+};
+struct image_did {
+  uint16_t did;
+  uint16_t len;
+  uint32_t data_off;
+};
+struct image_pid {    // OBD mode 01
+  uint8_t pid;
+  uint8_t len;
+  uint16_t pad;
+  uint32_t data_off;
+};
+struct image_dtc {
+  uint16_t code;
+  uint8_t status;
+  uint8_t pad;
+};
+unsigned char *ecu_image = NULL;
+uint32_t ecu_image_size = 0;
+__thread unsigned char *resp_buf; // Response scratch so handlers don't allocate
+
+/* Built in DIDs, sorted by DID for binary search */
+struct did_entry {
+  int did;
+  int len;
+  char *data;
+};
+
+/* Simulated ECUs, routed by 11 bit request ID and then by SID */
+typedef void (*sid_handler)(int, struct canfd_frame);
+struct ecu {
+  char *name;
+  int req_id;     // Physical request ID
+  int resp_id;    // 0 if the ECU doesn't answer over ISO-TP
+  int log_pkts;   // Print every request in verbose mode
+  int func_id;    // Functional request ID routed here, 0 if none
+  unsigned int loops;       // Interfaces answering for it, a bit per loops[] index, 0 for all
+  int isotp_fd[MAX_IFACES]; // CAN_ISOTP backend sockets per interface, -1 when not open
+  int func_fd[MAX_IFACES];
+  unsigned long requests;   // Served on any interface, updated atomically
+  struct ecu *func_next;    // Next ECU answering the same functional ID
+  struct image_ecu *def;    // From the definition file, NULL if built in
+  struct dtc_store *dtcs;   // NULL if the ECU has no DTCs
+  struct did_entry *dids;   // Built in DIDs, NULL if none
+  int did_count;
+  sid_handler did_fallback; // Other 0x22 handler for DIDs we don't have
+  sid_handler pid_fallback; // Same for mode 01 PIDs
+  sid_handler sids[256];
+};
+struct ecu ecus[MAX_ECUS];
+int ecu_count = 0;
+struct ecu *ecu_by_id[CAN_SFF_MASK + 1];   // Request ID -> ECU
+struct ecu *ecu_by_resp[CAN_SFF_MASK + 1]; // Response ID -> ECU
+
+/*
+ * DTCs of one ECU.  Bit i of bits[b] is status bit b of DTC i, so a
+ * status mask query ORs a few bitmaps together instead of looking at
+ * every record.  Clearing takes the write lock, queries the read lock.
+ */
+struct dtc_store {
+  int count;
+  int alloc;           // DTCs the arrays have room for, a multiple of 64
+  uint32_t *codes;     // 3 byte UDS DTCs, OBD codes are the top two bytes
+  uint64_t *bits[DTC_STATUS_BITS + 1];
+  unsigned int gen;    // Bumped on every change, streamed reports check it
+  pthread_rwlock_t lock;
+};
+int dtc_stress = 0;    // Extra DTCs for the engine, -D
+
+/* Memory images, files mapped read-only at an ECU address */
+struct mem_region {
+  struct ecu *ecu;
+  uint64_t base;
+  uint64_t size;
+  unsigned char *map;
+};
+struct mem_region mem_regions[MEM_REGIONS_MAX];
+int mem_region_count = 0;
+
+/* Transfer in progress on one ECU */
+struct xfer {
+  struct ecu *ecu;   // NULL when the slot is free
+  int dir;
+  unsigned char *data;
+  uint64_t size;
+  uint64_t done;     // Bytes transferred so far
+  int seq;           // Next blockSequenceCounter
+  int block;         // Data bytes per block
+  int last_len;      // Size of the last block, for repeats
+  unsigned long blocks;
+  long long start_us;
+  long last_ms;      // Last request to the ECU, for S3
+  struct sink *sink; // Downloads, where the blocks are written
+  int writer;
+  uint32_t crc;
+};
+__thread struct xfer *xfers;
+
+/*
+ * Downloads are written by their own threads so the event loops never
+ * wait for the disk.  Every transfer sticks to one writer, which keeps
+ * its open, writes and close in order.
+ */
+struct sink {
+  int fd;
+  int failed;
+  uint64_t written;
+  char path[PATH_MAX];
+};
+struct write_job {
+  int op;
+  struct sink *sink;
+  uint64_t offset;
+  int len;
+  int buf;           // Index into xfer_bufs
+};
+struct writer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t room;   // Signalled when a job is taken off the queue
+  int stop;
+  int head;
+  int count;
+  struct write_job jobs[WRITE_QUEUE];
+} writers[XFER_WRITERS];
+char *download_dir = NULL;
+int writer_next = 0;
+unsigned char xfer_bufs[XFER_BUFS][XFER_BLOCK_LEN];
+int xfer_free[XFER_BUFS];
+int xfer_free_count = 0;
+pthread_mutex_t xfer_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t crc32_table[256];
+
+/* Transmit vector, flushed with one sendmmsg() */
+__thread struct canfd_frame *tx_frames;
+__thread struct mmsghdr *tx_msgs;
+__thread struct iovec *tx_iov;
+__thread int tx_count = 0;
+__thread int tx_errno = 0;
+__thread unsigned long tx_sent = 0;
+__thread unsigned long tx_syscalls = 0;
+__thread unsigned long tx_retries = 0;
+__thread unsigned long tx_dropped = 0;
+__thread int tx_backoff = 0; // ENOBUFS backoffs since the last frame went out
+__thread struct canfd_frame *tx_backlog; // Ring of frames waiting out ENOBUFS
+__thread int tx_backlog_head = 0;
+__thread int tx_backlog_len = 0;
+__thread long long tx_backlog_due = 0;   // When the backlog is tried again
+
+/* Deferred frames, a binary min-heap ordered by due time */
+struct deferred_frame {
+  long long due_us;
+  unsigned long seq;  // Keeps frames due at the same time in order
+  struct ecu *ecu;    // Set when frame is a request for this ECU to handle
+  struct canfd_frame frame;
+};
+__thread struct deferred_frame *tx_defer_heap;
+__thread int tx_defer_count = 0;
+__thread unsigned long tx_defer_seq = 0;
+__thread unsigned long tx_defer_full = 0;
+
+/* Periodic DID subscriptions, linked into the timing wheel slots */
+struct periodic_sub {
+  int in_use;
+  int proto;      // PERIODIC_GM or PERIODIC_UDS
+  int tx_id;
+  int did;
+  int rate;
+  long long due_us;
+  int prev;       // Neighbours in the same slot, -1 ends the list
+  int next;
+  int *slot;      // Head of the slot list we are on
+};
+__thread struct periodic_sub *periodic_subs;
+__thread int periodic_count = 0;
+__thread int *wheel_l0;
+__thread int *wheel_l1;
+__thread long long wheel_tick = 0;  // Last tick that was processed
+__thread long long wheel_base_us = 0;
+__thread int periodic_timer_fd = -1;
+__thread long long periodic_timer_armed = 0;
+long periodic_rate_us[PERIODIC_RATES] = { 1000000, 100000, 20000 };
+char *periodic_rate_names[PERIODIC_RATES] = { "slow", "medium", "fast" };
+__thread unsigned long periodic_sent[PERIODIC_RATES];
+__thread long long periodic_late_sum[PERIODIC_RATES]; // us behind schedule
+__thread long long periodic_late_max[PERIODIC_RATES];
+__thread unsigned long periodic_full = 0;
+
+/*
+ * Response cache, the exact frames of every answer that doesn't change
+ * while we aren't fuzzing.  Filled before the event loops start and
+ * only read afterwards.
+ */
+struct rcache_entry {
+  struct ecu *ecu;
+  int req_id;
+  int key_len;
+  unsigned char key[RCACHE_KEY_MAX]; // Request payload
+  int dest;
+  uint32_t pdu_off;     // Into rcache_pdus
+  uint32_t pdu_len;     // 0 if the handler sent raw frames
+  uint32_t frame_off;   // Into rcache_frames
+  uint32_t frame_count;
+  uint32_t first;       // Payload bytes in the first frame
+};
+struct rcache_entry *rcache = NULL; // Sized from the ECUs by rcache_build()
+int rcache_count = 0;
+int rcache_alloc = 0;
+int *rcache_slots = NULL;          // Entry index + 1, 0 when empty
+unsigned int rcache_mask = 0;      // Hash slots - 1, twice the entries rounded up to a power of two
+unsigned char *rcache_pdus = NULL;
+uint32_t rcache_pdus_len = 0, rcache_pdus_alloc = 0;
+struct canfd_frame *rcache_frames = NULL;
+uint32_t rcache_frames_len = 0, rcache_frames_alloc = 0;
+int rcache_enabled = 0;
+unsigned long rcache_full = 0;
+__thread unsigned long rcache_hits = 0;
+__thread unsigned long rcache_misses = 0;
+
+/* What a handler sent while the cache was being filled */
+struct rcache_capture {
+  int bad;        // Deferred something or sent more than we can replay
+  int pdus;
+  int dest;
+  int len;
+  unsigned char pdu[ISOTP_BUF_SIZE];
+  int raw;
+  struct canfd_frame frames[TX_BATCH_MAX];
+};
+int rcache_capturing = 0;
+struct rcache_capture rcache_caps[2];
+struct rcache_capture *rcache_cap = NULL;
+
+/* Receive engine, preallocated so the hot path never allocates */
+int rx_batch = RX_BATCH_DEF;
+__thread struct canfd_frame *rx_frames;
+__thread struct mmsghdr *rx_msgs;
+__thread struct iovec *rx_iov;
+__thread struct sockaddr_can *rx_addr;
+__thread char (*rx_ctrl)[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+__thread unsigned long rx_wakeups = 0;
+__thread unsigned long rx_total = 0;
+__thread unsigned long rx_bad = 0;
+__thread unsigned long rx_hist[RX_BATCH_MAX + 1];
+__thread char *can_ifname = NULL;
+int rx_filter = 1;
+__thread int rx_filters = 0;           // Installed kernel filters, 0 = receive everything
+__thread unsigned long iface_rx_start = 0;
+__thread unsigned long rx_overflows = 0; // Dropped by the socket queue (SO_RXQ_OVFL)
 
 /* Prototypes */
 void print_pkt(struct canfd_frame);
 void print_bin(unsigned char *, int);
+void handle_pkt(int, struct canfd_frame);
+void handle_request(int, struct canfd_frame);
+long long now_us();
+int isotp_dl();
+void isotp_fill_cf(struct canfd_frame *, unsigned char *, int, int, int);
+void dtc_report_read(struct isotp_session *, int, unsigned char *, int);
+int isotp_kernel_send(int, char *, int);
+int isotp_kernel_sendv(int, struct iovec *, int);
+void isotp_kernel_close();
+void ecu_dispatch(int, struct ecu *, struct canfd_frame);
+struct ecu *ecu_route(int);
+void send_nrc(int, int, int, int);
+unsigned char *ecu_find_did(struct ecu *, int, int *);
+struct mem_region *mem_find(struct ecu *, uint64_t, uint64_t);
+void download_block(int, struct xfer *);
+void download_exit(int, struct xfer *);
+int writer_push(int, int, struct sink *, uint64_t, int, int, int);
+void rcache_capture_pdu(int, int, char *, int);
+void rcache_capture_frames(int);
+void rec_frames(struct canfd_frame *, int, int);
+int rcache_send(int, struct canfd_frame);
 
 
 void usage(char *app, char *msg) {
   printf("Simulates UDS responses\n");
   if (msg) printf("%s\n", msg);
-  printf("Usage: %s [options] <can_interface>\n", app);
+  printf("Usage: %s [options] <can_interface> [can_interface...]\n", app);
   printf("\t-z\t\tIncrease fuzz level\n");
   printf("\t-v\t\tVerbose\n");
   printf("\t-l <logfile>\tLog output to file instead of STDOUT\n");
   printf("\t-c\t\tDon't fuzz ISOTP Spec, just data\n");
   printf("\t-F\t\tDisable flow control (Functional Addressing)\n");
   printf("\t-V <vin>\tSpecify VIN (Default: %s)\n", VIN);
+  printf("\t-B <frames>\tMax frames drained per wakeup (Default: %d, Max: %d)\n", RX_BATCH_DEF, RX_BATCH_MAX);
+  printf("\t-f\t\tCAN FD mode (64 byte frames)\n");
+  printf("\t-A\t\tReceive all IDs (don't install kernel filters)\n");
+  printf("\t-I\t\tUse kernel CAN_ISOTP sockets for ISO-TP (Linux 5.10+)\n");
+  printf("\t-C <cores>\tPin interface threads to these cores (e.g. 0,2,4)\n");
+  printf("\t-N <ecus>\tECUs answering functional OBD requests (Default: 1, Max: %d)\n", OBD_MAX_ECUS);
+  printf("\t-J <ms>\t\tMax random delay before each functional response (Default: 0)\n");
+  printf("\t-e <file>\tLoad ECU definitions (compiled to <file>%s)\n", IMAGE_SUFFIX);
+  printf("\t-m <id>:<addr>:<file>\tMap a memory image for ReadMemoryByAddress\n");
+  printf("\t-b <id>:<iface>\tOnly answer for ECU <id> on this interface (Default: all)\n");
+  printf("\t-g <from>:<to>\tGateway, ECUs bound to <to> also answer on <from>\n");
+  printf("\t-d <dir>\tAccept downloads (RequestDownload) and save them here\n");
+  printf("\t-D <dtcs>\tGive the engine this many extra DTCs (Max: %d)\n", DTC_STRESS_MAX);
+  printf("\t-S <seed>\tSeed for fuzz data, logged at start up (Default: time)\n");
+  printf("\t-M <percent>\tMutate this share of all responses (Default: 0)\n");
+  printf("\t-W <weights>\tMutation weights, e.g. length=8,nrc=0 (boundary length truncate\n");
+  printf("\t\t\trepeat echo nrc sid bitflip, Default: 4,4,3,2,2,2,1,2)\n");
+  printf("\t-T <percent>\tBreak this share of ISOTP messages at the frame level (Default: 0)\n");
+  printf("\t-R <file>\tRecord every frame received and sent\n");
+  printf("\t-P <file>[:<cases>]\tReplay a recording instead of simulating, up to <cases> requests\n");
+  printf("\t-X\t\tReplay as fast as possible instead of at the recorded timing\n");
+  printf("\t-O <file>\tWatch the tester for hangs and append findings here (on when fuzzing)\n");
   printf("\n");
   exit(1);
 }
@@ -89,1336 +578,5390 @@ void intHandler(int sig) {
     running = 0;
 }
 
-// Generates data into a buff and returns it.
-char *gen_data(int scope, int size) {
-  char *charset, *buf;
-  unsigned char byte;
-  int num;
+/*
+ * Fuzz data
+ *
+ * Every loop thread runs its own xoshiro256** generator, seeded from
+ * fuzz_seed (-S) plus the loop number, so a fuzz run can be repeated
+ * from the seed it logs at start up.  gen_data() fills the caller's
+ * buffer eight bytes per draw and maps printable scopes through a
+ * 256 entry table instead of a modulo per byte.
+ */
+uint64_t fuzz_seed;
+__thread uint64_t prng_s[4];
+unsigned char charset_map[DATA_BINARY][256];
+
+uint64_t prng_rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+uint64_t prng_next() {
+  uint64_t *s = prng_s;
+  uint64_t result = prng_rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = prng_rotl(s[3], 45);
+  return result;
+}
+
+// Expands one seed into the four state words with splitmix64
+void prng_seed(uint64_t seed) {
+  uint64_t z;
   int i;
-  buf = malloc(size);
-  memset(buf,0,size);
-  switch(scope) {
-    case DATA_ALPHA:
-       charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-       for(i = 0; i < size; i++) {
-         buf[i] = charset[rand() % strlen(charset)];
-       } 
-       break;
-    case DATA_ALPHANUM:
-       charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-       for(i = 0; i < size; i++) {
-         num = rand() % strlen(charset);
-         byte = charset[num];
-if (DEBUG) printf("DEBUG: random byte[%d] = %d %02X\n", i, num, byte);
-         buf[i] = byte;
-       } 
-       break;
-    case DATA_BINARY:
-       for(i = 0; i < size; i++) {
-         buf[i] = rand() % 256;
-       }
-    default:
-      break;
+  for(i = 0; i < 4; i++) {
+    z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    prng_s[i] = z ^ (z >> 31);
   }
-  return buf;
 }
 
-// If a flow control packet comes in, push out more data
-// This isn't fully supported, just a hack at the moment
-void flow_control_push_to(int can, int id) {
-  struct canfd_frame frame;
-  int nbytes;
-  if(no_flow_control) return;
-  if(verbose) plog("FC: Flushing ISOTP buffers\n");
-  frame.can_id = id;
-  while(gBufLengthRemaining > 0) {
-    if(gBufLengthRemaining > 7) {
-      frame.len = 8;
-      frame.data[0] = gBufCounter;
-      memcpy(&frame.data[1], gBuffer+(gBufSize-gBufLengthRemaining), 7);
-      nbytes = write(can, &frame, CAN_MTU);
-      if(nbytes < 0) perror("Write packet (FC)");
-      gBufCounter++;
-      gBufLengthRemaining -= 7;
-    } else {
-      frame.len = gBufLengthRemaining + 1;
-      frame.data[0] = gBufCounter;
-      memcpy(&frame.data[1], gBuffer+(gBufSize-gBufLengthRemaining), CAN_MTU);
-      nbytes = write(can, &frame, CAN_MTU);
-      if(nbytes < 0) perror("Write packet (FC Final)");
-      gBufLengthRemaining = 0;
+// Uniform value below n, multiply and shift rather than a division
+uint32_t prng_below(uint32_t n) {
+  return ((prng_next() >> 32) * n) >> 32;
+}
+
+void gen_data_init() {
+  char *charsets[DATA_BINARY] = { "ABCDEFGHIJKLMNOPQRSTUVWXYZ", "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789" };
+  int scope, i, len;
+  for(scope = 0; scope < DATA_BINARY; scope++) {
+    len = strlen(charsets[scope]);
+    // Bytes past the last whole multiple of len would favour the first
+    // characters, they map to 0 and gen_data() draws another one
+    for(i = 0; i < 256; i++) charset_map[scope][i] = i < 256 - 256 % len ? charsets[scope][i % len] : 0;
+  }
+}
+
+// Fills buf with size bytes of random data in the given scope
+void gen_data(int scope, char *buf, int size) {
+  unsigned char *map;
+  uint64_t r = 0;
+  int i, left = 0;
+  if(scope < DATA_ALPHA || scope >= DATA_BINARY) {
+    for(i = 0; i + 8 <= size; i += 8) {
+      r = prng_next();
+      memcpy(&buf[i], &r, 8);
+    }
+    if(i < size) {
+      r = prng_next();
+      memcpy(&buf[i], &r, size - i);
+    }
+    return;
+  }
+  map = charset_map[scope];
+  for(i = 0; i < size; r >>= 8, left--) {
+    if(!left) {
+      r = prng_next();
+      left = 8;
     }
+    if(map[r & 0xFF]) buf[i++] = map[r & 0xFF];
+  }
+}
+
+/*
+ * Tester oracle
+ *
+ * While fuzzing we watch the tester instead of its screen.  For every
+ * ECU we keep the TesterPresent interval and the time from our answer
+ * to the tester's next request to the same ECU, as moving averages and
+ * log2 histograms.  A TesterPresent that stops coming, a latency spike
+ * or a tester that goes quiet altogether is a finding, tied to the case
+ * (received frame, as numbered by -P) answered just before it and the
+ * fuzz strategy used on that answer.  Findings are logged, appended to
+ * the -O file and summed up by kind and strategy on shutdown.
+ */
+#define ORACLE_BUCKETS      24      // log2 of microseconds, up to 16 s
+#define ORACLE_FINDINGS_MAX 1024
+#define ORACLE_MIN_SAMPLES  8       // Before an average is trusted
+#define ORACLE_SPIKE        5       // Latency this many times the average is a spike
+#define ORACLE_SPIKE_MIN_US 100000
+#define ORACLE_TP_LATE      3       // TesterPresent intervals missed
+#define ORACLE_TP_MIN_US    500000
+#define ORACLE_SILENT       20      // Request gaps of silence
+#define ORACLE_SILENT_MIN_US 2000000
+#define ORACLE_CHECK_US     100000
+#define ORACLE_TP_MISSING   0
+#define ORACLE_LATENCY      1
+#define ORACLE_QUIET        2
+#define ORACLE_KINDS        3
+
+struct oracle_ecu {
+  long long answer_us;   // Our last answer, 0 if the tester has been asked since
+  unsigned long answer_case;
+  char *answer_fuzz;
+  long long lat_avg;
+  unsigned long lat_samples;
+  long long tp_us;       // Last TesterPresent
+  long long tp_avg;
+  unsigned long tp_samples;
+  int tp_flagged;
+  unsigned int lat_hist[ORACLE_BUCKETS];
+  unsigned int tp_hist[ORACLE_BUCKETS];
+};
+struct oracle_finding {
+  int kind;
+  struct ecu *ecu;
+  unsigned long case_id;
+  char *fuzz;
+  long long us;
+  long long avg;
+};
+char *oracle_kinds[ORACLE_KINDS] = { "TesterPresent stopped", "latency spike", "tester quiet" };
+int oracle_enabled = 0;
+FILE *oraclefp = NULL;
+__thread struct oracle_ecu *oracle_ecus;
+__thread struct oracle_finding *oracle_findings;
+__thread int oracle_finding_count = 0;
+__thread unsigned long oracle_findings_lost = 0;
+__thread struct ecu *oracle_last_ecu = NULL;  // Where the tester's last request went
+__thread long long oracle_req_us = 0;         // and when
+__thread long long oracle_gap_avg = 0;        // Between requests on this interface
+__thread unsigned long oracle_gap_samples = 0;
+__thread int oracle_quiet = 0;
+__thread unsigned long oracle_case = 0;       // Last answered case on this interface
+__thread char *oracle_fuzz = NULL;
+__thread long long oracle_checked_us = 0;
+__thread unsigned long case_id = 0;           // Frames received, the case numbers of -P
+__thread char *case_fuzz = NULL;              // Strategy used on the answer being built
+
+int oracle_bucket(long long us) {
+  int b = 0;
+  while(us > 1 && b < ORACLE_BUCKETS - 1) {
+    us >>= 1;
+    b++;
   }
+  return b;
 }
 
-void flow_control_push(int can) {
-  flow_control_push_to(can, 0x7e8);
+// Moving average over roughly the last eight samples
+void oracle_avg(long long *avg, unsigned long *samples, long long us) {
+  *avg = (*samples)++ ? *avg + (us - *avg) / 8 : us;
 }
 
-void isotp_send_to(int can, char *data, int size, int dest) {
-  struct canfd_frame frame;
-  int left = size;
-  int counter;
-  int nbytes;
-  if(size > 256) return;
-  frame.can_id = dest;
-  if(size < 7) {
-    frame.len = size + 1;
-    frame.data[0] = size;
-    memcpy(&frame.data[1], data, size);
-    nbytes = write(can, &frame, CAN_MTU);
-    if(nbytes < 0) perror("Write packet");
-  } else {
-    frame.len = 8;
-    frame.data[0] = 0x10;
-    if(fuzz_level > 2 && keep_spec == 0) {
-      frame.data[1] = rand() % 256;
-      printf("Breaking ISOTP specs real size = %d reported size = %d\n", size, frame.data[1]);
-    } else {
-      frame.data[1] = (char)size-1;
-    }
-    memcpy(&frame.data[2], data, 6);
-    nbytes = write(can, &frame, CAN_MTU);
-    if(nbytes < 0) perror("Write packet");
-    left -= 6;
-    counter = 0x21;
-    if(no_flow_control) {
-      while(left > 0) {
-        if(left > 7) {
-          frame.len = 8;
-          frame.data[0] = counter;
-          memcpy(&frame.data[1], data+(size-left), 7);
-          write(can, &frame, CAN_MTU);
-          counter++;
-          left -= 7;
-        } else {
-          frame.len = left + 1;
-          frame.data[0] = counter;
-          memcpy(&frame.data[1], data+(size-left), CAN_MTU);
-          write(can, &frame, frame.len);
-          left = 0;
-        }
-      }
-    } else { // FC
-      memcpy(gBuffer, data, size); // Size is restricted to <256
-      gBufSize = size;
-      gBufLengthRemaining = left;
-      gBufCounter = counter;
+void oracle_flag(int kind, struct ecu *ecu, unsigned long case_id, char *fuzz, long long us, long long avg) {
+  struct oracle_finding *f;
+  if(!fuzz) fuzz = fuzz_level ? "-z" : "none";
+  plog("Finding: %s on %s %s, %lld ms (usually %lld ms) after case %lu, fuzzed with %s\n", oracle_kinds[kind],
+       can_ifname, ecu ? ecu->name : "bus", us / 1000, avg / 1000, case_id, fuzz);
+  if(oraclefp) {
+    fprintf(oraclefp, "%ld\t%s\t%s\t%s\t%lu\t%s\t%lld\t%lld\n", (long)time(NULL), can_ifname,
+            ecu ? ecu->name : "bus", oracle_kinds[kind], case_id, fuzz, us / 1000, avg / 1000);
+    fflush(oraclefp);
+  }
+  if(oracle_finding_count == ORACLE_FINDINGS_MAX) {
+    oracle_findings_lost++;
+    return;
+  }
+  f = &oracle_findings[oracle_finding_count++];
+  f->kind = kind;
+  f->ecu = ecu;
+  f->case_id = case_id;
+  f->fuzz = fuzz;
+  f->us = us;
+  f->avg = avg;
+}
+
+// The tester asked ecu for sid
+void oracle_request(struct ecu *ecu, int sid) {
+  struct oracle_ecu *o = &oracle_ecus[ecu - ecus];
+  long long now = now_us(), us;
+  if(oracle_req_us) {
+    if(oracle_quiet && verbose) plog("Oracle: tester on %s is back after %lld ms\n", can_ifname, (now - oracle_req_us) / 1000);
+    oracle_avg(&oracle_gap_avg, &oracle_gap_samples, now - oracle_req_us);
+  }
+  oracle_quiet = 0;
+  oracle_req_us = now;
+  if(o->answer_us && oracle_last_ecu == ecu) {
+    us = now - o->answer_us;
+    o->lat_hist[oracle_bucket(us)]++;
+    if(o->lat_samples >= ORACLE_MIN_SAMPLES && us > ORACLE_SPIKE_MIN_US && us > o->lat_avg * ORACLE_SPIKE) {
+      oracle_flag(ORACLE_LATENCY, ecu, o->answer_case, o->answer_fuzz, us, o->lat_avg);
     }
+    oracle_avg(&o->lat_avg, &o->lat_samples, us);
   }
+  o->answer_us = 0;
+  oracle_last_ecu = ecu;
+  if(sid != UDS_SID_TESTER_PRESENT) return;
+  if(o->tp_us) {
+    us = now - o->tp_us;
+    o->tp_hist[oracle_bucket(us)]++;
+    oracle_avg(&o->tp_avg, &o->tp_samples, us);
+  }
+  o->tp_us = now;
+  o->tp_flagged = 0;
 }
 
-void isotp_send(int can, char *data, int size) {
-  isotp_send_to(can, data, size, 0x7e8);
+// Something went out for the request ecu just handled
+void oracle_answered(struct ecu *ecu) {
+  struct oracle_ecu *o = &oracle_ecus[ecu - ecus];
+  o->answer_us = now_us();
+  o->answer_case = case_id;
+  o->answer_fuzz = case_fuzz;
+  oracle_case = case_id;
+  oracle_fuzz = case_fuzz;
+}
+
+// The last frame of a multi-frame answer went out, the tester's
+// latency counts from here
+void oracle_answer_done(struct ecu *ecu) {
+  struct oracle_ecu *o = &oracle_ecus[ecu - ecus];
+  if(o->answer_us) o->answer_us = now_us();
+}
+
+// Looks for TesterPresent that stopped and a tester that went quiet
+void oracle_check() {
+  struct oracle_ecu *o;
+  long long now = now_us();
+  int i;
+  if(now - oracle_checked_us < ORACLE_CHECK_US) return;
+  oracle_checked_us = now;
+  for(i = 0; i < ecu_count; i++) {
+    o = &oracle_ecus[i];
+    if(o->tp_flagged || o->tp_samples < 3) continue;
+    if(now - o->tp_us > o->tp_avg * ORACLE_TP_LATE && now - o->tp_us > ORACLE_TP_MIN_US) {
+      oracle_flag(ORACLE_TP_MISSING, &ecus[i], oracle_case, oracle_fuzz, now - o->tp_us, o->tp_avg);
+      o->tp_flagged = 1;
+    }
+  }
+  if(oracle_quiet || oracle_gap_samples < ORACLE_MIN_SAMPLES) return;
+  if(now - oracle_req_us > oracle_gap_avg * ORACLE_SILENT && now - oracle_req_us > ORACLE_SILENT_MIN_US) {
+    oracle_flag(ORACLE_QUIET, NULL, oracle_case, oracle_fuzz, now - oracle_req_us, oracle_gap_avg);
+    oracle_quiet = 1;
+  }
+}
+
+// Findings grouped by kind and the strategy that preceded them
+void print_oracle_stats() {
+  struct oracle_finding *f, *g;
+  unsigned char done[ORACLE_FINDINGS_MAX];
+  struct oracle_ecu *o;
+  int i, j, b, n;
+  if(oracle_finding_count) plog("Oracle: %d findings\n", oracle_finding_count + (int)oracle_findings_lost);
+  memset(done, 0, sizeof(done));
+  for(i = 0; i < oracle_finding_count; i++) {
+    if(done[i]) continue;
+    f = &oracle_findings[i];
+    for(n = 0, j = i; j < oracle_finding_count; j++) {
+      g = &oracle_findings[j];
+      if(done[j] || g->kind != f->kind || strcmp(g->fuzz, f->fuzz)) continue;
+      done[j] = 1;
+      n++;
+    }
+    plog("  %4d x %s after %s, cases", n, oracle_kinds[f->kind], f->fuzz);
+    for(n = 0, j = i; j < oracle_finding_count && n < 8; j++) {
+      g = &oracle_findings[j];
+      if(g->kind != f->kind || strcmp(g->fuzz, f->fuzz)) continue;
+      plog(" %lu", g->case_id);
+      n++;
+    }
+    plog("%s\n", n == 8 ? " ..." : "");
+  }
+  if(!verbose) return;
+  for(i = 0; i < ecu_count; i++) {
+    o = &oracle_ecus[i];
+    if(!o->lat_samples && !o->tp_samples) continue;
+    plog("Oracle: %s latency %lld us average, TesterPresent every %lld us\n", ecus[i].name, o->lat_avg, o->tp_avg);
+    for(b = 0; b < ORACLE_BUCKETS; b++) {
+      if(o->lat_hist[b] || o->tp_hist[b]) plog("  < %8lld us: %u answers, %u TesterPresent\n", 2LL << b, o->lat_hist[b], o->tp_hist[b]);
+    }
+  }
 }
 
 /*
- * Some UDS queries requiest periodic data.  This handles those
+ * Response mutation
+ *
+ * With -M a share of all ISO-TP responses is mutated on the way out.
+ * mut_layouts[] describes each response well enough to lie with it:
+ * how long the header is, the size of repeated records, where a count
+ * or length field sits and which bytes echo the request (PID, DID,
+ * subfunction).  A strategy is picked by weight (-W) for every case,
+ * strategies that don't fit the layout fall back to a boundary value.
  */
-void handle_pending_data(int can) {
-  struct canfd_frame frame;
-  struct timeval tv;
-  long currcms;
-  int i, offset, datacnt;
-  if(!pending_data) return;
-
-  gettimeofday(&tv, NULL);
-  currcms = (tv.tv_sec - start_tv.tv_sec) * 100 + (tv.tv_usec / 10000);
-
-  if(IS_SET(pending_data, PENDING_READ_DATA_BY_ID_GM)) {
-        if(gm_data_by_id.data[0] == 0xFE) {
-          offset = 1;
-        } else {
-          offset = 0;
-        }
-        frame.can_id = gm_data_by_id.can_id;
-        frame.len = 8;
-        switch(gm_data_by_id.data[2 + offset]) { // Subfunctions
-          case 0x02:  // Slow Rate
-            if (currcms - gm_lastcms > 1000) {
-              for(i=3; i < gm_data_by_id.data[0]+1; i++) {
-                frame.data[0] = gm_data_by_id.data[i];
-                for(datacnt=1; datacnt < 8; datacnt++) {
-                  frame.data[datacnt] = rand() % 255;
-                }
-                write(can, &frame, CAN_MTU);
-                if(verbose > 1) plog("  + Sending GM data (%02X) at a slow rate\n", frame.data[0]);
-              }
-              gm_lastcms = currcms;
-            }
-            break;
-          case 0x03:  // Medium Rate
-            if (currcms - gm_lastcms > 100) {
-              for(i=3; i < gm_data_by_id.data[0]+1; i++) {
-                frame.data[0] = gm_data_by_id.data[i];
-                for(datacnt=1; datacnt < 8; datacnt++) {
-                  frame.data[datacnt] = rand() % 255;
-                }
-                write(can, &frame, CAN_MTU);
-                if(verbose > 1) plog("  + Sending GM data (%02X) at a medium rate\n", frame.data[0]);
-              }
-              gm_lastcms = currcms;
-            }
-            break;
-          case 0x04:  // Fast Rate
-            if (currcms - gm_lastcms > 20) {
-              for(i=3; i < gm_data_by_id.data[0]+1; i++) {
-                frame.data[0] = gm_data_by_id.data[i];
-                for(datacnt=1; datacnt < 8; datacnt++) {
-                  frame.data[datacnt] = rand() % 255;
-                }
-                write(can, &frame, CAN_MTU);
-                if(verbose > 1) plog("  + Sending GM data (%02X) at a fast rate\n", frame.data[0]);
-              }
-              gm_lastcms = currcms;
-            }
-            break;
-          default:
-            plog("Unknown subfunction timer\n");
-            break;
-        }
-  } // IS_SET PENDING_READ_DATA_BY_ID_GM
+#define MUT_BOUNDARY   0 // Boundary value in a random byte
+#define MUT_LENGTH     1 // Count or length field disagrees with the data
+#define MUT_TRUNCATE   2 // Cut off, in the middle of a record if there are any
+#define MUT_REPEAT     3 // Records (or the whole body) repeated
+#define MUT_ECHO       4 // Echoed PID/DID/subfunction changed
+#define MUT_NRC        5 // Negative response instead, or a different NRC
+#define MUT_SID        6 // Wrong response SID
+#define MUT_BITFLIP    7 // A few random bits flipped
+#define MUT_STRATEGIES 8
+
+struct mut_layout {
+  int sid;        // Response SID
+  int sub;        // Byte 1 has to match this, -1 for any
+  int header;     // Bytes before the first record
+  int record;     // Record size, 0 if the body is one opaque record
+  int count_off;  // Count or length field, -1 for none
+  int count_len;
+  int echo_off;   // Bytes echoed from the request, -1 for none
+  int echo_len;
+};
+struct mut_layout mut_layouts[] = {
+  { 0x7F, -1, 3, 0, -1, 0, 1, 1 }, // Negative response
+  { 0x41, -1, 2, 0, -1, 0, 1, 1 }, // OBD current data
+  { 0x43, -1, 2, 2, 1, 1, -1, 0 }, // OBD stored, pending and permanent DTCs
+  { 0x47, -1, 2, 2, 1, 1, -1, 0 },
+  { 0x4A, -1, 2, 2, 1, 1, -1, 0 },
+  { 0x49, 0x02, 3, 17, 2, 1, 1, 1 }, // VIN
+  { 0x49, -1, 2, 0, -1, 0, 1, 1 },
+  { 0x50, -1, 2, 2, -1, 0, 1, 1 }, // Session timings
+  { 0x59, UDS_DTC_REPORT_NUMBER_BY_MASK, 6, 0, 4, 2, 1, 1 },
+  { 0x59, -1, 3, 4, -1, 0, 1, 1 }, // DTC and status records
+  { 0x5A, -1, 2, 0, -1, 0, 1, 1 }, // GM DID
+  { 0x62, -1, 3, 0, -1, 0, 1, 2 }, // DID echo, then data
+  { 0x67, -1, 2, 0, -1, 0, 1, 1 }, // Security access seed
+  { 0x6E, -1, 3, 0, -1, 0, 1, 2 },
+  { 0x71, -1, 4, 0, -1, 0, 1, 3 }, // Routine control
+  { 0x74, -1, 2, 0, 1, 1, -1, 0 }, // Length format identifier
+  { 0x75, -1, 2, 0, 1, 1, -1, 0 },
+  { 0x76, -1, 2, 0, -1, 0, 1, 1 }, // Block sequence counter
+};
+struct mut_layout mut_layout_default = { 0, -1, 1, 0, -1, 0, -1, 0 };
+
+char *mut_names[MUT_STRATEGIES] = { "boundary", "length", "truncate", "repeat", "echo", "nrc", "sid", "bitflip" };
+int mut_weights[MUT_STRATEGIES] = { 4, 4, 3, 2, 2, 2, 1, 2 };
+int mut_weight_total = 20;
+int mutate_rate = 0;        // Percent of responses mutated
+unsigned char mut_boundaries[] = { 0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF };
+unsigned char mut_nrcs[] = { 0x10, 0x11, 0x12, 0x13, 0x14, 0x21, 0x22, 0x24, 0x31, 0x33, 0x35, 0x70, 0x72, 0x73, 0x78, 0x7E, 0x7F };
+__thread unsigned char *mut_buf;
+__thread unsigned long mut_counts[MUT_STRATEGIES];
+
+// Parses -W, e.g. "length=10,nrc=0", strategies not listed keep their weight
+int mut_set_weights(char *list) {
+  char *p, *end;
+  int i, len, total = 0;
+  for(p = list; p && *p; p = *end == ',' ? end + 1 : NULL) {
+    for(i = 0; i < MUT_STRATEGIES; i++) {
+      len = strlen(mut_names[i]);
+      if(!strncmp(p, mut_names[i], len) && p[len] == '=') break;
+    }
+    if(i == MUT_STRATEGIES) return -1;
+    mut_weights[i] = strtol(p + len + 1, &end, 10);
+    if(end == p + len + 1 || mut_weights[i] < 0 || (*end && *end != ',')) return -1;
+  }
+  for(i = 0; i < MUT_STRATEGIES; i++) total += mut_weights[i];
+  if(total == 0) return -1;
+  mut_weight_total = total;
+  return 0;
 }
 
-void send_dtcs(int can, char total, struct canfd_frame frame) {
-  char resp[1024];
-  char i;
-  memset(resp, 0, 1024);
-  switch(fuzz_level) {
-    case 0:  // Default is to make P01XX where XX = total number of DTCs
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = total; // Total DTCs
-      for(i = 0; i <= total*2; i+=2) {
-        resp[2+i] = 1;
-        resp[2+i+1] = i;
-      }
-      if(total == 0) {
-        isotp_send(can, resp, 2);
-      } else if (total < 3) {
-        isotp_send(can, resp, 2+(total*2));
-      } else {
-        isotp_send(can, resp, total*2);
-      }
+struct mut_layout *mut_layout_find(unsigned char *pdu, int size) {
+  struct mut_layout *l;
+  for(l = mut_layouts; l < mut_layouts + sizeof(mut_layouts) / sizeof(mut_layouts[0]); l++) {
+    if(l->sid != pdu[0]) continue;
+    if(l->sub >= 0 && (size < 2 || pdu[1] != l->sub)) continue;
+    return l;
+  }
+  return &mut_layout_default;
+}
+
+int mut_pick() {
+  int i, r = prng_below(mut_weight_total);
+  for(i = 0; r >= mut_weights[i]; i++) r -= mut_weights[i];
+  return i;
+}
+
+// Writes value into a big endian field of len bytes
+void mut_put(unsigned char *p, int len, unsigned int value) {
+  while(len-- > 0) {
+    p[len] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+unsigned int mut_get(unsigned char *p, int len) {
+  unsigned int value = 0;
+  while(len-- > 0) value = (value << 8) | *p++;
+  return value;
+}
+
+// Mutates size bytes of pdu into mut_buf, returns the new size
+int mutate_pdu(unsigned char *pdu, int size) {
+  struct mut_layout *l;
+  unsigned char *p = mut_buf;
+  unsigned int count, max;
+  int strategy, records, rec, rec_len, at, n, sid;
+  if(size < 1 || size > ISOTP_BUF_SIZE) return size;
+  sid = pdu[0];
+  if(pdu != mut_buf) memcpy(p, pdu, size);
+  l = mut_layout_find(p, size);
+  strategy = mut_pick();
+  records = size > l->header ? (l->record ? (size - l->header) / l->record : 1) : 0;
+  rec_len = l->record ? l->record : size - l->header;
+  if((strategy == MUT_LENGTH && (l->count_off < 0 || l->count_off + l->count_len > size)) ||
+     ((strategy == MUT_TRUNCATE || strategy == MUT_REPEAT) && records == 0) ||
+     (strategy == MUT_ECHO && (l->echo_off < 0 || l->echo_off + l->echo_len > size))) strategy = MUT_BOUNDARY;
+  mut_counts[strategy]++;
+  case_fuzz = mut_names[strategy];
+  switch(strategy) {
+    case MUT_BOUNDARY:
+      p[size > 1 ? 1 + prng_below(size - 1) : 0] = mut_boundaries[prng_below(sizeof(mut_boundaries))];
       break;
-    case 1:
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = rand() % 256;
-      if (verbose) plog("Randomized total DTCs to %d real DTCs %d\n", resp[1], total);
-      for(i = 0; i <= total*2; i+=2) {
-        resp[2+i] = 1;
-        resp[2+i+1] = i;
-      }
-      if(total == 0) {
-        isotp_send(can, resp, 2);
-      } else if (total < 3) {
-        isotp_send(can, resp, 2+(total*2));
-      } else {
-        isotp_send(can, resp, total*2);
+    case MUT_LENGTH:
+      count = mut_get(&p[l->count_off], l->count_len);
+      max = l->count_len >= 4 ? 0xFFFFFFFF : (1U << (l->count_len * 8)) - 1;
+      switch(prng_below(4)) {
+        case 0: count = 0; break;
+        case 1: count--; break;
+        case 2: count++; break;
+        default: count = max; break;
       }
+      mut_put(&p[l->count_off], l->count_len, count & max);
       break;
-    case 2:
-    default:
-      resp[0] = frame.data[1] + 0x40;
-      total = rand() % 128;
-      resp[1] = total;
-      if (verbose) plog("Randomized total DTCs to %d\n", resp[1]);
-      for(i = 0; i <= total*2; i+=2) {
-        resp[2+i] = rand() % 256;
-        resp[2+i+1] = rand() % 256;
-      }
-      if (verbose) {
-        plog("DTC random data is:\n");
-        print_bin(&resp[2], total*2);
+    case MUT_TRUNCATE:
+      rec = prng_below(records);
+      size = l->header + rec * rec_len + (rec_len > 1 ? prng_below(rec_len - 1) + 1 : 0);
+      break;
+    case MUT_REPEAT:
+      rec = prng_below(records);
+      at = l->header + rec * rec_len;
+      n = 1 + prng_below(16);
+      if(size + n * rec_len > ISOTP_MAX_PDU) n = (ISOTP_MAX_PDU - size) / rec_len;
+      if(n < 1) break;
+      memmove(&p[at + (n + 1) * rec_len], &p[at + rec_len], size - at - rec_len);
+      for(rec = 1; rec <= n; rec++) memcpy(&p[at + rec * rec_len], &p[at], rec_len);
+      size += n * rec_len;
+      // Keep the count honest, the repeats are the point here
+      if(l->record && l->count_off >= 0) mut_put(&p[l->count_off], l->count_len, mut_get(&p[l->count_off], l->count_len) + n);
+      break;
+    case MUT_ECHO:
+      p[l->echo_off + prng_below(l->echo_len)] ^= 1 + prng_below(255);
+      break;
+    case MUT_NRC:
+      if(p[0] != 0x7F) {
+        p[1] = p[0] & ~0x40;
+        p[0] = 0x7F;
       }
-      if(total == 0) {
-        isotp_send(can, resp, 2);
-      } else if (total < 3) {
-        isotp_send(can, resp, 2+(total*2));
-      } else {
-        isotp_send(can, resp, total*2);
+      p[2] = prng_below(4) ? mut_nrcs[prng_below(sizeof(mut_nrcs))] : (unsigned char)prng_next();
+      size = 3;
+      break;
+    case MUT_SID:
+      p[0] = prng_below(2) ? p[0] & ~0x40 : (unsigned char)prng_next();
+      break;
+    case MUT_BITFLIP:
+      for(n = 1 + prng_below(4); n > 0; n--) p[prng_below(size)] ^= 1 << prng_below(8);
+      break;
+  }
+  if(verbose) plog("Mutated %02X response (%s), %d bytes\n", sid, mut_names[strategy], size);
+  return size;
+}
+
+/*
+ * Transport fuzzing
+ *
+ * With -T a share of ISO-TP messages is broken at the frame level.  The
+ * consecutive frames of a fuzzed message are built up front, mutations
+ * included, into the session's slot of tp_trains[] and handed to the
+ * session as prebuilt frames, so isotp_push_block() only copies them
+ * into the TX vector and a fuzzed transfer goes out as fast as a clean
+ * one.
+ */
+#define TP_SN          0 // Wrong sequence number
+#define TP_SKIP        1 // A consecutive frame left out
+#define TP_DUP         2 // A consecutive frame sent twice
+#define TP_REORDER     3 // Two consecutive frames swapped
+#define TP_CROSS       4 // Frames sent under another ECU's response ID
+#define TP_SF_LONG     5 // Single frame claims more data than it carries
+#define TP_ESCAPE      6 // Escape length where none is needed, or a wrong one
+#define TP_FC          7 // Bogus flow control for the tester's requests
+#define TP_STRATEGIES  8
+#define TP_TRAIN_MAX   768 // Consecutive frames, longer messages go out unfuzzed
+
+char *tp_names[TP_STRATEGIES] = { "sn", "skip", "dup", "reorder", "cross", "sf-long", "escape", "fc" };
+int tp_rate = 0;            // Percent of ISO-TP messages broken
+__thread struct canfd_frame (*tp_trains)[TP_TRAIN_MAX];
+__thread unsigned long tp_counts[TP_STRATEGIES];
+
+int tp_roll() {
+  return tp_rate && (int)prng_below(100) < tp_rate;
+}
+
+// A 32 bit length that is wrong for size bytes
+uint32_t tp_bad_len(uint32_t size) {
+  switch(prng_below(4)) {
+    case 0: return size + 1;
+    case 1: return size - 1;
+    case 2: return prng_below(8); // Would have fit a single frame
+    default: return 0xFFFFFFFF;
+  }
+}
+
+// Breaks a single frame that is already in the TX vector
+void tp_single(struct canfd_frame *frame, char *data, int size, int ext) {
+  int pci = ext >= 0 ? 1 : 0;
+  int strategy = prng_below(2) ? TP_SF_LONG : TP_ESCAPE;
+  if(strategy == TP_ESCAPE && size > CAN_MAX_DLEN - 2 - pci) strategy = TP_SF_LONG;
+  tp_counts[strategy]++;
+  case_fuzz = tp_names[strategy];
+  if(strategy == TP_SF_LONG) {
+    if(frame->data[pci]) frame->data[pci] = size + 1 + prng_below(15 - size); // Up to 0xF, 8+ is invalid
+    else frame->data[pci + 1] = prng_below(2) ? size + 1 : 0xFF;
+  } else {
+    // CAN FD style escape (00 length) on a frame that didn't need it
+    memmove(&frame->data[pci + 2], data, size);
+    frame->data[pci] = 0;
+    frame->data[pci + 1] = prng_below(2) ? size : (int)(tp_bad_len(size) & 0xFF);
+    frame->len = pci + 2 + size;
+  }
+  if(verbose) plog("ISOTP fuzz: %s single frame to %03X\n", tp_names[strategy], frame->can_id);
+}
+
+// Builds the consecutive frames of a session into its train and breaks
+// them.  ff is the first frame, already in the TX vector, and first the
+// payload it carries.  Returns the size to start the session with, a
+// train of n frames is sent as first + n frames worth of data.
+int tp_train(struct isotp_session *sess, struct canfd_frame *ff, int size, int *first) {
+  struct canfd_frame *train = tp_trains[sess - isotp_sessions];
+  struct canfd_frame tmp;
+  int pci = sess->ext >= 0 ? 1 : 0;
+  int per_cf = isotp_dl() - 1 - pci;
+  int strategy, offset, chunk, n, k, i, other = -1;
+  uint32_t len = size;
+  strategy = prng_below(6);
+  if(strategy == TP_SF_LONG) strategy = TP_ESCAPE;
+  // Messages too long for a train go out untouched, so check before
+  // anything is changed or counted
+  n = strategy == TP_ESCAPE ? isotp_dl() - pci - 6 : *first;
+  if((size - n + per_cf - 1) / per_cf > TP_TRAIN_MAX - 1) return size;
+  if(strategy == TP_ESCAPE) {
+    // Redo the first frame with a 32 bit length, true or not
+    if(prng_below(2)) len = tp_bad_len(size);
+    ff->data[pci] = 0x10;
+    ff->data[pci + 1] = 0;
+    ff->data[pci + 2] = (len >> 24) & 0xFF;
+    ff->data[pci + 3] = (len >> 16) & 0xFF;
+    ff->data[pci + 4] = (len >> 8) & 0xFF;
+    ff->data[pci + 5] = len & 0xFF;
+    memcpy(&ff->data[pci + 6], sess->src, isotp_dl() - pci - 6);
+    *first = isotp_dl() - pci - 6;
+  }
+  tp_counts[strategy]++;
+  case_fuzz = tp_names[strategy];
+  if(verbose) plog("ISOTP fuzz: %s in %d byte message to %03X\n", tp_names[strategy], size, sess->tx_id);
+  for(n = 0, offset = *first; offset < size; n++, offset += chunk) {
+    chunk = size - offset < per_cf ? size - offset : per_cf;
+    memset(&train[n], 0, sizeof(struct canfd_frame));
+    train[n].can_id = sess->tx_id;
+    isotp_fill_cf(&train[n], sess->src + offset, chunk, n + 1, sess->ext);
+  }
+  k = prng_below(n);
+  switch(strategy) {
+    case TP_SN:
+      train[k].data[pci] = 0x20 | ((k + 2 + prng_below(15)) & 0x0F);
+      break;
+    case TP_SKIP:
+      if(n < 2) break;
+      memmove(&train[k], &train[k + 1], (n - k - 1) * sizeof(struct canfd_frame));
+      n--;
+      break;
+    case TP_DUP:
+      memmove(&train[k + 1], &train[k], (n - k) * sizeof(struct canfd_frame));
+      n++;
+      break;
+    case TP_REORDER:
+      if(n < 2) break;
+      if(k == n - 1) k--;
+      tmp = train[k];
+      train[k] = train[k + 1];
+      train[k + 1] = tmp;
+      break;
+    case TP_CROSS:
+      // Interleave with the stream of another ECU
+      for(i = prng_below(ecu_count); other < 0 && i < ecu_count * 2; i++) {
+        if(ecus[i % ecu_count].resp_id && ecus[i % ecu_count].resp_id != sess->tx_id) other = ecus[i % ecu_count].resp_id;
       }
+      if(other < 0) break;
+      for(i = k; i < n && i < k + 1 + (int)prng_below(4); i++) train[i].can_id = other;
       break;
   }
+  sess->cfs = train;
+  return *first + n * per_cf;
 }
 
-unsigned char calc_vin_checksum(char *vin, int size) {
-  char w[17] = { 8, 7, 6, 5, 4, 3, 2, 10, 0, 9, 8, 7, 6, 5, 4, 3, 2 };
+// Replaces a flow control frame we are about to send with a bogus one
+void tp_fc(struct canfd_frame *frame) {
+  static unsigned char stmins[] = { 0x7F, 0x80, 0xF0, 0xFA, 0xFF };
+  tp_counts[TP_FC]++;
+  // Nothing is dispatched for a first frame, so the FC is the answer to its case
+  oracle_case = case_id;
+  oracle_fuzz = tp_names[TP_FC];
+  switch(prng_below(5)) {
+    case 0: frame->data[0] = 0x30 | (3 + prng_below(13)); break; // Reserved flow status
+    case 1: frame->data[0] = 0x30 | (prng_below(2) ? ISOTP_FC_WAIT : ISOTP_FC_OVERFLOW); break;
+    case 2: frame->data[1] = prng_below(2) ? 1 : 0xFF; break;
+    case 3: frame->data[2] = stmins[prng_below(sizeof(stmins))]; break;
+    default: frame->len = 1 + prng_below(2); break;
+  }
+  if(verbose) plog("ISOTP fuzz: FC to %03X is %02X %02X %02X (%d bytes)\n", frame->can_id,
+                   frame->data[0], frame->data[1], frame->data[2], frame->len);
+}
+
+/*
+ * Transmit path
+ *
+ * Frames are built in place in the preallocated tx_frames vector with
+ * tx_frame() and pushed out with a single sendmmsg() by tx_flush().
+ * tx_flush() keeps going after partial sends and on ENOBUFS (device
+ * queue full) moves the unsent tail to the backlog with a growing backoff
+ * instead of sleeping in the loop thread or dropping it.  Until the
+ * backlog is out everything else sent queues up behind it, so no frame
+ * overtakes one that was flushed before it.
+ */
+void tx_init() {
   int i;
-  int checksum = 0;
-  int num;
-  for(i=0; i < size; i++) {
-    if(vin[i] == 'I' || vin[i] == 'O' || vin[i] == 'Q') {
-      num = 0;
+  memset(tx_msgs, 0, TX_BATCH_MAX * sizeof(struct mmsghdr));
+  for(i = 0; i < TX_BATCH_MAX; i++) {
+    tx_iov[i].iov_base = &tx_frames[i];
+    tx_iov[i].iov_len = CAN_MTU;
+    tx_msgs[i].msg_hdr.msg_iov = &tx_iov[i];
+    tx_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+// CAN FD frames only come in a few sizes, pads a frame up to the next one
+void canfd_pad(struct canfd_frame *frame) {
+  static const unsigned char sizes[] = { 12, 16, 20, 24, 32, 48, 64 };
+  int i;
+  if(frame->len <= CAN_MAX_DLEN) return;
+  for(i = 0; frame->len > sizes[i]; i++);
+  memset(&frame->data[frame->len], 0xCC, sizes[i] - frame->len);
+  frame->len = sizes[i];
+}
+
+// Returns the next free frame in the TX vector or NULL if it is full
+struct canfd_frame *tx_frame(int id) {
+  struct canfd_frame *frame;
+  if(tx_count >= TX_BATCH_MAX) return NULL;
+  frame = &tx_frames[tx_count++];
+  memset(frame, 0, sizeof(struct canfd_frame));
+  frame->can_id = id;
+  return frame;
+}
+
+// Sends as much of the TX vector as the device takes right now without
+// waiting.  Returns the number of frames that made it out, the rest are
+// taken off the vector (but stay in tx_frames) and the reason is left
+// in tx_errno.
+int tx_flush_once(int can) {
+  int sent = 0;
+  int n, queued = tx_count;
+  tx_errno = 0;
+  if(rcache_capturing) {
+    rcache_capture_frames(queued);
+    tx_count = 0;
+    return queued;
+  }
+  for(n = 0; n < queued; n++) {
+    if(can_fd) {
+      canfd_pad(&tx_frames[n]);
+      tx_frames[n].flags |= CANFD_BRS;
+      tx_iov[n].iov_len = CANFD_MTU;
     } else {
-      if(vin[i] >= '0' && vin[i] <='9') num = vin[i] - '0';
-      if(vin[i] >= 'A' && vin[i] <='I') num = (vin[i] - 'A') + 1;
-      if(vin[i] >= 'J' && vin[i] <='R') num = (vin[i] - 'J') + 1;
-      if(vin[i] >= 'S' && vin[i] <='Z') num = (vin[i] - 'S') + 2;
+      tx_iov[n].iov_len = CAN_MTU;
     }
-    checksum += num * w[i];
   }
-  checksum = checksum % 11;
-  if (checksum == 10) return 'X';
-  return ('0' + checksum);
+  while(sent < queued) {
+    n = sendmmsg(can, &tx_msgs[sent], queued - sent, 0);
+    tx_syscalls++;
+    if(n < 0) {
+      tx_errno = errno;
+      if(errno == EINTR) continue;
+      if(errno != ENOBUFS && errno != EAGAIN) perror("sendmmsg");
+      break;
+    }
+    sent += n;
+  }
+  if(recfp && sent) rec_frames(tx_frames, sent, 1);
+  tx_sent += sent;
+  tx_count = 0;
+  return sent;
 }
 
-void send_error_snfs(int can, struct canfd_frame frame) {
-  char resp[4];
-  if(verbose) plog("Responded with Sub Function Not Supported\n");
-  resp[0] = 0x7f;
-  resp[1] = frame.data[1];
-  resp[2] = 12; // SubFunctionNotSupported
-  isotp_send(can, resp, 3);
+// Appends count frames of tx_frames from first on to the backlog,
+// returns how many fit
+int tx_backlog_add(int first, int count) {
+  int n;
+  for(n = 0; n < count && tx_backlog_len < TX_DEFER_MAX; n++) {
+    memcpy(&tx_backlog[(tx_backlog_head + tx_backlog_len++) % TX_DEFER_MAX], &tx_frames[first + n], sizeof(struct canfd_frame));
+  }
+  if(n < count) tx_defer_full += count - n;
+  return n;
 }
 
-void send_error_roor(int can, struct canfd_frame frame, int id) {
-  char resp[4];
-  if(verbose) plog("Responded with Sub Function Not Supported\n");
-  resp[0] = 0x7f;
-  resp[1] = frame.data[1];
-  resp[2] = 31; // RequestOutOfRange
-  isotp_send_to(can, resp, 3, id);
+// Backs off after ENOBUFS, returns -1 once it's time to give up
+int tx_backlog_retry() {
+  if(tx_backoff >= TX_RETRIES) return -1;
+  tx_backlog_due = now_us() + (TX_BACKOFF_US << (tx_backoff < 6 ? tx_backoff : 6));
+  tx_backoff++;
+  tx_retries++;
+  return 0;
 }
 
-void generic_OK_resp(int can, struct canfd_frame frame) {
-  char resp[4];
-  if(verbose > 1) plog("Responding with a generic OK message\n");
-  resp[0] = frame.data[1] + 0x40;
-  resp[1] = frame.data[2];
-  resp[2] = 0;
-  isotp_send(can, resp, 3);
+// Sends the TX vector.  If the device queue is full the tail goes to the
+// backlog to be tried again once it had time to drain, and while there
+// is a backlog new frames join it instead of going out ahead of it.
+// Returns the number of frames sent or queued.
+int tx_flush(int can) {
+  int queued = tx_count;
+  int sent, n;
+  if(tx_backlog_len && !rcache_capturing) {
+    tx_count = 0;
+    n = tx_backlog_add(0, queued);
+  } else {
+    sent = tx_flush_once(can);
+    n = sent;
+    if(sent) tx_backoff = 0;
+    if(sent < queued && (tx_errno == ENOBUFS || tx_errno == EAGAIN) && tx_backlog_retry() == 0) {
+      n += tx_backlog_add(sent, queued - sent);
+    }
+  }
+  if(n < queued) {
+    tx_dropped += queued - n;
+    plog("TX: dropped %d of %d frames\n", queued - n, queued);
+  }
+  return n;
 }
 
-void generic_OK_resp_to(int can, struct canfd_frame frame, int id) {
-  char resp[4];
-  if(verbose > 1) plog("Responding with a generic OK message\n");
-  resp[0] = frame.data[1] + 0x40;
-  resp[1] = frame.data[2];
-  resp[2] = 0;
-  isotp_send_to(can, resp, 3, id);
+// Queues a copy of frame and sends it right away
+int tx_send_frame(int can, struct canfd_frame *frame) {
+  struct canfd_frame *out;
+  if(tx_count >= TX_BATCH_MAX) tx_flush(can);
+  out = tx_frame(frame->can_id);
+  memcpy(out, frame, sizeof(struct canfd_frame));
+  return tx_flush(can) == 1 ? 0 : -1;
 }
 
-void handle_current_data(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received Current info request\n");
-  char resp[8];
-  switch(frame.data[2]) {
-    case 0x00: // Supported PIDs
-      if(verbose) plog("Responding with a generic set of PIDs (1-20)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x01: // MIL & DTC Status
-      if(verbose) plog("Responding to MIL and DTC Status request\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0x00;
-      resp[3] = 0x07;
-      resp[4] = 0xE5;
-      resp[5] = 0xE5;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x20: // More supported PIDs (21-40)
-      if(verbose) plog("Responding with PIDs supported (21-40)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x40: // More supported PIDs (41-60)
-      if(verbose) plog("Responding with PIDs supported (41-60)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x41: // Monitor status this drive cycle
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0;
-      resp[3] = 0x0F;
-      resp[4] = 0xFF;
-      resp[5] = 0x00;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x60: // More supported PIDs (61-80)
-      if(verbose) plog("Responding with PIDs supported (61-80)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x80: // More supported PIDs (81-100)
-      if(verbose) plog("Responding with PIDs supported (81-100)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0xA0:  // More Supported PIDs (101-120)
-      if(verbose) plog("Responding with PIDs supported (101-120)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    case 0xC0: // More supported PIDs (121-140)
-      if(verbose) plog("Responding with PIDs supported (121-140)\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0xBF;
-      resp[3] = 0xBF;
-      resp[4] = 0xB9;
-      resp[5] = 0x93;
-      isotp_send(can, resp, 6);
-      break;
-    default:
-      if(verbose) plog("Note: Requested unsupported service %02X\n", frame.data[2]);
-      break;
+void print_tx_stats() {
+  int i;
+  plog("TX: %lu frames in %lu sendmmsg calls", tx_sent, tx_syscalls);
+  if(tx_retries) plog(", %lu ENOBUFS retries", tx_retries);
+  if(tx_dropped) plog(", %lu dropped", tx_dropped);
+  if(tx_defer_full) plog(", %lu not deferred (queue full)", tx_defer_full);
+  plog("\n");
+  if(mutate_rate) {
+    plog("Mutations:");
+    for(i = 0; i < MUT_STRATEGIES; i++) plog(" %s %lu", mut_names[i], mut_counts[i]);
+    plog("\n");
+  }
+  if(tp_rate) {
+    plog("ISOTP fuzzing:");
+    for(i = 0; i < TP_STRATEGIES; i++) plog(" %s %lu", tp_names[i], tp_counts[i]);
+    plog("\n");
   }
+  if(rcache_enabled) plog("Response cache: %lu hits, %lu misses (%d answers cached)\n", rcache_hits, rcache_misses, rcache_count);
+  if(isotp_backend == ISOTP_KERNEL) {
+    plog("ISOTP (kernel): %lu requests, %lu responses with %lu bytes", isotp_kernel_pdus_rx, isotp_kernel_pdus_tx, isotp_tx_bytes);
+    if(isotp_kernel_busy) plog(", %lu dropped while busy", isotp_kernel_busy);
+    plog("\n");
+  }
+  if(!isotp_tx_frames) return;
+  plog("ISOTP (%s): %lu bytes in %lu frames (%.1f bytes/frame)", can_fd ? "CAN FD" : "classic",
+       isotp_tx_bytes, isotp_tx_frames, (double)isotp_tx_bytes / isotp_tx_frames);
+  if(isotp_tx_us) plog(", %lu multi-frame messages at %.0f bytes/s", isotp_tx_msgs,
+                       (double)isotp_tx_bytes * 1000000 / isotp_tx_us);
+  plog("\n");
 }
 
-void handle_vehicle_info(int can, struct canfd_frame frame) {
-  char *buf;
-  int pktsize = 0;
-  unsigned char chksum;
-  if(verbose) plog("Received Vehicle info request\n");
-  char resp[300];
-  switch(frame.data[2]) {
-    case 0x00: // Supported PIDs
-      if(verbose) plog("Replying with ALL Pids supported\n");
-      resp[0] = frame.data[1] + 0x40;
-      resp[1] = frame.data[2];
-      resp[2] = 0x55;
-      resp[3] = 0;
-      resp[4] = 0;
-      resp[5] = 0;
-      isotp_send(can, resp, 6);
-      break;
-    case 0x02: // Get VIN
-      switch(fuzz_level) {
-        case 0:
-          if(verbose) plog("Sending VIN %s\n", vin);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          memcpy(&resp[3], vin, strlen(vin));
-          isotp_send(can, resp, 4 + strlen(vin));
-          break;
-        case 1:
-          if(verbose) plog("Fuzzing VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_ALPHANUM, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) plog("Using VIN: %s\n", buf);
-          memcpy(&resp[3], buf, 17);
-          free(buf);
-          isotp_send(can, resp, 4 + 17);
-          break;
-        case 2:
-        case 3:  // At 3 the ISOTP spec gets flaky
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing big VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_ALPHANUM, pktsize);
-          chksum = calc_vin_checksum(buf, pktsize);
-          buf[8] = chksum;
-          if(verbose) plog("Using big VIN (%d chars): %s\n",pktsize, buf);
-          memcpy(&resp[3], buf, pktsize);
-          free(buf);
-          isotp_send(can, resp, 4 + pktsize);
-          break;
-        case 4:
-          if(verbose) plog("Fuzzing VIN with binary data\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_BINARY, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) print_bin(buf, 17);
-          memcpy(&resp[3], buf, 17);
-          free(buf);
-          isotp_send(can, resp, 4 + 17);
-          break;
-        case 5:
-        default:
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 1;
-          buf = gen_data(DATA_BINARY, pktsize);
-          if(verbose) print_bin(buf, pktsize);
-          memcpy(&resp[3], buf, pktsize);
-          free(buf);
-          isotp_send(can, resp, 4 + pktsize);
-          break;
-      }
-      break;
-    default:
-      break;
+/*
+ * Deferred transmit queue
+ *
+ * Handlers that want frames to go out later put them here and return
+ * right away.  The TX timer fires when the earliest one is due and
+ * everything due by then is sent as one batch.
+ */
+int defer_before(struct deferred_frame *a, struct deferred_frame *b) {
+  if(a->due_us != b->due_us) return a->due_us < b->due_us;
+  return a->seq < b->seq;
+}
+
+void defer_swap(int a, int b) {
+  struct deferred_frame tmp;
+  memcpy(&tmp, &tx_defer_heap[a], sizeof(tmp));
+  memcpy(&tx_defer_heap[a], &tx_defer_heap[b], sizeof(tmp));
+  memcpy(&tx_defer_heap[b], &tmp, sizeof(tmp));
+}
+
+int defer_push(struct canfd_frame *frame, long long due_us, struct ecu *ecu) {
+  int i, parent;
+  if(rcache_capturing) {
+    rcache_cap->bad = 1; // Answers spread over time aren't cached
+    return 0;
   }
+  if(tx_defer_count >= TX_DEFER_MAX) {
+    tx_defer_full++;
+    return -1;
+  }
+  i = tx_defer_count++;
+  tx_defer_heap[i].due_us = due_us;
+  tx_defer_heap[i].seq = tx_defer_seq++;
+  tx_defer_heap[i].ecu = ecu;
+  memcpy(&tx_defer_heap[i].frame, frame, sizeof(struct canfd_frame));
+  while(i > 0) {
+    parent = (i - 1) / 2;
+    if(!defer_before(&tx_defer_heap[i], &tx_defer_heap[parent])) break;
+    defer_swap(i, parent);
+    i = parent;
+  }
+  return 0;
 }
 
-void handle_pending_codes(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for pending trouble codes\n");
-  send_dtcs(can, 20, frame);
+// Schedules a copy of frame to be sent at due_us.  Returns -1 if the
+// queue is full.
+int tx_defer(struct canfd_frame *frame, long long due_us) {
+  return defer_push(frame, due_us, NULL);
 }
 
-void handle_stored_codes(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for stored trouble codes\n");
-  send_dtcs(can, 2, frame);
+// Schedules a single frame request to be handled by ecu at due_us
+int tx_defer_request(struct ecu *ecu, struct canfd_frame *frame, long long due_us) {
+  return defer_push(frame, due_us, ecu);
 }
 
-// TODO: This is wrong.  Record a real transaction to see the format
-void handle_freeze_frame(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for freeze frame code\n");
-  //send_dtcs(can, 1, frame);
-  char resp[4];
-  resp[0] = frame.data[1] + 0x40;
-  resp[1] = 0x01;
-  resp[2] = 0x01;
-  isotp_send(can, resp, 3);
+void tx_defer_pop() {
+  int i = 0, child;
+  tx_defer_count--;
+  if(tx_defer_count == 0) return;
+  memcpy(&tx_defer_heap[0], &tx_defer_heap[tx_defer_count], sizeof(struct deferred_frame));
+  while((child = 2 * i + 1) < tx_defer_count) {
+    if(child + 1 < tx_defer_count && defer_before(&tx_defer_heap[child + 1], &tx_defer_heap[child])) child++;
+    if(!defer_before(&tx_defer_heap[child], &tx_defer_heap[i])) break;
+    defer_swap(i, child);
+    i = child;
+  }
 }
 
-void handle_perm_codes(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received request for permanent trouble codes\n");
-  send_dtcs(can, 0, frame);
+// When the next deferred frame or the backlog is due, 0 if there is none
+long long tx_defer_next() {
+  long long next = tx_defer_count ? tx_defer_heap[0].due_us : 0;
+  if(tx_backlog_len && (!next || tx_backlog_due < next)) next = tx_backlog_due;
+  return next;
 }
 
-void handle_dsc(int can, struct canfd_frame frame) {
-  //if(verbose) plog("Received DSC Request\n");
-  //send_error_snfs(can, frame);
-  if(verbose) plog("Received DSC Request giving VCDS respose\n");
-      frame.can_id = 0x77A;
-      frame.len = 8;
-      frame.data[0] = 0x06;
-      frame.data[1] = 0x50;
-      frame.data[2] = 0x03;
-      frame.data[3] = 0x00;
-      frame.data[4] = 0x32;
-      frame.data[5] = 0x01;
-      frame.data[6] = 0xF4;
-      frame.data[7] = 0xAA;
-      write(can, &frame, CAN_MTU);
+// Sends the backlog in order, as much of it as the device takes
+void tx_backlog_send(int can) {
+  int n, sent;
+  if(tx_count > 0) tx_flush(can);
+  while(tx_backlog_len) {
+    for(n = 0; n < tx_backlog_len && n < TX_BATCH_MAX; n++) {
+      memcpy(&tx_frames[n], &tx_backlog[(tx_backlog_head + n) % TX_DEFER_MAX], sizeof(struct canfd_frame));
+    }
+    tx_count = n;
+    sent = tx_flush_once(can);
+    tx_backlog_head = (tx_backlog_head + sent) % TX_DEFER_MAX;
+    tx_backlog_len -= sent;
+    if(sent) tx_backoff = 0;
+    if(sent == n) continue;
+    if((tx_errno == ENOBUFS || tx_errno == EAGAIN) && tx_backlog_retry() == 0) return;
+    tx_dropped += tx_backlog_len;
+    plog("TX: dropped %d backlogged frames\n", tx_backlog_len);
+    tx_backlog_len = 0;
+  }
 }
 
-/*
-  ECU Memory, based on VCDS response for now
-*/
-void handle_read_data_by_id(int can, struct canfd_frame frame) {
-  if(verbose) plog("Recieved Read Data by ID %02X %02X\n", frame.data[2], frame.data[3]);
-  char resp[120];
-  if(frame.data[2] == 0xF1) {
-    switch(frame.data[3]) {
-     case 0x87:
-       if(verbose) plog("Read data by ID 0x87\n");
-       resp[0] = frame.data[1] + 0x40;
-       resp[1] = frame.data[2];
-       resp[2] = 0x87;
-       resp[3] = 0x30;
-       resp[4] = 0x34;
-       resp[5] = 0x45;
-       resp[6] = 0x39;
-       resp[7] = 0x30;
-       resp[8] = 0x36;
-       resp[9] = 0x33;
-       resp[10] = 0x32;
-       resp[11] = 0x33;
-       resp[12] = 0x46;
-       resp[13] = 0x20; // Note VCDS pads with 55's
-       isotp_send_to(can, resp, 14, 0x77A);
-       break;
-      case 0x89:
-          if(verbose) plog("Read data by ID 0x89\n");
-          frame.can_id = 0x7E8;
-          frame.len = 8;
-          frame.data[0] = 0x07;
-          frame.data[1] = 0x62;
-          frame.data[2] = 0xF1;
-          frame.data[3] = 0x89;
-          frame.data[4] = 0x38; //8
-          frame.data[5] = 0x34; //4
-          frame.data[6] = 0x31; //1
-          frame.data[7] = 0x30; //0
-          write(can, &frame, CAN_MTU);
-        break;
-      case 0x9E:
-        if(verbose) plog("Read data by ID 0x9E\n");
-        resp[0] = frame.data[1] + 0x40;
-        resp[1] = frame.data[2];
-        resp[2] = 0x45; 
-        resp[3] = 0x56;
-        resp[4] = 0x5F;
-        resp[5] = 0x47;
-        resp[6] = 0x61;
-        resp[7] = 0x74;
-        resp[8] = 0x65;
-        resp[9] = 0x77;
-        resp[10] = 0x45;
-        resp[11] = 0x56;
-        resp[12] = 0x43;
-        resp[13] = 0x6F;
-        resp[14] = 0x6E;
-        resp[15] = 0x74;
-        resp[16] = 0x69;
-        resp[17] = 0x00;
-        isotp_send(can, resp, 0x13);
-        break;
-      case 0xA2: 
-        if(verbose) plog("Read data by ID 0xA2\n");
-        resp[0] = frame.data[1] + 0x40;
-        resp[1] = frame.data[2];
-        resp[2] = 0xA2;
-        resp[3] = 0x30; // 004010
-        resp[4] = 0x30;
-        resp[5] = 0x34;
-        resp[6] = 0x30;
-        resp[7] = 0x31;
-        resp[8] = 0x30;
-        isotp_send(can, resp, 9);
-        break;
-     default:
-        if(verbose) plog("Not responding to ID %02X\n", frame.data[3]);
-        break;
-     }
-  } else if(frame.data[2] == 0x06) {
-    switch(frame.data[3]) {
-     case 0x00:
-        if(verbose) plog("Read data by ID 0x9E\n");
-        resp[0] = frame.data[1] + 0x40;
-        resp[1] = frame.data[2];
-        resp[2] = 0x02; 
-        resp[3] = 0x01;
-        resp[4] = 0x00;
-        resp[5] = 0x17;
-        resp[6] = 0x26;
-        resp[7] = 0xF2;
-        resp[8] = 0x00;
-        resp[9] = 0x00;
-        resp[10] = 0x5B;
-        resp[11] = 0x00;
-        resp[12] = 0x12;
-        resp[13] = 0x08;
-        resp[14] = 0x58;
-        resp[15] = 0x00;
-        resp[16] = 0x00;
-        resp[17] = 0x00;
-        resp[18] = 0x00;
-        resp[19] = 0x01;
-        resp[20] = 0x01;
-        resp[21] = 0x01;
-        resp[22] = 0x00;
-        resp[23] = 0x01;
-        resp[24] = 0x00;
-        resp[25] = 0x00;
-        resp[26] = 0x00;
-        resp[27] = 0x00;
-        resp[28] = 0x00;
-        resp[29] = 0x00;
-        resp[30] = 0x00;
-        resp[31] = 0x00;
-        isotp_send(can, resp, 0x21);
-       break;
-     case 0x01:
-          if(verbose) plog("Read data by ID 0x01\n");
-          send_error_roor(can, frame, 0x7E8);
-       break;
-     default:
-       if(verbose) plog("Not responding to ID %02X\n", frame.data[3]);
-       break;
-     }
-  } else {
-    if(verbose) plog("Unknown read data by ID %02X\n", frame.data[2]);
+// Sends every deferred frame and runs every deferred request that is due
+void tx_defer_service(int can) {
+  struct canfd_frame *out;
+  struct deferred_frame req;
+  long long now = now_us();
+  if(tx_backlog_len && tx_backlog_due <= now) tx_backlog_send(can);
+  if(!tx_defer_count || tx_defer_heap[0].due_us > now) return;
+  if(tx_count > 0) tx_flush(can);
+  while(tx_defer_count && tx_defer_heap[0].due_us <= now) {
+    if(tx_defer_heap[0].ecu) {
+      memcpy(&req, &tx_defer_heap[0], sizeof(req));
+      tx_defer_pop();
+      cur_req.id = req.frame.can_id;
+      cur_req.data = &req.frame.data[1];
+      cur_req.len = req.frame.data[0];
+      ecu_dispatch(can, req.ecu, req.frame);
+      continue;
+    }
+    out = tx_frame(tx_defer_heap[0].frame.can_id);
+    if(!out) {
+      tx_flush(can);
+      continue;
+    }
+    memcpy(out, &tx_defer_heap[0].frame, sizeof(struct canfd_frame));
+    tx_defer_pop();
   }
+  tx_flush(can);
+}
+
+// Data bytes per frame on the bus
+int isotp_dl() {
+  return can_fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+}
+
+long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /*
- GM
-*/
+ * ISO-TP sessions
+ *
+ * Every multi-frame response lives in its own session keyed by the
+ * tester's request ID (where its FC frames arrive), our response ID and
+ * the extended address (-1 when not used).  Sessions come from a fixed
+ * pool so concurrent transfers to different ECUs never share state.
+ */
+int isotp_rx_id(int tx_id) {
+  struct ecu *ecu = ecu_by_resp[tx_id & CAN_SFF_MASK];
+  return ecu ? ecu->req_id : -1;
+}
 
-// Read DID from ID (GM)
-// For now we are only setting this up to work with the BCM
-// 244   [3]  02 1A 90
-void handle_gm_read_did_by_id(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received GM Read DID by ID Request\n");
-  char resp[300];
-  char *buf;
-  char *tracenum = "874602RA51950204";
-  unsigned char chksum;
-  int pktsize;
-  switch(frame.data[2]) {
-    case 0x90:  // VIN
-      if(verbose) plog(" + Requested VIN\n");
-      switch(fuzz_level) {
-        case 0:
-          if(verbose) plog("Sending VIN %s\n", vin);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          memcpy(&resp[2], vin, strlen(vin));
-          isotp_send_to(can, resp, 3 + strlen(vin), 0x644);
-          break;
-        case 1:
-          if(verbose) plog("Fuzzing VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_ALPHANUM, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) plog("Using VIN: %s\n", buf);
-          memcpy(&resp[2], buf, 17);
-          free(buf);
-          isotp_send_to(can, resp, 3 + 17, 0x644);
-          break;
-        case 2:
-        case 3:  // At 3 the ISOTP spec gets flaky
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing big VIN with printable chars\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_ALPHANUM, pktsize);
-          chksum = calc_vin_checksum(buf, pktsize);
-          buf[8] = chksum;
-          if(verbose) plog("Using big VIN (%d chars): %s\n",pktsize, buf);
-          memcpy(&resp[2], buf, pktsize);
-          free(buf);
-          isotp_send_to(can, resp, 3 + pktsize, 0x644);
-          break;
-        case 4:
-          if(verbose) plog("Fuzzing VIN with binary data\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_BINARY, 17);
-          chksum = calc_vin_checksum(buf, 17);
-          buf[8] = chksum;
-          if(verbose) print_bin(buf, 17);
-          memcpy(&resp[2], buf, 17);
-          free(buf);
-          isotp_send_to(can, resp, 3 + 17, 0x644);
-          break;
-        case 5:
-        default:
-          pktsize = rand() % 252;
-          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          buf = gen_data(DATA_BINARY, pktsize);
-          if(verbose) print_bin(buf, pktsize);
-          memcpy(&resp[2], buf, pktsize);
-          free(buf);
-          isotp_send_to(can, resp, 3 + pktsize, 0x644);
-          break;
-       }
-      break;
-    case 0xA1:  // SDM Primary Key
-      if(verbose) plog(" + Requested SDM Primary Key\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending SDM Key %04X\n", 0x6966);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x69;
-          resp[3] = 0x66;
-          isotp_send_to(can, resp, 5, 0x644);
-          break;
-      }
-      break;
-    case 0xB4:  // Traceability Number
-      if(verbose) plog(" + Requested Traceability Number\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending Traceabiliity number %s\n", tracenum);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          memcpy(&resp[2], tracenum, strlen(tracenum));
-          isotp_send_to(can, resp, 3 + strlen(tracenum), 0x644);
-          break;
-      }
-      break;
-    case 0xB7:  // Software Number
-      if(verbose) plog(" + Requested Software Number\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending SW # %d\n", 600);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x42;
-          resp[3] = 0xAA;
-          resp[4] = 6;
-          resp[5] = 2; // 600
-          resp[6] = 0x58;
-          isotp_send_to(can, resp, 6, 0x644);
-          break;
-      }
-      break;
-    case 0xCB:  // End Model Part #
-      if(verbose) plog(" + Requested End Model Part Number\n");
-      switch(fuzz_level) {
-        case 0:
-        default:
-          if(verbose) plog("Sending End Model Part Number %d\n", 15804602);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x00;
-          resp[3] = 0xF1;
-          resp[4] = 0x28;
-          resp[5] = 0xBA;
-          isotp_send_to(can, resp, 6, 0x644);
-          break;
-      }
-      break;
-    default:
-      break;
+// Only physical request IDs may send multi-frame requests
+int isotp_tx_id(int rx_id) {
+  struct ecu *ecu = ecu_by_id[rx_id & CAN_SFF_MASK];
+  if(!ecu || ecu->req_id != rx_id || !ecu->resp_id) return -1;
+  return ecu->resp_id;
+}
+
+struct isotp_session *isotp_find(int rx_id, int ext) {
+  int i;
+  for(i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+    if(isotp_sessions[i].state != ISOTP_IDLE && isotp_sessions[i].rx_id == rx_id &&
+       isotp_sessions[i].ext == ext) return &isotp_sessions[i];
   }
+  return NULL;
 }
 
-/* GM Read Data via PID */
-/* 244   [5]  04 AA 03 02 07 */
-/* 544#0738408D8B000200 */
-/* 544#02508D8D00000000 */
-void handle_gm_read_data_by_id(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received GM Read Data by ID Request\n");
-  int offset = 0;
+// Finds the session for this key or claims a free one.  A new response
+// on a key that is still busy replaces the old transfer.
+struct isotp_session *isotp_session_get(int rx_id, int tx_id, int ext) {
+  struct isotp_session *free_sess = NULL;
   int i;
-  int datacnt;
-  char datacpy[8];
-  if (frame.data[0] == 0xFE) offset = 1;
-  memcpy(&datacpy, &frame.data, 8);
-  if(frame.can_id == 0x7e0) {
-    frame.can_id = 0x5e8;
-  } else {
-    frame.can_id = 0x500 + (frame.can_id & 0xFF);
+  for(i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+    if(isotp_sessions[i].state == ISOTP_IDLE) {
+      if(!free_sess) free_sess = &isotp_sessions[i];
+    } else if(isotp_sessions[i].rx_id == rx_id && isotp_sessions[i].tx_id == tx_id &&
+              isotp_sessions[i].ext == ext) {
+      if(verbose) plog("ISOTP: new response to %03X replaces a pending one\n", tx_id);
+      return &isotp_sessions[i];
+    }
   }
-  frame.len = 8;
-  switch(frame.data[2 + offset]) { // Subfunctions
-    case 0x00:  // Stop
-      if(verbose) plog(" + Stop Data Request\n");
-      memset(frame.data, 0, 8);
-      write(can, &frame, CAN_MTU);
-      CLEAR_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      break;
-    case 0x01:  // One Response
-      if(verbose) plog(" + One Response\n");
-      for(i=3; i < datacpy[0]+1; i++) {
-        frame.data[0] = datacpy[i];
-        for(datacnt=1; datacnt < 8; datacnt++) {
-          frame.data[datacnt] = rand() % 256;
-        }
-        write(can, &frame, CAN_MTU);
-        sleep(0.5);
-      }
-      break;
-    case 0x02:  // Slow Rate
-      if(verbose) plog(" + Slow Rate\n");
-      SET_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      memcpy(&gm_data_by_id, &frame, sizeof(frame));
-      break;
-    case 0x03:  // Medium Rate
-      if(verbose) plog(" + Medium Rate\n");
-      SET_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      memcpy(&gm_data_by_id, &frame, sizeof(frame));
-      break;
-    case 0x04:  // Fast Rate
-      if(verbose) plog(" + Fast Rate\n");
-      SET_BIT(pending_data, PENDING_READ_DATA_BY_ID_GM);
-      memcpy(&gm_data_by_id, &frame, sizeof(frame));
-      break;
-    default:
-      plog("Unknown subfunction timer\n");
-      break;
+  if(!free_sess) {
+    plog("ISOTP: all %d sessions busy, dropping response to %03X\n", ISOTP_MAX_SESSIONS, tx_id);
+    return NULL;
   }
+  free_sess->rx_id = rx_id;
+  free_sess->tx_id = tx_id;
+  free_sess->ext = ext;
+  free_sess->dtcs = NULL;
+  return free_sess;
 }
 
-/* GM Diag format is either
-     101#FE 03 A9 81 52  (Functional addressing: Where FE is the extended address)
-     7E0#03 A9 81 52 (no extended addressing)
-*/
-void handle_gm_read_diag(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received GM Read Diagnostic Request\n");
-  int offset = 0;
-  int i, total;
-  char resp[150];
-  if(frame.data[0] == 0xFE) offset = 1;
-  switch(frame.data[2 + offset]) { // Subfunctions
-    case UDS_READ_STATUS_BY_MASK:  // Read DTCs by mask
-      if(verbose) {
-        plog(" + Read DTCs by mask\n");
-        if(frame.data[3 + offset] & DTC_SUPPORTED_BY_CALIBRATION) plog("   - Supported By Calibration\n");
-        if(frame.data[3 + offset] & DTC_CURRENT_DTC) plog("   - Current DTC\n");
-        if(frame.data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_CLEARED) plog("   - Tests not passed since DTC cleared\n");
-        if(frame.data[3 + offset] & DTC_TEST_FAILED_SINCE_CLEARED) plog("   - Tests failed since DTC cleared\n");
-        if(frame.data[3 + offset] & DTC_HISTORY) plog("   - DTC History\n");
-        if(frame.data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_POWER) plog("   - Tests not passed since power up\n");
-        if(frame.data[3 + offset] & DTC_CURRENT_DTC_SINCE_POWER) plog("   - Tests failed since power up\n");
-        if(frame.data[3 + offset] & DTC_WARNING_INDICATOR_STATE) plog("   - Warning Indicator State\n");
-      }
-      if(frame.can_id == 0x7e0) {
-        frame.can_id = 0x5e8;
-      } else {
-        frame.can_id = 0x500 + (frame.can_id & 0xFF);
-      }
-      frame.len = 8;
-      frame.data[0] = frame.data[2 + offset];
-      frame.data[1] = 0;    // DTC 1st byte
-      frame.data[2] = 0x30; // DTC 2nd byte
-      frame.data[3] = 0;
-      frame.data[4] = 0x6F; // Last Test/ This Ignition/ Last Clear bitflag
-      frame.data[5] = 0;
-      frame.data[6] = 0;
-      frame.data[7] = 0;
-      write(can, &frame, CAN_MTU);
-      sleep(0.2); // Instead of actually processing the FC
-      if(fuzz_level == 1) {
-        total = rand() % 1024;
-        if(verbose) plog("Sending %d DTCs\n", total);
-        for(i = 0; i < total; i++) {
-          frame.data[1] = rand() % 256;
-          frame.data[2] = (rand() % 255) + 1;
-          frame.data[3] = 0;
-          frame.data[4] = 0x6F; // Last DTC
-          write(can, &frame, CAN_MTU);
-          sleep(1);
-        }
-      }
-      frame.data[1] = 0; // Last frame must be a 0 DTC
-      frame.data[2] = 0;
-      frame.data[3] = 0;
-      frame.data[4] = 0xFF; // Last DTC
-      write(can, &frame, CAN_MTU);
-      break;
-    default:
-      if(verbose) plog(" + Unknown subfunction request %02X\n", frame.data[2 + offset]);
-      break;
+void isotp_session_close(struct isotp_session *sess) {
+  sess->state = ISOTP_IDLE;
+}
+
+void isotp_fill_cf(struct canfd_frame *frame, unsigned char *data, int chunk, int sn, int ext) {
+  int pci = ext >= 0 ? 1 : 0;
+  if(pci) frame->data[0] = ext;
+  frame->len = pci + chunk + 1;
+  frame->data[pci] = 0x20 | (sn & 0x0F);
+  memcpy(&frame->data[pci + 1], data, chunk);
+}
+
+// Builds consecutive frames for a session into the TX vector.  Stops
+// after max frames or when the vector is full.  Returns -1 if a streamed
+// DTC report can't go on because the store changed under it.
+int isotp_build_cfs(struct isotp_session *sess, int max) {
+  struct canfd_frame *frame;
+  unsigned char chunk_buf[CANFD_MAX_DLEN];
+  int n, chunk;
+  int pci = sess->ext >= 0 ? 1 : 0;
+  int offset = sess->offset;
+  int sn = sess->sn;
+  if(sess->dtcs) {
+    pthread_rwlock_rdlock(&sess->dtcs->lock);
+    if(sess->dtcs->gen != sess->dtc_gen) {
+      pthread_rwlock_unlock(&sess->dtcs->lock);
+      plog("ISOTP: DTCs changed, aborting report to %03X\n", sess->tx_id);
+      return -1;
+    }
+  }
+  for(n = 0; offset < sess->size && n < max; n++) {
+    frame = tx_frame(sess->tx_id);
+    if(!frame) break;
+    chunk = sess->size - offset;
+    if(chunk > isotp_dl() - 1 - pci) chunk = isotp_dl() - 1 - pci;
+    if(sess->cfs) {
+      memcpy(frame, &sess->cfs[sn - 1], sizeof(struct canfd_frame));
+    } else if(sess->dtcs) {
+      dtc_report_read(sess, offset, chunk_buf, chunk);
+      isotp_fill_cf(frame, chunk_buf, chunk, sn, sess->ext);
+    } else {
+      isotp_fill_cf(frame, sess->src + (offset - sess->src_off), chunk, sn, sess->ext);
+    }
+    offset += chunk;
+    sn++;
   }
+  if(sess->dtcs) pthread_rwlock_unlock(&sess->dtcs->lock);
+  return n;
 }
 
-/*
-  Gateway
-*/
-void handle_vcds_710(int can, struct canfd_frame frame) {
-  if(verbose) plog("Received VCDS 0x710 gateway request\n");
-  char resp[150];
-  if(frame.data[0] == 0x30) { // Flow control
-    flow_control_push(can);
+// STmin is 0x00-0x7F ms or 0xF1-0xF9 for 100-900 us.  Anything else is
+// reserved and has to be treated as 127 ms.
+long isotp_stmin_us(unsigned char stmin) {
+  if(stmin <= 0x7F) return stmin * 1000;
+  if(stmin >= 0xF1 && stmin <= 0xF9) return (stmin - 0xF0) * 100;
+  return 127000;
+}
+
+// Pushes consecutive frames for a session.  Without STmin the rest of
+// the block goes out in one sendmmsg(), otherwise a single frame is sent
+// and the session is scheduled for the next one.  Only the frames that
+// actually went out are taken off the session.
+void isotp_push_block(int can, struct isotp_session *sess) {
+  int queued, sent, max, offset;
+  int per_cf = isotp_dl() - 1 - (sess->ext >= 0 ? 1 : 0);
+  if(tx_backlog_len) {
+    // CFs can't overtake frames flushed before them, wait for the backlog
+    sess->state = ISOTP_SENDING;
+    sess->next_us = tx_backlog_due;
     return;
   }
-  switch(frame.data[1]) {
-    //Pkt: 710#02 10 03 55 55 55 55 55 
-    case 0x10: // Diagnostic Session Control
-      frame.can_id = 0x77A;
-      frame.len = 8;
-      frame.data[0] = 0x06;
-      frame.data[1] = 0x50;
-      frame.data[2] = 0x03;
-      frame.data[3] = 0x00;
-      frame.data[4] = 0x32;
-      frame.data[5] = 0x01;
-      frame.data[6] = 0xF4;
-      frame.data[7] = 0xAA;
-      write(can, &frame, CAN_MTU);
-      break;
-    case 0x22: // Read Data By Identifier
-      if(frame.data[2] == 0xF1) {
-        switch(frame.data[3]) {
-        case 0x87: // VAG Number
-          if(verbose) plog("Read data by ID 0x87\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x87;
-          resp[3] = 0x35;
-          resp[4] = 0x51;
-          resp[5] = 0x45;
-          resp[6] = 0x39;
-          resp[7] = 0x30;
-          resp[8] = 0x37;
-          resp[9] = 0x35;
-          resp[10] = 0x33;
-          resp[11] = 0x30;
-          resp[12] = 0x43;
-          resp[13] = 0x20; // Note normally this would pad with AA's
-          isotp_send_to(can, resp, 14, 0x77A);
-        break;
-        case 0x89: // VAG Number
-          if(verbose) plog("Read data by ID 0x89\n");
-          frame.can_id = 0x77A;
-          frame.len = 8;
-          frame.data[0] = 0x07;
-          frame.data[1] = 0x62;
-          frame.data[2] = 0xF1;
-          frame.data[3] = 0x89;
-          frame.data[4] = 0x33; //3
-          frame.data[5] = 0x32; //2
-          frame.data[6] = 0x30; //0
-          frame.data[7] = 0x33; //3
-          write(can, &frame, CAN_MTU);
-        break;
-        case 0x91: // VAG Number
-          if(verbose) plog("Read data by ID 0x91\n");
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x87;
-          resp[3] = 0x35;
-          resp[4] = 0x51;
-          resp[5] = 0x45;
-          resp[6] = 0x39;
-          resp[7] = 0x30;
-          resp[8] = 0x37;
-          resp[9] = 0x35;
-          resp[10] = 0x33;
-          resp[11] = 0x30;
-          resp[12] = 0x41;
-          resp[13] = 0x20; // Note normally this would pad with AA's
-          isotp_send_to(can, resp, 14, 0x77A);
-        break;
-        default:
-          if(verbose) plog("NOTE: Read data by unknown ID %02X\n", frame.data[3]);
-          resp[0] = frame.data[1] + 0x40;
-          resp[1] = frame.data[2];
-          resp[2] = 0x87;
-          resp[3] = 0x35;
-          resp[4] = 0x51;
-          resp[5] = 0x45;
-          resp[6] = 0x39;
-          resp[7] = 0x30;
-          resp[8] = 0x37;
-          resp[9] = 0x35;
-          resp[10] = 0x33;
-          resp[11] = 0x30;
-          resp[12] = 0x41;
-          resp[13] = 0x20; // Note normally this would pad with AA's
-          isotp_send_to(can, resp, 14, 0x77A);
-        break;
-       
+  do {
+    max = sess->bs ? sess->bs - sess->block : TX_BATCH_MAX;
+    if(sess->stmin_us) max = 1;
+    queued = isotp_build_cfs(sess, max);
+    if(queued < 0) {
+      isotp_session_close(sess);
+      return;
+    }
+    sent = tx_flush_once(can);
+    offset = sess->offset;
+    sess->offset += sent * per_cf;
+    if(sess->offset > sess->size) sess->offset = sess->size;
+    isotp_tx_bytes += sess->offset - offset;
+    isotp_tx_frames += sent;
+    sess->sn += sent;
+    sess->block += sent;
+    if(sent < queued) {
+      if(tx_errno == ENOBUFS || tx_errno == EAGAIN || tx_errno == EINTR) {
+        // Try again once the device queue had a chance to drain
+        tx_retries++;
+        sess->state = ISOTP_SENDING;
+        sess->next_us = now_us() + TX_BACKOFF_US;
+        return;
       }
-    } else {
-      if (verbose) plog("Unknown read data by Identifier %02X\n", frame.data[2]);
+      plog("ISOTP: aborting transfer to %03X, %d bytes unsent\n", sess->tx_id, sess->size - sess->offset);
+      tx_dropped += queued - sent;
+      isotp_session_close(sess);
+      return;
     }
-    break;
+  } while(!sess->stmin_us && sess->offset < sess->size && (sess->bs == 0 || sess->block < sess->bs));
+  if(sess->offset >= sess->size) {
+    if(oracle_enabled && ecu_by_resp[sess->tx_id & CAN_SFF_MASK]) oracle_answer_done(ecu_by_resp[sess->tx_id & CAN_SFF_MASK]);
+    isotp_tx_msgs++;
+    isotp_tx_us += now_us() - sess->start_us;
+    isotp_session_close(sess);
+  } else if(sess->bs && sess->block >= sess->bs) {
+    sess->state = ISOTP_WAIT_FC;
+    sess->deadline = now_ms() + ISOTP_N_BS_MS;
+  } else {
+    sess->state = ISOTP_SENDING;
+    sess->next_us = now_us() + sess->stmin_us;
   }
 }
 
-// return Mode/SIDs in english
-char *get_mode_str(struct canfd_frame frame) {
-  switch(frame.data[1]) {
-    case OBD_MODE_SHOW_CURRENT_DATA:
-       return "Show current Data";
-       break;
-    case OBD_MODE_SHOW_FREEZE_FRAME:
-       return "Show freeze frame";
-       break;
-    case OBD_MODE_READ_DTC:
-       return "Read DTCs";
-       break;
-    case OBD_MODE_CLEAR_DTC:
-       return "Clear DTCs";
-       break;
-    case OBD_MODE_TEST_RESULTS_NON_CAN:
-       return "Mode Test Results (Non-CAN)";
-       break;
-    case OBD_MODE_TEST_RESULTS_CAN:
-       return "Mode Test Results (CAN)";
-       break;
-    case OBD_MODE_READ_PENDING_DTC:
-       return "Read Pending DTCs";
-       break;
-    case OBD_MODE_CONTROL_OPERATIONS:
-       return "Control Operations";
-       break;
-    case OBD_MODE_VEHICLE_INFORMATION:
-       return "Vehicle Information";
-       break;
-    case OBD_MODE_READ_PERM_DTC:
-       return "Read Permanent DTCs";
-       break;
-    case UDS_SID_DIAGNOSTIC_CONTROL:
-       return "Diagnostic Control";
-       break;
-    case UDS_SID_ECU_RESET:
-       return "ECU Reset";
-       break;
-    case UDS_SID_CLEAR_DTC:
-       return "UDS Clear DTCs";
-       break;
-    case UDS_SID_READ_DTC:
-       return "UDS Read DTCs";
-       break;
-    case UDS_SID_GM_READ_DID_BY_ID:
-       return "Read DID by ID (GM)";
-       break;
-    case UDS_SID_RESTART_COMMUNICATIONS:
-       return "Restore Normal Commnications";
-       break;
-    case UDS_SID_READ_DATA_BY_ID:
-       return "Read DATA By ID";
-       break;
-    case UDS_SID_READ_MEM_BY_ADDRESS:
-       return "Read Memory By Address";
-       break;
-    case UDS_SID_READ_SCALING_BY_ID:
-       return "Read Scalling Data by ID";
-       break;
-    case UDS_SID_SECURITY_ACCESS:
-       return "Security Access";
-       break;
-    case UDS_SID_COMMUNICATION_CONTROL:
-       return "Communication Control";
-       break;
-    case UDS_SID_READ_DATA_BY_ID_PERIODIC:
-       return "Read DATA By ID Periodically";
-       break;
-    case UDS_SID_DEFINE_DATA_ID:
-       return "Define DATA By ID";
-       break;
-    case UDS_SID_WRITE_DATA_BY_ID:
-       return "Write DATA By ID";
-       break;
-    case UDS_SID_IO_CONTROL_BY_ID:
-       return "Input/Output Control By ID";
-       break;
-    case UDS_SID_ROUTINE_CONTROL:
-       return "Routine Control";
-       break;
-    case UDS_SID_REQUEST_DOWNLOAD:
-       return "Request Download";
-       break;
-    case UDS_SID_REQUEST_UPLOAD:
-       return "Request Upload";
-       break;
-    case UDS_SID_TRANSFER_DATA:
-       return "Transfer DATA";
-       break;
-    case UDS_SID_REQUEST_XFER_EXIT:
-       return "Request Transfer Exit";
-       break;
-    case UDS_SID_REQUEST_XFER_FILE:
-       return "Request Transfer File";
-       break;
-    case UDS_SID_WRITE_MEM_BY_ADDRESS:
-       return "Write Memory By Address";
-       break;
-    case UDS_SID_TESTER_PRESENT:
-       return "Tester Present";
-       break;
-    case UDS_SID_ACCESS_TIMING:
-       return "Access Timing";
-       break;
-    case UDS_SID_SECURED_DATA_TRANS:
-       return "Secured DATA Transfer";
-       break;
-    case UDS_SID_CONTROL_DTC_SETTINGS:
-       return "Control DTC Settings";
-       break;
-    case UDS_SID_RESPONSE_ON_EVENT:
-       return "Response On Event";
-       break;
-    case UDS_SID_LINK_CONTROL:
-       return "Link Control";
-       break;
-    case UDS_SID_GM_PROGRAMMED_STATE:
-       return "Programmed State (GM)";
-       break;
-    case UDS_SID_GM_PROGRAMMING_MODE:
-       return "Programming Mode (GM)";
-       break;
-    case UDS_SID_GM_READ_DIAG_INFO:
-       return "Read Diagnostic Information (GM)";
-       break;
-    case UDS_SID_GM_READ_DATA_BY_ID:
-       return "Read DATA By ID (GM)";
-       break;
-    case UDS_SID_GM_DEVICE_CONTROL:
-       return "Device Control (GM)";
-       break;
+// Sends whatever paced frames are due
+void isotp_service(int can) {
+  int i;
+  long long now = now_us();
+  for(i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+    if(isotp_sessions[i].state == ISOTP_SENDING && isotp_sessions[i].next_us <= now) {
+      isotp_push_block(can, &isotp_sessions[i]);
+    }
+  }
+}
+
+// Arms the TX timer for the next paced or deferred frame that is due,
+// it is only touched when that time changes
+void tx_schedule() {
+  struct itimerspec its;
+  long long next = tx_defer_next();
+  int i;
+  for(i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+    if(isotp_sessions[i].state != ISOTP_SENDING) continue;
+    if(!next || isotp_sessions[i].next_us < next) next = isotp_sessions[i].next_us;
+  }
+  if(next == tx_timer_armed) return;
+  memset(&its, 0, sizeof(its));
+  if(next) {
+    its.it_value.tv_sec = next / 1000000;
+    its.it_value.tv_nsec = (next % 1000000) * 1000;
+  }
+  if(timerfd_settime(tx_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) perror("timerfd_settime");
+  tx_timer_armed = next;
+}
+
+// Finds the session a flow control frame is for.  Some testers send the
+// FC to the functional ID, then it goes to the first ECU answering that
+// ID that is waiting for one.
+struct isotp_session *isotp_find_fc(int rx_id, int ext) {
+  struct isotp_session *sess, *found;
+  struct ecu *ecu = ecu_by_id[rx_id];
+  found = isotp_find(rx_id, ext);
+  if(found || !ecu || ecu->func_id != rx_id) return found;
+  for(; ecu; ecu = ecu->func_next) {
+    sess = isotp_find(ecu->req_id, ext);
+    if(sess && sess->state == ISOTP_WAIT_FC) return sess;
+    if(sess && !found) found = sess;
+  }
+  return found;
+}
+
+// Handles a flow control frame from the tester.  Returns 1 if the frame
+// belonged to one of our sessions.
+int isotp_handle_fc(int can, struct canfd_frame frame) {
+  struct isotp_session *sess;
+  int rx_id = frame.can_id & CAN_SFF_MASK;
+  int pci = 0;
+  sess = isotp_find_fc(rx_id, -1);
+  if(!sess && frame.len > 1) {
+    sess = isotp_find_fc(rx_id, frame.data[0]);
+    pci = 1;
+  }
+  if(!sess) {
+    // A stray FC is never a request, don't let the handlers see it
+    if((frame.data[0] & 0xF0) != 0x30) return 0;
+    if(verbose > 1) plog("FC: %03X has no pending transfer\n", rx_id);
+    return 1;
+  }
+  if((frame.data[pci] & 0xF0) != 0x30) return 0;
+  if(sess->state != ISOTP_WAIT_FC) return 1;
+  switch(frame.data[pci] & 0x0F) {
+    case 0x00: // Clear to send
+      break;
+    case 0x01: // Wait, another FC will follow
+      if(verbose) plog("FC: Tester asked %03X to wait\n", sess->tx_id);
+      sess->deadline = now_ms() + ISOTP_N_BS_MS;
+      return 1;
+    default:   // Overflow/abort
+      if(verbose) plog("FC: Tester aborted the transfer from %03X\n", sess->tx_id);
+      isotp_session_close(sess);
+      return 1;
+  }
+  sess->bs = frame.data[pci + 1];
+  sess->block = 0;
+  sess->stmin_us = isotp_stmin_us(frame.data[pci + 2]);
+  if(verbose) plog("FC: Flushing ISOTP buffers for %03X (BS=%d STmin=%ldus)\n", sess->tx_id, sess->bs, sess->stmin_us);
+  isotp_push_block(can, sess);
+  return 1;
+}
+
+// Drops transfers whose tester went quiet
+void isotp_check_timeouts() {
+  int i;
+  long now = now_ms();
+  for(i = 0; i < ISOTP_MAX_SESSIONS; i++) {
+    if(isotp_sessions[i].state == ISOTP_WAIT_FC && now > isotp_sessions[i].deadline) {
+      if(verbose) plog("ISOTP: timed out waiting for FC to %03X\n", isotp_sessions[i].tx_id);
+      isotp_session_close(&isotp_sessions[i]);
+    }
+  }
+  for(i = 0; i < ISOTP_RX_POOL; i++) {
+    if(isotp_rxs[i].in_use && now > isotp_rxs[i].deadline) {
+      if(verbose) plog("ISOTP: timed out waiting for CF on %03X (%d of %d bytes)\n",
+                       isotp_rxs[i].rx_id, isotp_rxs[i].offset, isotp_rxs[i].size);
+      isotp_rxs[i].in_use = 0;
+    }
+  }
+}
+
+// Fills in a single frame, or the first frame of a longer message, and
+// returns how many bytes of data it carries
+int isotp_first_frame(struct canfd_frame *frame, char *data, int size, int ext) {
+  int pci = ext >= 0 ? 1 : 0;
+  int ff;
+  if(pci) frame->data[0] = ext;
+  if(size <= 7 - pci) {
+    frame->len = pci + size + 1;
+    frame->data[pci] = size;
+    memcpy(&frame->data[pci + 1], data, size);
+    return size;
+  }
+  if(size <= isotp_dl() - 2 - pci) {
+    // CAN FD single frame, the length moves to the second byte
+    frame->len = pci + size + 2;
+    frame->data[pci] = 0;
+    frame->data[pci + 1] = size;
+    memcpy(&frame->data[pci + 2], data, size);
+    return size;
+  }
+  frame->len = isotp_dl();
+  if(size <= ISOTP_MAX_PDU) {
+    frame->data[pci] = 0x10 | ((size >> 8) & 0x0F);
+    frame->data[pci + 1] = size & 0xFF;
+    ff = pci + 2;
+  } else {
+    // Escape sequence, 32 bit length follows a zero 12 bit length
+    frame->data[pci] = 0x10;
+    frame->data[pci + 1] = 0;
+    frame->data[pci + 2] = (size >> 24) & 0xFF;
+    frame->data[pci + 3] = (size >> 16) & 0xFF;
+    frame->data[pci + 4] = (size >> 8) & 0xFF;
+    frame->data[pci + 5] = size & 0xFF;
+    ff = pci + 6;
+  }
+  memcpy(&frame->data[ff], data, isotp_dl() - ff);
+  return isotp_dl() - ff;
+}
+
+// Sends the first frame waiting in the TX vector and starts the rest
+// of the transfer.  first is the payload it carries.
+void isotp_session_start(int can, struct isotp_session *sess, int size, int first) {
+  sess->size = size;
+  sess->offset = first;
+  sess->sn = 1;
+  sess->bs = 0;
+  sess->block = 0;
+  sess->stmin_us = 0;
+  sess->start_us = now_us();
+  if(tx_flush(can) < 1) {
+    isotp_session_close(sess);
+    return;
+  }
+  isotp_tx_bytes += sess->offset;
+  isotp_tx_frames++;
+  if(no_flow_control) {
+    // Nobody will send FC, so the whole message goes out in one go
+    sess->state = ISOTP_SENDING;
+    isotp_push_block(can, sess);
+  } else {
+    sess->state = ISOTP_WAIT_FC;
+    sess->deadline = now_ms() + ISOTP_N_BS_MS;
+  }
+}
+
+void isotp_send_ext(int can, char *data, int size, int dest, int ext) {
+  struct isotp_session *sess;
+  struct canfd_frame *frame;
+  int pci = ext >= 0 ? 1 : 0;
+  int first;
+  if(rcache_capturing) {
+    rcache_capture_pdu(dest, ext, data, size);
+    return;
+  }
+  if(mutate_rate && (int)prng_below(100) < mutate_rate) {
+    size = mutate_pdu((unsigned char *)data, size);
+    data = (char *)mut_buf;
+  }
+  if(isotp_backend == ISOTP_KERNEL && ext < 0 && isotp_kernel_send(dest, data, size) == 0) return;
+  if(size > ISOTP_BUF_SIZE) {
+    plog("ISOTP: %d byte response to %03X is too large\n", size, dest);
+    return;
+  }
+  if(tx_count > 0) tx_flush(can);
+  frame = tx_frame(dest);
+  first = isotp_first_frame(frame, data, size, ext);
+  if(first == size) {
+    if(tp_roll()) tp_single(frame, data, size, ext);
+    if(tx_flush(can) == 1) {
+      isotp_tx_bytes += size;
+      isotp_tx_frames++;
+    }
+    return;
+  }
+  sess = isotp_session_get(isotp_rx_id(dest), dest, ext);
+  if(!sess) {
+    tx_count = 0;
+    return;
+  }
+  if(fuzz_level > 2 && keep_spec == 0 && size <= ISOTP_MAX_PDU) {
+    frame->data[pci + 1] = (unsigned char)prng_next();
+    printf("Breaking ISOTP specs real size = %d reported size = %d\n", size, frame->data[pci + 1]);
+  }
+  memcpy(sess->buf, data, size);
+  sess->src = sess->buf;
+  sess->src_off = 0;
+  sess->cfs = NULL;
+  if(tp_roll()) size = tp_train(sess, frame, size, &first);
+  isotp_session_start(can, sess, size, first);
+}
+
+void isotp_send_to(int can, char *data, int size, int dest) {
+  isotp_send_ext(can, data, size, dest, -1);
+}
+
+void isotp_send(int can, char *data, int size) {
+  isotp_send_to(can, data, size, cur_req.ecu && cur_req.ecu->resp_id ? cur_req.ecu->resp_id : 0x7e8);
+}
+
+// Sends a short header followed by size bytes that are never copied,
+// consecutive frames are built straight from data (usually a mapping)
+void isotp_send_mapped(int can, int dest, unsigned char *head, int head_len, unsigned char *data, int size) {
+  struct isotp_session *sess;
+  struct iovec iov[2];
+  unsigned char first_buf[CANFD_MAX_DLEN];
+  int first, total = head_len + size;
+  iov[0].iov_base = head;
+  iov[0].iov_len = head_len;
+  iov[1].iov_base = data;
+  iov[1].iov_len = size;
+  if((mutate_rate || tp_rate) && total <= ISOTP_BUF_SIZE) {
+    // The fuzzers need a copy they can change
+    memcpy(mut_buf, head, head_len);
+    memcpy(&mut_buf[head_len], data, size);
+    isotp_send_to(can, (char *)mut_buf, total, dest);
+    return;
+  }
+  if(isotp_backend == ISOTP_KERNEL && isotp_kernel_sendv(dest, iov, 2) == 0) return;
+  memcpy(first_buf, head, head_len);
+  memcpy(&first_buf[head_len], data, total < CANFD_MAX_DLEN ? size : CANFD_MAX_DLEN - head_len);
+  if(total < CANFD_MAX_DLEN) {
+    isotp_send_to(can, (char *)first_buf, total, dest);
+    return;
+  }
+  if(tx_count > 0) tx_flush(can);
+  sess = isotp_session_get(isotp_rx_id(dest), dest, -1);
+  if(!sess) return;
+  first = isotp_first_frame(tx_frame(dest), (char *)first_buf, total, -1);
+  // The header only goes out in the first frame, so the CFs read the
+  // data with offsets head_len bytes in
+  sess->src = data;
+  sess->src_off = head_len;
+  sess->cfs = NULL;
+  isotp_session_start(can, sess, total, first);
+}
+
+/*
+ * ISO-TP request reassembly
+ *
+ * First frames claim a buffer from a fixed pool, we answer with our own
+ * flow control and collect consecutive frames until the request is
+ * complete.  The finished PDU is handed to handle_request() through
+ * cur_req, nothing is allocated per message.
+ */
+void isotp_send_fc(int can, int tx_id, int fs) {
+  struct canfd_frame *frame;
+  if(tx_count > 0) tx_flush(can);
+  frame = tx_frame(tx_id);
+  frame->len = 3;
+  frame->data[0] = 0x30 | fs;
+  frame->data[1] = ISOTP_RX_BS;
+  frame->data[2] = ISOTP_RX_STMIN;
+  if(tp_roll()) tp_fc(frame);
+  tx_flush(can);
+}
+
+struct isotp_rx *isotp_rx_find(int rx_id) {
+  int i;
+  for(i = 0; i < ISOTP_RX_POOL; i++) {
+    if(isotp_rxs[i].in_use && isotp_rxs[i].rx_id == rx_id) return &isotp_rxs[i];
+  }
+  return NULL;
+}
+
+void isotp_rx_first(int can, struct canfd_frame frame, int tx_id) {
+  struct isotp_rx *rx;
+  int i, size, ff = 2;
+  size = ((frame.data[0] & 0x0F) << 8) | frame.data[1];
+  if(size == 0 && frame.len >= 6) {
+    // Escape sequence for lengths over 4095
+    size = (frame.data[2] << 24) | (frame.data[3] << 16) | (frame.data[4] << 8) | frame.data[5];
+    ff = 6;
+  }
+  if(size < 8 || frame.len < 8 || size < frame.len - ff) {
+    if(verbose) plog("ISOTP: ignoring malformed first frame on %03X\n", frame.can_id);
+    return;
+  }
+  // A new first frame replaces whatever was in progress on this ID
+  rx = isotp_rx_find(frame.can_id);
+  for(i = 0; !rx && i < ISOTP_RX_POOL; i++) {
+    if(!isotp_rxs[i].in_use) rx = &isotp_rxs[i];
+  }
+  if(!rx || size > ISOTP_BUF_SIZE) {
+    plog("ISOTP: can't take a %d byte request on %03X\n", size, frame.can_id);
+    isotp_send_fc(can, tx_id, ISOTP_FC_OVERFLOW);
+    return;
+  }
+  rx->in_use = 1;
+  rx->rx_id = frame.can_id;
+  rx->tx_id = tx_id;
+  rx->size = size;
+  memcpy(rx->buf, &frame.data[ff], frame.len - ff);
+  rx->offset = frame.len - ff;
+  rx->sn = 1;
+  rx->block = 0;
+  rx->deadline = now_ms() + ISOTP_N_CR_MS;
+  if(verbose > 1) plog("ISOTP: receiving %d byte request on %03X\n", size, frame.can_id);
+  isotp_send_fc(can, tx_id, ISOTP_FC_CTS);
+}
+
+void isotp_rx_consecutive(int can, struct canfd_frame frame) {
+  struct isotp_rx *rx;
+  struct canfd_frame req;
+  int chunk;
+  rx = isotp_rx_find(frame.can_id);
+  if(!rx) return;
+  if((frame.data[0] & 0x0F) != (rx->sn & 0x0F)) {
+    plog("ISOTP: wrong sequence number on %03X (got %X expected %X), dropping request\n",
+         frame.can_id, frame.data[0] & 0x0F, rx->sn & 0x0F);
+    rx->in_use = 0;
+    return;
+  }
+  chunk = rx->size - rx->offset;
+  if(chunk > frame.len - 1) chunk = frame.len - 1;
+  if(chunk < 0) chunk = 0;
+  memcpy(rx->buf + rx->offset, &frame.data[1], chunk);
+  rx->offset += chunk;
+  rx->sn++;
+  rx->deadline = now_ms() + ISOTP_N_CR_MS;
+  if(rx->offset < rx->size) {
+    if(ISOTP_RX_BS && ++rx->block >= ISOTP_RX_BS) {
+      rx->block = 0;
+      isotp_send_fc(can, rx->tx_id, ISOTP_FC_CTS);
+    }
+    return;
+  }
+  // Complete.  Handlers still get a frame with the start of the request,
+  // the whole thing is in cur_req.
+  memset(&req, 0, sizeof(req));
+  req.can_id = frame.can_id;
+  req.data[0] = rx->size < CANFD_MAX_DLEN - 1 ? rx->size : CANFD_MAX_DLEN - 1;
+  req.len = req.data[0] + 1;
+  memcpy(&req.data[1], rx->buf, req.data[0]);
+  cur_req.id = frame.can_id;
+  cur_req.data = rx->buf;
+  cur_req.len = rx->size;
+  handle_request(can, req);
+  rx->in_use = 0;
+}
+
+// Handles the transport side of a frame.  Returns 1 if nothing is left
+// for the request handlers to do.
+int isotp_handle_rx(int can, struct canfd_frame *frame) {
+  int tx_id;
+  if(frame->len == 0) return 0;
+  switch(frame->data[0] & 0xF0) {
+    case 0x10: // First frame
+      tx_id = isotp_tx_id(frame->can_id);
+      if(tx_id < 0) return 0;
+      isotp_rx_first(can, *frame, tx_id);
+      return 1;
+    case 0x20: // Consecutive frame
+      if(!isotp_rx_find(frame->can_id)) return 0;
+      isotp_rx_consecutive(can, *frame);
+      return 1;
+    case 0x00:
+      if(frame->data[0] == 0 && frame->len > CAN_MAX_DLEN && frame->data[1] <= frame->len - 2) {
+        // CAN FD single frame, move it into the classic layout handlers know
+        frame->data[0] = frame->data[1];
+        memmove(&frame->data[1], &frame->data[2], frame->data[0]);
+        frame->len = frame->data[0] + 1;
+      }
+      // Fall through
     default:
-       printf("Unknown mode/sid (%02X)\n", frame.data[1]);
-       return "";
+      // Single frame (or something we don't know), it is its own request
+      cur_req.id = frame->can_id;
+      cur_req.data = &frame->data[1];
+      cur_req.len = frame->data[0] < frame->len ? frame->data[0] : frame->len - 1;
+      return 0;
+  }
+}
+
+/*
+ * Periodic data
+ *
+ * GM 0xAA and UDS 0x2A subscriptions sit on a two level timing wheel.
+ * Level 0 has one slot per tick for the next WHEEL_SLOTS ticks, level 1
+ * holds anything further out and is cascaded down one slot at a time as
+ * the wheel turns.  The timer is only armed for the next tick that has
+ * work on it, and every subscription keeps its own fixed schedule so the
+ * lateness we measure doesn't add up over time.
+ */
+void periodic_init() {
+  int i;
+  for(i = 0; i < WHEEL_SLOTS; i++) wheel_l0[i] = -1;
+  for(i = 0; i < WHEEL_L1_SLOTS; i++) wheel_l1[i] = -1;
+  wheel_base_us = now_us();
+  wheel_tick = 0;
+}
+
+long long wheel_now() {
+  return (now_us() - wheel_base_us) / WHEEL_TICK_US;
+}
+
+void wheel_unlink(int i) {
+  struct periodic_sub *sub = &periodic_subs[i];
+  if(!sub->slot) return;
+  if(sub->prev >= 0) periodic_subs[sub->prev].next = sub->next;
+  else *sub->slot = sub->next;
+  if(sub->next >= 0) periodic_subs[sub->next].prev = sub->prev;
+  sub->slot = NULL;
+}
+
+// Puts a subscription in the slot for its due time, but no earlier
+// than min_tick
+void wheel_insert(int i, long long min_tick) {
+  struct periodic_sub *sub = &periodic_subs[i];
+  long long tick = (sub->due_us - wheel_base_us + WHEEL_TICK_US - 1) / WHEEL_TICK_US;
+  long long delta;
+  if(tick < min_tick) tick = min_tick;
+  delta = tick - wheel_tick;
+  if(delta < WHEEL_SLOTS) {
+    sub->slot = &wheel_l0[tick & (WHEEL_SLOTS - 1)];
+  } else {
+    // Too far out for level 1 gets parked in its last slot and cascaded again
+    if(delta >= WHEEL_SLOTS * (WHEEL_L1_SLOTS - 1)) tick = wheel_tick + WHEEL_SLOTS * (WHEEL_L1_SLOTS - 1) - 1;
+    sub->slot = &wheel_l1[(tick >> WHEEL_BITS) & (WHEEL_L1_SLOTS - 1)];
+  }
+  sub->prev = -1;
+  sub->next = *sub->slot;
+  if(sub->next >= 0) periodic_subs[sub->next].prev = i;
+  *sub->slot = i;
+}
+
+int periodic_find(int proto, int tx_id, int did) {
+  int i;
+  for(i = 0; i < PERIODIC_MAX; i++) {
+    if(!periodic_subs[i].in_use) continue;
+    if(periodic_subs[i].proto == proto && periodic_subs[i].tx_id == tx_id && periodic_subs[i].did == did) return i;
+  }
+  return -1;
+}
+
+// Starts sending a DID periodically, or changes its rate if it is
+// already being sent.  Returns -1 if the table is full.
+int periodic_start(int proto, int tx_id, int did, int rate) {
+  struct periodic_sub *sub;
+  int i = periodic_find(proto, tx_id, did);
+  if(rcache_capturing) {
+    rcache_cap->bad = 1;
+    return 0;
+  }
+  if(i >= 0) {
+    wheel_unlink(i);
+  } else {
+    for(i = 0; i < PERIODIC_MAX && periodic_subs[i].in_use; i++);
+    if(i == PERIODIC_MAX) {
+      periodic_full++;
+      return -1;
+    }
+    // An empty wheel isn't turned, catch it up before using it again
+    if(periodic_count++ == 0) wheel_tick = wheel_now();
+  }
+  sub = &periodic_subs[i];
+  sub->in_use = 1;
+  sub->proto = proto;
+  sub->tx_id = tx_id;
+  sub->did = did;
+  sub->rate = rate;
+  // First one goes out on the next tick, the schedule stays on tick boundaries
+  sub->due_us = wheel_base_us + (wheel_now() + 1) * WHEEL_TICK_US;
+  wheel_insert(i, wheel_tick + 1);
+  return 0;
+}
+
+// Stops a periodic DID, or all of them for tx_id when did is -1.
+// Returns how many were stopped.
+int periodic_stop(int proto, int tx_id, int did) {
+  int i, n = 0;
+  for(i = 0; i < PERIODIC_MAX; i++) {
+    if(!periodic_subs[i].in_use) continue;
+    if(periodic_subs[i].proto != proto || periodic_subs[i].tx_id != tx_id) continue;
+    if(did >= 0 && periodic_subs[i].did != did) continue;
+    wheel_unlink(i);
+    periodic_subs[i].in_use = 0;
+    periodic_count--;
+    n++;
+  }
+  return n;
+}
+
+// Sends one periodic frame and puts the subscription back on the wheel
+void periodic_fire(int can, int i, long long now) {
+  struct periodic_sub *sub = &periodic_subs[i];
+  struct canfd_frame *out;
+  long long late = now - sub->due_us;
+  long period = periodic_rate_us[sub->rate];
+  int n;
+  out = tx_frame(sub->tx_id);
+  if(!out) {
+    tx_flush(can);
+    out = tx_frame(sub->tx_id);
+  }
+  out->len = 8;
+  if(sub->proto == PERIODIC_GM) {
+    out->data[0] = sub->did;
+    for(n = 1; n < 8; n++) out->data[n] = (unsigned char)prng_next();
+  } else {
+    out->data[0] = 7;
+    out->data[1] = sub->did;
+    for(n = 2; n < 8; n++) out->data[n] = (unsigned char)prng_next();
+  }
+  if(verbose > 1) plog("  + Sending %s data (%02X) at a %s rate\n", sub->proto == PERIODIC_GM ? "GM" : "periodic",
+                       sub->did, periodic_rate_names[sub->rate]);
+  if(late < 0) late = 0;
+  periodic_sent[sub->rate]++;
+  periodic_late_sum[sub->rate] += late;
+  if(late > periodic_late_max[sub->rate]) periodic_late_max[sub->rate] = late;
+  sub->due_us += period;
+  // If we fell more than a period behind skip what was missed, no bursts
+  if(sub->due_us <= now) sub->due_us += ((now - sub->due_us) / period + 1) * period;
+  wheel_insert(i, wheel_tick + 1);
+}
+
+// Turns the wheel up to now and sends everything that came due
+void periodic_service(int can) {
+  long long target = wheel_now();
+  long long now;
+  int i, next, *slot;
+  while(wheel_tick < target) {
+    wheel_tick++;
+    if(!(wheel_tick & (WHEEL_SLOTS - 1))) {
+      slot = &wheel_l1[(wheel_tick >> WHEEL_BITS) & (WHEEL_L1_SLOTS - 1)];
+      for(i = *slot, *slot = -1; i >= 0; i = next) {
+        next = periodic_subs[i].next;
+        wheel_insert(i, wheel_tick);
+      }
+    }
+    slot = &wheel_l0[wheel_tick & (WHEEL_SLOTS - 1)];
+    if(*slot < 0) continue;
+    now = now_us();
+    for(i = *slot, *slot = -1; i >= 0; i = next) {
+      next = periodic_subs[i].next;
+      periodic_subs[i].slot = NULL;
+      periodic_fire(can, i, now);
+    }
+  }
+  if(tx_count > 0) tx_flush(can);
+}
+
+// Arms periodic_timer_fd for the next tick that has something to do
+void periodic_schedule() {
+  struct itimerspec its;
+  long long next = 0, t;
+  int i;
+  if(periodic_count) {
+    for(t = wheel_tick + 1; t < wheel_tick + WHEEL_SLOTS; t++) {
+      if(wheel_l0[t & (WHEEL_SLOTS - 1)] < 0) continue;
+      next = t;
+      break;
+    }
+    for(i = 0; i < WHEEL_L1_SLOTS; i++) {
+      if(wheel_l1[i] < 0) continue;
+      t = ((wheel_tick >> WHEEL_BITS) + 1) << WHEEL_BITS; // Next cascade
+      if(!next || t < next) next = t;
+      break;
+    }
+  }
+  if(next) next = wheel_base_us + next * WHEEL_TICK_US;
+  if(next == periodic_timer_armed) return;
+  memset(&its, 0, sizeof(its));
+  if(next) {
+    its.it_value.tv_sec = next / 1000000;
+    its.it_value.tv_nsec = (next % 1000000) * 1000;
+  }
+  if(timerfd_settime(periodic_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) perror("timerfd_settime");
+  periodic_timer_armed = next;
+}
+
+void print_periodic_stats() {
+  int r;
+  for(r = 0; r < PERIODIC_RATES; r++) {
+    if(!periodic_sent[r]) continue;
+    plog("Periodic (%s, %ld ms): %lu frames, %.0f us average lateness, %lld us max\n",
+         periodic_rate_names[r], periodic_rate_us[r] / 1000, periodic_sent[r],
+         (double)periodic_late_sum[r] / periodic_sent[r], periodic_late_max[r]);
+  }
+  if(periodic_full) plog("Periodic: %lu subscriptions refused (table full)\n", periodic_full);
+}
+
+/*
+ * DTC store
+ */
+int dtc_add(struct ecu *ecu, uint32_t code, int status) {
+  struct dtc_store *st = ecu->dtcs;
+  uint32_t *codes;
+  uint64_t *bits;
+  int b, i, words, alloc;
+  if(!st) {
+    st = ecu->dtcs = calloc(1, sizeof(struct dtc_store));
+    if(!st) return -1;
+    pthread_rwlock_init(&st->lock, NULL);
+  }
+  if(st->count == st->alloc) {
+    // Nothing in the store changes until every array has grown, a failed
+    // realloc leaves it as it was
+    words = st->alloc / 64;
+    alloc = st->alloc ? st->alloc * 2 : 64;
+    codes = realloc(st->codes, alloc * sizeof(uint32_t));
+    if(!codes) return -1;
+    st->codes = codes;
+    for(b = 0; b <= DTC_STATUS_BITS; b++) {
+      bits = realloc(st->bits[b], alloc / 8);
+      if(!bits) return -1;
+      memset(bits + words, 0, alloc / 8 - words * 8);
+      st->bits[b] = bits;
+    }
+    st->alloc = alloc;
+  }
+  st->gen++;
+  i = st->count++;
+  st->codes[i] = code;
+  for(b = 0; b <= DTC_STATUS_BITS; b++) {
+    if(status & (1 << b)) st->bits[b][i / 64] |= 1ULL << (i % 64);
+  }
+  return 0;
+}
+
+void dtc_reset(struct ecu *ecu) {
+  int b;
+  if(!ecu->dtcs) return;
+  for(b = 0; b <= DTC_STATUS_BITS; b++) memset(ecu->dtcs->bits[b], 0, ecu->dtcs->alloc / 8);
+  ecu->dtcs->count = 0;
+  ecu->dtcs->gen++;
+}
+
+// The DTCs uds-server always made up, P0100-P0126 pending and the
+// first two of them confirmed, plus -D stress DTCs for the engine
+void dtc_seed(struct ecu *ecu, int stress) {
+  int i;
+  for(i = 0; i < 20; i++) dtc_add(ecu, (0x0100 + i * 2) << 8, DTC_PENDING | (i < 2 ? DTC_CONFIRMED : 0));
+  for(i = 0; i < stress; i++) dtc_add(ecu, ((0x4000 + (i & 0x3FFF)) << 8) | (i >> 14), (i * 2654435761u) >> 24);
+}
+
+// ORs the bitmaps selected by mask for words w to w + DTC_CHUNK into out,
+// returns the number of words filled.  A mask of -1 selects every DTC.
+int dtc_select(struct dtc_store *st, int mask, int w, uint64_t *out) {
+  int b, j, n = (st->count + 63) / 64 - w;
+  if(n > DTC_CHUNK) n = DTC_CHUNK;
+  if(mask < 0) {
+    for(j = 0; j < n; j++) out[j] = ~0ULL;
+    if((w + n) * 64 > st->count) out[n - 1] = (1ULL << (st->count % 64)) - 1;
+    return n;
+  }
+  memset(out, 0, n * sizeof(uint64_t));
+  for(b = 0; b <= DTC_STATUS_BITS; b++) {
+    if(!(mask & (1 << b))) continue;
+    for(j = 0; j < n; j++) out[j] |= st->bits[b][w + j];
+  }
+  return n;
+}
+
+int dtc_status(struct dtc_store *st, int i) {
+  int b, status = 0;
+  for(b = 0; b < DTC_STATUS_BITS; b++) {
+    if(st->bits[b][i / 64] & (1ULL << (i % 64))) status |= 1 << b;
+  }
+  return status;
+}
+
+int dtc_count(struct dtc_store *st, int mask) {
+  uint64_t words[DTC_CHUNK];
+  int w, j, n, total = 0;
+  for(w = 0; w < (st->count + 63) / 64; w += n) {
+    n = dtc_select(st, mask, w, words);
+    for(j = 0; j < n; j++) total += __builtin_popcountll(words[j]);
+  }
+  return total;
+}
+
+// Writes the DTCs matching mask into out, each as the top size bytes of
+// its code plus the status byte if with_status.  Returns how many were
+// written or -1 if there are more than max.
+int dtc_list(struct dtc_store *st, int mask, unsigned char *out, int size, int with_status, int max) {
+  uint64_t words[DTC_CHUNK], m;
+  int w, j, i, k, n, total = 0;
+  for(w = 0; w < (st->count + 63) / 64; w += n) {
+    n = dtc_select(st, mask, w, words);
+    for(j = 0; j < n; j++) {
+      for(m = words[j]; m; m &= m - 1) {
+        if(total == max) return -1;
+        i = (w + j) * 64 + __builtin_ctzll(m);
+        for(k = 0; k < size; k++) *out++ = st->codes[i] >> (16 - k * 8);
+        if(with_status) *out++ = dtc_status(st, i);
+        total++;
+      }
+    }
+  }
+  return total;
+}
+
+// The DTCs in bitmap word w that match mask
+uint64_t dtc_word(struct dtc_store *st, int mask, int w) {
+  uint64_t m = 0;
+  int b;
+  if(mask < 0) return (w + 1) * 64 > st->count ? (1ULL << (st->count % 64)) - 1 : ~0ULL;
+  for(b = 0; b <= DTC_STATUS_BITS; b++) {
+    if(mask & (1 << b)) m |= st->bits[b][w];
+  }
+  return m;
+}
+
+// Returns the first DTC from i on that matches mask, or -1
+int dtc_next(struct dtc_store *st, int mask, int i) {
+  uint64_t m;
+  int w;
+  for(w = i / 64; w < (st->count + 63) / 64; w++) {
+    m = dtc_word(st, mask, w);
+    if(w == i / 64) m &= ~0ULL << (i % 64);
+    if(m) return w * 64 + __builtin_ctzll(m);
+  }
+  return -1;
+}
+
+// Returns the last DTC up to i that matches mask, or -1
+int dtc_prev(struct dtc_store *st, int mask, int i) {
+  uint64_t m;
+  int w;
+  for(w = i / 64; w >= 0; w--) {
+    m = dtc_word(st, mask, w);
+    if(w == i / 64 && i % 64 < 63) m &= (2ULL << (i % 64)) - 1;
+    if(m) return w * 64 + 63 - __builtin_clzll(m);
+  }
+  return -1;
+}
+
+// Copies len bytes of a streamed DTC report from offset into out.  The
+// header is in sess->buf, each record after it is a 3 byte DTC and its
+// status, found by walking from the last one looked up.  Called with
+// the store's read lock held.
+void dtc_report_read(struct isotp_session *sess, int offset, unsigned char *out, int len) {
+  struct dtc_store *st = sess->dtcs;
+  int rec, k;
+  for(; len > 0 && offset < 3; len--) *out++ = sess->buf[offset++];
+  for(; len > 0; len--, offset++) {
+    rec = (offset - 3) / 4;
+    while(sess->dtc_rec > rec) {
+      // Frames built again after ENOBUFS
+      sess->dtc_i = dtc_prev(st, sess->dtc_mask, sess->dtc_i - 1);
+      sess->dtc_rec--;
+    }
+    while(sess->dtc_rec < rec) {
+      sess->dtc_i = dtc_next(st, sess->dtc_mask, sess->dtc_i + 1);
+      sess->dtc_rec++;
+    }
+    k = (offset - 3) % 4;
+    *out++ = k < 3 ? st->codes[sess->dtc_i] >> (16 - k * 8) : (uint32_t)dtc_status(st, sess->dtc_i);
+  }
+}
+
+// Sends a report of the n DTCs matching mask that is too big to build in
+// a buffer.  The consecutive frames are filled from the store as they go
+// out, if it changes before the end (gen is the generation n was counted
+// at) the transfer is aborted rather than sending a mix of both.
+void isotp_send_dtcs(int can, int dest, unsigned char *head, struct dtc_store *st, int mask, int n, unsigned int gen) {
+  struct isotp_session *sess;
+  unsigned char first_buf[CANFD_MAX_DLEN];
+  int first, size = 3 + n * 4;
+  if(tx_count > 0) tx_flush(can);
+  sess = isotp_session_get(isotp_rx_id(dest), dest, -1);
+  if(!sess) return;
+  memcpy(sess->buf, head, 3);
+  sess->src = sess->buf;
+  sess->src_off = 0;
+  sess->cfs = NULL;
+  sess->dtcs = st;
+  sess->dtc_mask = mask;
+  sess->dtc_gen = gen;
+  sess->dtc_rec = -1;
+  sess->dtc_i = -1;
+  pthread_rwlock_rdlock(&st->lock);
+  if(st->gen != gen) {
+    pthread_rwlock_unlock(&st->lock);
+    plog("ISOTP: DTCs changed, dropping report to %03X\n", dest);
+    return;
+  }
+  dtc_report_read(sess, 0, first_buf, isotp_dl());
+  pthread_rwlock_unlock(&st->lock);
+  first = isotp_first_frame(tx_frame(dest), (char *)first_buf, size, -1);
+  isotp_session_start(can, sess, size, first);
+}
+
+// Clears every DTC, or the one whose code is group.  Returns -1 if there
+// is no such DTC.
+int dtc_clear(struct dtc_store *st, uint32_t group) {
+  int b, i, words = (st->count + 63) / 64;
+  if(group == 0xFFFFFF) {
+    st->gen++;
+    for(b = 0; b < DTC_STATUS_BITS; b++) {
+      if(DTC_CLEARED & (1 << b)) {
+        for(i = 0; i < words; i++) st->bits[b][i] = ~0ULL;
+        if(st->count % 64) st->bits[b][words - 1] = (1ULL << (st->count % 64)) - 1;
+      } else {
+        memset(st->bits[b], 0, words * sizeof(uint64_t));
+      }
+    }
+    return 0;
+  }
+  for(i = 0; i < st->count && st->codes[i] != group; i++);
+  if(i == st->count) return -1;
+  st->gen++;
+  for(b = 0; b < DTC_STATUS_BITS; b++) {
+    if(DTC_CLEARED & (1 << b)) st->bits[b][i / 64] |= 1ULL << (i % 64);
+    else st->bits[b][i / 64] &= ~(1ULL << (i % 64));
+  }
+  return 0;
+}
+
+// OBD modes 03, 07 and 0A
+void send_obd_dtcs(int can, int mask) {
+  struct ecu *ecu = cur_req.ecu;
+  int n = 0;
+  if(ecu->dtcs) {
+    pthread_rwlock_rdlock(&ecu->dtcs->lock);
+    n = dtc_list(ecu->dtcs, mask, &resp_buf[2], 2, 0, 255);
+    if(n < 0) {
+      if(verbose) plog("More than 255 DTCs match, sending the first 255\n");
+      n = 255;
+    }
+    pthread_rwlock_unlock(&ecu->dtcs->lock);
+  }
+  resp_buf[0] = cur_req.data[0] + 0x40;
+  resp_buf[1] = n;
+  isotp_send_to(can, (char *)resp_buf, 2 + n * 2, ecu->resp_id);
+}
+
+// ReadDTCInformation, number of DTCs and DTCs by status mask and all
+// supported DTCs
+void handle_read_dtc_info(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct dtc_store *st = ecu->dtcs;
+  unsigned int gen = 0;
+  int sub, mask, n = 0, stream = 0;
+  (void)frame;
+  if(cur_req.len < 2) {
+    send_nrc(can, UDS_SID_READ_DTC, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  sub = cur_req.data[1] & 0x7F;
+  if(sub != UDS_DTC_REPORT_NUMBER_BY_MASK && sub != UDS_DTC_REPORT_BY_MASK && sub != UDS_DTC_REPORT_SUPPORTED) {
+    send_nrc(can, UDS_SID_READ_DTC, UDS_NRC_SUB_FUNCTION_NOT_SUPPORTED, ecu->resp_id);
+    return;
+  }
+  if(cur_req.len != (sub == UDS_DTC_REPORT_SUPPORTED ? 2 : 3)) {
+    send_nrc(can, UDS_SID_READ_DTC, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  mask = sub == UDS_DTC_REPORT_SUPPORTED ? 0 : cur_req.data[2];
+  if(verbose) plog("Read DTC information %02X, status mask %02X\n", sub, mask);
+  if(sub == UDS_DTC_REPORT_SUPPORTED) mask = -1;
+  resp_buf[0] = UDS_SID_READ_DTC + 0x40;
+  resp_buf[1] = sub;
+  resp_buf[2] = 0xFF; // DTCStatusAvailabilityMask
+  if(st) pthread_rwlock_rdlock(&st->lock);
+  if(sub == UDS_DTC_REPORT_NUMBER_BY_MASK) {
+    if(st) n = dtc_count(st, mask);
+    resp_buf[3] = 0x01; // ISO 14229-1 DTC format
+    resp_buf[4] = n >> 8;
+    resp_buf[5] = n & 0xFF;
+    n = 6;
+  } else {
+    if(st) n = dtc_count(st, mask);
+    if(3 + n * 4 <= ISOTP_BUF_SIZE) {
+      if(st) dtc_list(st, mask, &resp_buf[3], 3, 1, n);
+      n = 3 + n * 4;
+    } else if(isotp_backend == ISOTP_USER && !mutate_rate && !tp_rate) {
+      // Too big for a buffer, the CFs are built straight from the store
+      gen = st->gen;
+      stream = 1;
+    } else {
+      n = -1;
+    }
+  }
+  if(st) pthread_rwlock_unlock(&st->lock);
+  if(n < 0) {
+    send_nrc(can, UDS_SID_READ_DTC, UDS_NRC_RESPONSE_TOO_LONG, ecu->resp_id);
+    return;
+  }
+  if(stream) isotp_send_dtcs(can, ecu->resp_id, resp_buf, st, mask, n, gen);
+  else isotp_send_to(can, (char *)resp_buf, n, ecu->resp_id);
+}
+
+// ClearDiagnosticInformation, all DTCs (FFFFFF) or a single one
+void handle_clear_dtc(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  uint32_t group;
+  int ret = 0;
+  char resp[1];
+  (void)frame;
+  if(cur_req.len != 4) {
+    send_nrc(can, UDS_SID_CLEAR_DTC, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  group = (cur_req.data[1] << 16) | (cur_req.data[2] << 8) | cur_req.data[3];
+  if(verbose) plog("Clear DTCs %06X\n", group);
+  if(ecu->dtcs) {
+    pthread_rwlock_wrlock(&ecu->dtcs->lock);
+    ret = dtc_clear(ecu->dtcs, group);
+    pthread_rwlock_unlock(&ecu->dtcs->lock);
+  }
+  if(ret < 0 || (!ecu->dtcs && group != 0xFFFFFF)) {
+    send_nrc(can, UDS_SID_CLEAR_DTC, UDS_NRC_REQUEST_OUT_OF_RANGE, ecu->resp_id);
+    return;
+  }
+  resp[0] = UDS_SID_CLEAR_DTC + 0x40;
+  isotp_send_to(can, resp, 1, ecu->resp_id);
+}
+
+// OBD mode 04
+void handle_clear_codes(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  char resp[1];
+  (void)frame;
+  if(verbose) plog("Received request to clear trouble codes\n");
+  if(ecu->dtcs) {
+    pthread_rwlock_wrlock(&ecu->dtcs->lock);
+    dtc_clear(ecu->dtcs, 0xFFFFFF);
+    pthread_rwlock_unlock(&ecu->dtcs->lock);
+  }
+  resp[0] = OBD_MODE_CLEAR_DTC + 0x40;
+  isotp_send_to(can, resp, 1, ecu->resp_id);
+}
+
+void send_dtcs(int can, char total, struct canfd_frame frame) {
+  char resp[1024];
+  int i;
+  memset(resp, 0, 1024);
+  switch(fuzz_level) {
+    case 0:  // Default is to make P01XX where XX = total number of DTCs
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = total; // Total DTCs
+      for(i = 0; i <= total*2; i+=2) {
+        resp[2+i] = 1;
+        resp[2+i+1] = i;
+      }
+      isotp_send(can, resp, 2+(total*2));
+      break;
+    case 1:
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = (unsigned char)prng_next();
+      if (verbose) plog("Randomized total DTCs to %d real DTCs %d\n", resp[1], total);
+      for(i = 0; i <= total*2; i+=2) {
+        resp[2+i] = 1;
+        resp[2+i+1] = i;
+      }
+      isotp_send(can, resp, 2+(total*2));
+      break;
+    case 2:
+    default:
+      resp[0] = frame.data[1] + 0x40;
+      total = prng_below(128);
+      resp[1] = total;
+      if (verbose) plog("Randomized total DTCs to %d\n", resp[1]);
+      for(i = 0; i <= total*2; i+=2) {
+        resp[2+i] = (unsigned char)prng_next();
+        resp[2+i+1] = (unsigned char)prng_next();
+      }
+      if (verbose) {
+        plog("DTC random data is:\n");
+        print_bin(&resp[2], total*2);
+      }
+      isotp_send(can, resp, 2+(total*2));
+      break;
+  }
+}
+
+unsigned char calc_vin_checksum(char *vin, int size) {
+  char w[17] = { 8, 7, 6, 5, 4, 3, 2, 10, 0, 9, 8, 7, 6, 5, 4, 3, 2 };
+  int i;
+  int checksum = 0;
+  int num;
+  if(size > 17) size = 17; // Fuzzed VINs can be longer, only 17 positions have a weight
+  for(i=0; i < size; i++) {
+    if(vin[i] == 'I' || vin[i] == 'O' || vin[i] == 'Q') {
+      num = 0;
+    } else {
+      if(vin[i] >= '0' && vin[i] <='9') num = vin[i] - '0';
+      if(vin[i] >= 'A' && vin[i] <='I') num = (vin[i] - 'A') + 1;
+      if(vin[i] >= 'J' && vin[i] <='R') num = (vin[i] - 'J') + 1;
+      if(vin[i] >= 'S' && vin[i] <='Z') num = (vin[i] - 'S') + 2;
+    }
+    checksum += num * w[i];
+  }
+  checksum = checksum % 11;
+  if (checksum == 10) return 'X';
+  return ('0' + checksum);
+}
+
+void send_nrc(int can, int sid, int nrc, int id) {
+  char resp[4];
+  if(verbose) plog("Responded with negative response %02X to SID %02X\n", nrc, sid);
+  resp[0] = 0x7f;
+  resp[1] = sid;
+  resp[2] = nrc;
+  isotp_send_to(can, resp, 3, id);
+}
+
+void send_error_snfs(int can, struct canfd_frame frame) {
+  char resp[4];
+  if(verbose) plog("Responded with Sub Function Not Supported\n");
+  resp[0] = 0x7f;
+  resp[1] = frame.data[1];
+  resp[2] = UDS_NRC_SUB_FUNCTION_NOT_SUPPORTED;
+  isotp_send(can, resp, 3);
+}
+
+void send_error_roor(int can, struct canfd_frame frame, int id) {
+  send_nrc(can, frame.data[1], UDS_NRC_REQUEST_OUT_OF_RANGE, id);
+}
+
+void generic_OK_resp(int can, struct canfd_frame frame) {
+  char resp[4];
+  if(verbose > 1) plog("Responding with a generic OK message\n");
+  resp[0] = frame.data[1] + 0x40;
+  resp[1] = frame.data[2];
+  resp[2] = 0;
+  isotp_send(can, resp, 3);
+}
+
+void generic_OK_resp_to(int can, struct canfd_frame frame, int id) {
+  char resp[4];
+  if(verbose > 1) plog("Responding with a generic OK message\n");
+  resp[0] = frame.data[1] + 0x40;
+  resp[1] = frame.data[2];
+  resp[2] = 0;
+  isotp_send_to(can, resp, 3, id);
+}
+
+void handle_current_data(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received Current info request\n");
+  char resp[8];
+  switch(frame.data[2]) {
+    case 0x00: // Supported PIDs
+      if(verbose) plog("Responding with a generic set of PIDs (1-20)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x01: // MIL & DTC Status
+      if(verbose) plog("Responding to MIL and DTC Status request\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0x00;
+      resp[3] = 0x07;
+      resp[4] = 0xE5;
+      resp[5] = 0xE5;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x20: // More supported PIDs (21-40)
+      if(verbose) plog("Responding with PIDs supported (21-40)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x40: // More supported PIDs (41-60)
+      if(verbose) plog("Responding with PIDs supported (41-60)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x41: // Monitor status this drive cycle
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0;
+      resp[3] = 0x0F;
+      resp[4] = 0xFF;
+      resp[5] = 0x00;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x60: // More supported PIDs (61-80)
+      if(verbose) plog("Responding with PIDs supported (61-80)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x80: // More supported PIDs (81-100)
+      if(verbose) plog("Responding with PIDs supported (81-100)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    case 0xA0:  // More Supported PIDs (101-120)
+      if(verbose) plog("Responding with PIDs supported (101-120)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    case 0xC0: // More supported PIDs (121-140)
+      if(verbose) plog("Responding with PIDs supported (121-140)\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0xBF;
+      resp[3] = 0xBF;
+      resp[4] = 0xB9;
+      resp[5] = 0x93;
+      isotp_send(can, resp, 6);
+      break;
+    default:
+      if(verbose) plog("Note: Requested unsupported service %02X\n", frame.data[2]);
+      break;
+  }
+}
+
+void handle_vehicle_info(int can, struct canfd_frame frame) {
+  char buf[256];
+  int pktsize = 0;
+  unsigned char chksum;
+  if(verbose) plog("Received Vehicle info request\n");
+  char resp[300];
+  switch(frame.data[2]) {
+    case 0x00: // Supported PIDs
+      if(verbose) plog("Replying with ALL Pids supported\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0x55;
+      resp[3] = 0;
+      resp[4] = 0;
+      resp[5] = 0;
+      isotp_send(can, resp, 6);
+      break;
+    case 0x02: // Get VIN
+      switch(fuzz_level) {
+        case 0:
+          if(verbose) plog("Sending VIN %s\n", vin);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 1;
+          memcpy(&resp[3], vin, strlen(vin));
+          isotp_send(can, resp, 3 + strlen(vin));
+          break;
+        case 1:
+          if(verbose) plog("Fuzzing VIN with printable chars\n");
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 1;
+          gen_data(DATA_ALPHANUM, buf, 17);
+          buf[17] = 0;
+          chksum = calc_vin_checksum(buf, 17);
+          buf[8] = chksum;
+          if(verbose) plog("Using VIN: %s\n", buf);
+          memcpy(&resp[3], buf, 17);
+          isotp_send(can, resp, 3 + 17);
+          break;
+        case 2:
+        case 3:  // At 3 the ISOTP spec gets flaky
+          pktsize = prng_below(252);
+          if(verbose) plog("Fuzzing big VIN with printable chars\n");
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 1;
+          gen_data(DATA_ALPHANUM, buf, pktsize);
+          buf[pktsize] = 0;
+          chksum = calc_vin_checksum(buf, pktsize);
+          buf[8] = chksum;
+          if(verbose) plog("Using big VIN (%d chars): %s\n",pktsize, buf);
+          memcpy(&resp[3], buf, pktsize);
+          isotp_send(can, resp, 3 + pktsize);
+          break;
+        case 4:
+          if(verbose) plog("Fuzzing VIN with binary data\n");
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 1;
+          gen_data(DATA_BINARY, buf, 17);
+          buf[17] = 0;
+          chksum = calc_vin_checksum(buf, 17);
+          buf[8] = chksum;
+          if(verbose) print_bin(buf, 17);
+          memcpy(&resp[3], buf, 17);
+          isotp_send(can, resp, 3 + 17);
+          break;
+        case 5:
+        default:
+          pktsize = prng_below(252);
+          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 1;
+          gen_data(DATA_BINARY, buf, pktsize);
+          buf[pktsize] = 0;
+          if(verbose) print_bin(buf, pktsize);
+          memcpy(&resp[3], buf, pktsize);
+          isotp_send(can, resp, 3 + pktsize);
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void handle_pending_codes(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received request for pending trouble codes\n");
+  if(fuzz_level) send_dtcs(can, 20, frame);
+  else send_obd_dtcs(can, DTC_PENDING);
+}
+
+void handle_stored_codes(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received request for stored trouble codes\n");
+  if(fuzz_level) send_dtcs(can, 2, frame);
+  else send_obd_dtcs(can, DTC_CONFIRMED);
+}
+
+// TODO: This is wrong.  Record a real transaction to see the format
+void handle_freeze_frame(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received request for freeze frame code\n");
+  //send_dtcs(can, 1, frame);
+  char resp[4];
+  resp[0] = frame.data[1] + 0x40;
+  resp[1] = 0x01;
+  resp[2] = 0x01;
+  isotp_send(can, resp, 3);
+}
+
+void handle_perm_codes(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received request for permanent trouble codes\n");
+  if(fuzz_level) send_dtcs(can, 0, frame);
+  else send_obd_dtcs(can, DTC_PERMANENT);
+}
+
+void handle_dsc(int can, struct canfd_frame frame) {
+  //if(verbose) plog("Received DSC Request\n");
+  //send_error_snfs(can, frame);
+  if(verbose) plog("Received DSC Request giving VCDS respose\n");
+      frame.can_id = 0x77A;
+      frame.len = 8;
+      frame.data[0] = 0x06;
+      frame.data[1] = 0x50;
+      frame.data[2] = 0x03;
+      frame.data[3] = 0x00;
+      frame.data[4] = 0x32;
+      frame.data[5] = 0x01;
+      frame.data[6] = 0xF4;
+      frame.data[7] = 0xAA;
+      tx_send_frame(can, &frame);
+}
+
+/*
+  ECU Memory, based on VCDS response for now
+*/
+// Engine ECU DIDs
+struct did_entry engine_dids[] = {
+  { 0x0600, 30, "\x02\x01\x00\x17\x26\xF2\x00\x00\x5B\x00\x12\x08\x58\x00\x00\x00\x00\x01\x01\x01\x00\x01\x00\x00\x00\x00\x00\x00\x00\x00" },
+  { 0xF187, 11, "04E906323F " }, // Note VCDS pads with 55's
+  { 0xF189, 4, "8410" },
+  { 0xF19E, 16, "EV_GatewEVConti" },
+  { 0xF1A2, 6, "004010" },
+};
+
+// ReadDataByIdentifier, any number of DIDs in one request.  Unknown DIDs
+// are left out of the answer, if none are known it's RequestOutOfRange.
+void handle_read_data_by_id(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  unsigned char *data;
+  int i, did, len, n = 1, found = 0;
+  if(verbose) plog("Recieved Read Data by ID, %d DIDs\n", (cur_req.len - 1) / 2);
+  if(cur_req.len < 3 || (cur_req.len - 1) % 2) {
+    send_nrc(can, UDS_SID_READ_DATA_BY_ID, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  resp_buf[0] = UDS_SID_READ_DATA_BY_ID + 0x40;
+  for(i = 1; i < cur_req.len; i += 2) {
+    did = (cur_req.data[i] << 8) | cur_req.data[i + 1];
+    data = ecu_find_did(ecu, did, &len);
+    if(!data) {
+      if(verbose) plog("Unknown DID %04X\n", did);
+      continue;
+    }
+    if(n + 2 + len > ISOTP_BUF_SIZE) {
+      send_nrc(can, UDS_SID_READ_DATA_BY_ID, UDS_NRC_RESPONSE_TOO_LONG, ecu->resp_id);
+      return;
+    }
+    if(verbose) plog("Read data by ID %04X (%d bytes)\n", did, len);
+    resp_buf[n++] = did >> 8;
+    resp_buf[n++] = did & 0xFF;
+    memcpy(&resp_buf[n], data, len);
+    n += len;
+    found++;
+  }
+  if(!found) {
+    if(cur_req.len == 3 && ecu->did_fallback) ecu->did_fallback(can, frame);
+    else send_nrc(can, UDS_SID_READ_DATA_BY_ID, UDS_NRC_REQUEST_OUT_OF_RANGE, ecu->resp_id);
+    return;
+  }
+  isotp_send_to(can, (char *)resp_buf, n, ecu->resp_id);
+}
+
+// ReadDataByPeriodicIdentifier.  Periodic DIDs are the low byte of
+// 0xF2xx and go out as single frames on our response ID.
+void handle_read_data_by_id_periodic(int can, struct canfd_frame frame) {
+  char resp[2];
+  int i, mode, resp_id = cur_req.ecu->resp_id;
+  if(verbose) plog("Received Read Data by Periodic ID\n");
+  mode = cur_req.len > 1 ? cur_req.data[1] : 0;
+  if(mode < 1 || mode > 4 || (mode < 4 && cur_req.len < 3)) {
+    send_error_roor(can, frame, resp_id);
+    return;
+  }
+  if(mode == 4) {  // Stop sending
+    if(cur_req.len < 3) periodic_stop(PERIODIC_UDS, resp_id, -1);
+    for(i = 2; i < cur_req.len; i++) periodic_stop(PERIODIC_UDS, resp_id, cur_req.data[i]);
+  } else {
+    if(verbose) plog(" + %d DIDs at a %s rate\n", cur_req.len - 2, periodic_rate_names[mode - 1]);
+    for(i = 2; i < cur_req.len; i++) {
+      if(periodic_start(PERIODIC_UDS, resp_id, cur_req.data[i], mode - 1) < 0) {
+        send_error_roor(can, frame, resp_id);
+        return;
+      }
+    }
+  }
+  resp[0] = 0x6A;
+  isotp_send_to(can, resp, 1, resp_id);
+}
+
+// Parses an addressAndLengthFormatIdentifier (size bytes in the high
+// nibble, address bytes in the low) and what follows it.  len is what
+// is left of the request.  Returns 0 or the NRC to answer with.
+int uds_addr_len(unsigned char *p, int len, uint64_t *addr, uint64_t *size) {
+  int i, addr_len, size_len;
+  if(len < 1) return UDS_NRC_INCORRECT_LENGTH;
+  addr_len = p[0] & 0x0F;
+  size_len = p[0] >> 4;
+  if(addr_len < 1 || addr_len > 4 || size_len < 1 || size_len > 4) return UDS_NRC_REQUEST_OUT_OF_RANGE;
+  if(len != 1 + addr_len + size_len) return UDS_NRC_INCORRECT_LENGTH;
+  *addr = *size = 0;
+  for(i = 0; i < addr_len; i++) *addr = (*addr << 8) | p[1 + i];
+  for(i = 0; i < size_len; i++) *size = (*size << 8) | p[1 + addr_len + i];
+  return 0;
+}
+
+// ReadMemoryByAddress, answered from the ECU's mapped memory images
+void handle_read_mem_by_address(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct mem_region *r;
+  uint64_t addr, size;
+  unsigned char sid = UDS_SID_READ_MEM_BY_ADDRESS + 0x40;
+  int nrc = uds_addr_len(&cur_req.data[1], cur_req.len - 1, &addr, &size);
+  (void)frame;
+  if(nrc) {
+    send_nrc(can, UDS_SID_READ_MEM_BY_ADDRESS, nrc, ecu->resp_id);
+    return;
+  }
+  if(verbose) plog("Read memory by address %08llX, %llu bytes\n", (unsigned long long)addr, (unsigned long long)size);
+  r = mem_find(ecu, addr, size);
+  if(!r || size == 0 || size >= INT_MAX) {
+    send_nrc(can, UDS_SID_READ_MEM_BY_ADDRESS, UDS_NRC_REQUEST_OUT_OF_RANGE, ecu->resp_id);
+    return;
+  }
+  isotp_send_mapped(can, ecu->resp_id, &sid, 1, r->map + (addr - r->base), size);
+}
+
+/*
+ * Uploads (RequestUpload, TransferData, RequestTransferExit)
+ *
+ * The tester asks for a region of a memory image and then pulls it in
+ * blocks of up to XFER_BLOCK_LEN bytes, each tagged with a sequence
+ * counter that starts at 1 and wraps to 0.  Blocks go out straight from
+ * the mapping and the next one is paged in while the tester handles
+ * the current one.
+ */
+struct xfer *xfer_find(struct ecu *ecu) {
+  int i;
+  for(i = 0; i < XFER_MAX; i++) {
+    if(xfers[i].ecu == ecu) return &xfers[i];
+  }
+  return NULL;
+}
+
+// Size of the next block, the last one can be short
+int xfer_next_len(struct xfer *x) {
+  return x->size - x->done < (uint64_t)x->block ? (int)(x->size - x->done) : x->block;
+}
+
+// Asks the kernel to page in the mapped block after this one
+void xfer_readahead(struct xfer *x) {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t start, end;
+  if(x->done >= x->size) return;
+  start = (uintptr_t)(x->data + x->done) & ~(page - 1);
+  end = (uintptr_t)(x->data + x->done + xfer_next_len(x));
+  madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+void xfer_report(struct xfer *x) {
+  double secs = (now_us() - x->start_us) / 1000000.0;
+  if(secs <= 0) secs = 0.000001;
+  plog("%s %s %llu of %llu bytes in %lu blocks, %.3fs, %.0f bytes/s, %.1f blocks/s\n", x->ecu->name,
+       x->dir == XFER_UPLOAD ? "upload" : "download", (unsigned long long)x->done, (unsigned long long)x->size,
+       x->blocks, secs, x->done / secs, x->blocks / secs);
+}
+
+// Frees the slot of a transfer that won't see its RequestTransferExit.
+// A download's file is closed as far as it got; this is rare enough to
+// wait for the writer if its queue is full, the sink must not leak.
+void xfer_abort(struct xfer *x, char *why) {
+  if(verbose) plog("%s %s aborted: %s\n", x->ecu->name, x->dir == XFER_UPLOAD ? "upload" : "download", why);
+  xfer_report(x);
+  if(x->dir == XFER_DOWNLOAD) writer_push(x->writer, WRITE_CLOSE, x->sink, 0, 0, -1, 1);
+  x->sink = NULL;
+  x->ecu = NULL;
+}
+
+// Drops transfers whose tester went quiet
+void xfer_check_timeouts() {
+  long now = now_ms();
+  int i;
+  for(i = 0; i < XFER_MAX; i++) {
+    if(xfers[i].ecu && now - xfers[i].last_ms > XFER_S3_MS) xfer_abort(&xfers[i], "S3 timeout");
+  }
+}
+
+void xfer_abort_all(char *why) {
+  int i;
+  for(i = 0; i < XFER_MAX; i++) {
+    if(xfers[i].ecu) xfer_abort(&xfers[i], why);
+  }
+}
+
+void handle_request_upload(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct mem_region *r;
+  struct xfer *x;
+  uint64_t addr, size;
+  unsigned char resp[4];
+  int nrc;
+  (void)frame;
+  if(cur_req.len < 2) {
+    send_nrc(can, UDS_SID_REQUEST_UPLOAD, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  // The tester started over, whatever it was doing before is dropped
+  if((x = xfer_find(ecu))) xfer_abort(x, "new RequestUpload");
+  nrc = uds_addr_len(&cur_req.data[2], cur_req.len - 2, &addr, &size);
+  // dataFormatIdentifier, we don't compress or encrypt
+  if(!nrc && cur_req.data[1] != 0) nrc = UDS_NRC_REQUEST_OUT_OF_RANGE;
+  if(!nrc && (!(r = mem_find(ecu, addr, size)) || size == 0)) nrc = UDS_NRC_REQUEST_OUT_OF_RANGE;
+  if(!nrc && !(x = xfer_find(NULL))) nrc = UDS_NRC_UPLOAD_DOWNLOAD_NOT_ACCEPTED;
+  if(nrc) {
+    send_nrc(can, UDS_SID_REQUEST_UPLOAD, nrc, ecu->resp_id);
+    return;
+  }
+  if(verbose) plog("Request upload %08llX, %llu bytes\n", (unsigned long long)addr, (unsigned long long)size);
+  memset(x, 0, sizeof(*x));
+  x->ecu = ecu;
+  x->dir = XFER_UPLOAD;
+  x->data = r->map + (addr - r->base);
+  x->size = size;
+  x->seq = 1;
+  x->block = XFER_BLOCK_LEN - 2;
+  x->start_us = now_us();
+  x->last_ms = now_ms();
+  xfer_readahead(x);
+  // lengthFormatIdentifier, then maxNumberOfBlockLength counting the SID and counter
+  resp[0] = UDS_SID_REQUEST_UPLOAD + 0x40;
+  resp[1] = 0x20;
+  resp[2] = XFER_BLOCK_LEN >> 8;
+  resp[3] = XFER_BLOCK_LEN & 0xFF;
+  isotp_send_to(can, (char *)resp, 4, ecu->resp_id);
+}
+
+void handle_transfer_data(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct xfer *x = xfer_find(ecu);
+  unsigned char head[2];
+  int seq;
+  (void)frame;
+  if(!x) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_REQUEST_SEQUENCE_ERROR, ecu->resp_id);
+    return;
+  }
+  if(x->dir == XFER_DOWNLOAD) {
+    download_block(can, x);
+    return;
+  }
+  if(cur_req.len != 2) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  seq = cur_req.data[1];
+  head[0] = UDS_SID_TRANSFER_DATA + 0x40;
+  head[1] = seq;
+  if(x->last_len && seq == ((x->seq - 1) & 0xFF)) {
+    // The tester missed our answer and asks for the same block again
+    if(verbose) plog("Repeating upload block %02X\n", seq);
+    isotp_send_mapped(can, ecu->resp_id, head, 2, x->data + x->done - x->last_len, x->last_len);
+    return;
+  }
+  if(seq != x->seq) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER, ecu->resp_id);
+    return;
+  }
+  if(x->done == x->size) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_REQUEST_SEQUENCE_ERROR, ecu->resp_id);
+    return;
+  }
+  x->last_len = xfer_next_len(x);
+  isotp_send_mapped(can, ecu->resp_id, head, 2, x->data + x->done, x->last_len);
+  x->done += x->last_len;
+  x->seq = (x->seq + 1) & 0xFF;
+  x->blocks++;
+  xfer_readahead(x);
+}
+
+void handle_request_xfer_exit(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct xfer *x = xfer_find(ecu);
+  char resp[1];
+  (void)frame;
+  if(!x) {
+    send_nrc(can, UDS_SID_REQUEST_XFER_EXIT, UDS_NRC_REQUEST_SEQUENCE_ERROR, ecu->resp_id);
+    return;
+  }
+  if(x->dir == XFER_DOWNLOAD) {
+    download_exit(can, x);
+    return;
+  }
+  xfer_report(x);
+  x->ecu = NULL;
+  resp[0] = UDS_SID_REQUEST_XFER_EXIT + 0x40;
+  isotp_send_to(can, resp, 1, ecu->resp_id);
+}
+
+/*
+ * Downloads (RequestDownload, TransferData, RequestTransferExit)
+ *
+ * With -d every ECU accepts downloads and saves them as
+ * <dir>/<request id>-<address>.bin.  Blocks are copied into a shared
+ * pool and handed to a writer thread; the tester gets its answer right
+ * away.  If the pool or queue is full it is told to repeat the block.
+ */
+void crc32_init() {
+  uint32_t c;
+  int i, j;
+  for(i = 0; i < 256; i++) {
+    for(c = i, j = 0; j < 8; j++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc32_table[i] = c;
+  }
+}
+
+uint32_t crc32_update(uint32_t crc, unsigned char *data, int len) {
+  crc = ~crc;
+  while(len--) crc = crc32_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+int xfer_buf_get() {
+  int buf = -1;
+  pthread_mutex_lock(&xfer_buf_lock);
+  if(xfer_free_count) buf = xfer_free[--xfer_free_count];
+  pthread_mutex_unlock(&xfer_buf_lock);
+  return buf;
+}
+
+void xfer_buf_put(int buf) {
+  pthread_mutex_lock(&xfer_buf_lock);
+  xfer_free[xfer_free_count++] = buf;
+  pthread_mutex_unlock(&xfer_buf_lock);
+}
+
+// Queues a job for a writer.  Returns -1 if its queue is full, unless
+// wait is set, then it waits for the writer to make room.
+int writer_push(int w, int op, struct sink *sink, uint64_t offset, int len, int buf, int wait) {
+  struct writer *wr = &writers[w];
+  struct write_job *job;
+  pthread_mutex_lock(&wr->lock);
+  while(wait && wr->count == WRITE_QUEUE) pthread_cond_wait(&wr->room, &wr->lock);
+  if(wr->count == WRITE_QUEUE) {
+    pthread_mutex_unlock(&wr->lock);
+    return -1;
+  }
+  job = &wr->jobs[(wr->head + wr->count) % WRITE_QUEUE];
+  job->op = op;
+  job->sink = sink;
+  job->offset = offset;
+  job->len = len;
+  job->buf = buf;
+  wr->count++;
+  pthread_cond_signal(&wr->ready);
+  pthread_mutex_unlock(&wr->lock);
+  return 0;
+}
+
+void writer_job(struct write_job *job) {
+  struct sink *sink = job->sink;
+  unsigned char *data;
+  ssize_t n;
+  int left;
+  switch(job->op) {
+    case WRITE_OPEN:
+      sink->fd = open(sink->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(sink->fd < 0) {
+        perror(sink->path);
+        __atomic_store_n(&sink->failed, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    case WRITE_DATA:
+      data = xfer_bufs[job->buf];
+      for(left = job->len; sink->fd >= 0 && !sink->failed && left > 0; left -= n, data += n) {
+        n = pwrite(sink->fd, data, left, job->offset + (job->len - left));
+        if(n < 0) {
+          if(errno == EINTR) {
+            n = 0;
+            continue;
+          }
+          perror(sink->path);
+          __atomic_store_n(&sink->failed, 1, __ATOMIC_RELAXED);
+          break;
+        }
+        sink->written += n;
+      }
+      xfer_buf_put(job->buf);
+      break;
+    case WRITE_CLOSE:
+      if(sink->fd >= 0 && close(sink->fd) < 0) {
+        perror(sink->path);
+        sink->failed = 1;
+      }
+      if(!sink->failed) plog("Saved %llu bytes to %s\n", (unsigned long long)sink->written, sink->path);
+      free(sink);
+      break;
+  }
+}
+
+void *writer_run(void *arg) {
+  struct writer *wr = arg;
+  struct write_job job;
+  pthread_mutex_lock(&wr->lock);
+  for(;;) {
+    while(!wr->count && !wr->stop) pthread_cond_wait(&wr->ready, &wr->lock);
+    if(!wr->count) break;
+    job = wr->jobs[wr->head];
+    wr->head = (wr->head + 1) % WRITE_QUEUE;
+    wr->count--;
+    pthread_cond_signal(&wr->room);
+    pthread_mutex_unlock(&wr->lock);
+    writer_job(&job);
+    pthread_mutex_lock(&wr->lock);
+  }
+  pthread_mutex_unlock(&wr->lock);
+  return NULL;
+}
+
+void handle_request_download(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct xfer *x = NULL;
+  struct sink *sink;
+  uint64_t addr, size;
+  unsigned char resp[4];
+  int nrc, w;
+  (void)frame;
+  if(cur_req.len < 2) {
+    send_nrc(can, UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_INCORRECT_LENGTH, ecu->resp_id);
+    return;
+  }
+  if((x = xfer_find(ecu))) xfer_abort(x, "new RequestDownload");
+  nrc = uds_addr_len(&cur_req.data[2], cur_req.len - 2, &addr, &size);
+  if(!nrc && cur_req.data[1] != 0) nrc = UDS_NRC_REQUEST_OUT_OF_RANGE;
+  if(!nrc && size == 0) nrc = UDS_NRC_REQUEST_OUT_OF_RANGE;
+  if(!nrc && !(x = xfer_find(NULL))) nrc = UDS_NRC_UPLOAD_DOWNLOAD_NOT_ACCEPTED;
+  if(nrc) {
+    send_nrc(can, UDS_SID_REQUEST_DOWNLOAD, nrc, ecu->resp_id);
+    return;
+  }
+  sink = malloc(sizeof(struct sink));
+  if(!sink) {
+    send_nrc(can, UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_UPLOAD_DOWNLOAD_NOT_ACCEPTED, ecu->resp_id);
+    return;
+  }
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = -1;
+  snprintf(sink->path, sizeof(sink->path), "%s/%03X-%08llX.bin", download_dir, ecu->req_id, (unsigned long long)addr);
+  w = __atomic_fetch_add(&writer_next, 1, __ATOMIC_RELAXED) % XFER_WRITERS;
+  if(writer_push(w, WRITE_OPEN, sink, 0, 0, -1, 0) < 0) {
+    free(sink);
+    send_nrc(can, UDS_SID_REQUEST_DOWNLOAD, UDS_NRC_BUSY_REPEAT_REQUEST, ecu->resp_id);
+    return;
+  }
+  if(verbose) plog("Request download %08llX, %llu bytes\n", (unsigned long long)addr, (unsigned long long)size);
+  memset(x, 0, sizeof(*x));
+  x->ecu = ecu;
+  x->dir = XFER_DOWNLOAD;
+  x->size = size;
+  x->seq = 1;
+  x->block = XFER_BLOCK_LEN - 2;
+  x->start_us = now_us();
+  x->last_ms = now_ms();
+  x->sink = sink;
+  x->writer = w;
+  resp[0] = UDS_SID_REQUEST_DOWNLOAD + 0x40;
+  resp[1] = 0x20;
+  resp[2] = XFER_BLOCK_LEN >> 8;
+  resp[3] = XFER_BLOCK_LEN & 0xFF;
+  isotp_send_to(can, (char *)resp, 4, ecu->resp_id);
+}
+
+void download_block(int can, struct xfer *x) {
+  int resp_id = x->ecu->resp_id;
+  int seq, len, buf;
+  char resp[2];
+  if(cur_req.len < 3) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_INCORRECT_LENGTH, resp_id);
+    return;
+  }
+  seq = cur_req.data[1];
+  len = cur_req.len - 2;
+  resp[0] = UDS_SID_TRANSFER_DATA + 0x40;
+  resp[1] = seq;
+  if(x->last_len && seq == ((x->seq - 1) & 0xFF)) {
+    // Our answer got lost, the block is already on its way to disk
+    if(verbose) plog("Download block %02X repeated\n", seq);
+    isotp_send_to(can, resp, 2, resp_id);
+    return;
+  }
+  if(seq != x->seq) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER, resp_id);
+    return;
+  }
+  if(len > x->block || (uint64_t)len > x->size - x->done) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_REQUEST_OUT_OF_RANGE, resp_id);
+    return;
+  }
+  if(__atomic_load_n(&x->sink->failed, __ATOMIC_RELAXED)) {
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_GENERAL_PROGRAMMING_FAILURE, resp_id);
+    return;
+  }
+  buf = xfer_buf_get();
+  if(buf >= 0) memcpy(xfer_bufs[buf], &cur_req.data[2], len);
+  if(buf < 0 || writer_push(x->writer, WRITE_DATA, x->sink, x->done, len, buf, 0) < 0) {
+    // The disk is behind, the tester tries again shortly
+    if(buf >= 0) xfer_buf_put(buf);
+    send_nrc(can, UDS_SID_TRANSFER_DATA, UDS_NRC_BUSY_REPEAT_REQUEST, resp_id);
+    return;
+  }
+  x->crc = crc32_update(x->crc, &cur_req.data[2], len);
+  x->done += len;
+  x->last_len = len;
+  x->seq = (x->seq + 1) & 0xFF;
+  x->blocks++;
+  isotp_send_to(can, resp, 2, resp_id);
+}
+
+void download_exit(int can, struct xfer *x) {
+  int resp_id = x->ecu->resp_id;
+  // The close frees the sink, so look before queueing it.  Writes still
+  // queued behind it can only fail in the log.
+  int failed = __atomic_load_n(&x->sink->failed, __ATOMIC_RELAXED);
+  char resp[1];
+  if(writer_push(x->writer, WRITE_CLOSE, x->sink, 0, 0, -1, 0) < 0) {
+    send_nrc(can, UDS_SID_REQUEST_XFER_EXIT, UDS_NRC_BUSY_REPEAT_REQUEST, resp_id);
+    return;
+  }
+  xfer_report(x);
+  plog("%s download CRC32 %08X\n", x->ecu->name, x->crc);
+  x->ecu = NULL;
+  if(failed) {
+    send_nrc(can, UDS_SID_REQUEST_XFER_EXIT, UDS_NRC_GENERAL_PROGRAMMING_FAILURE, resp_id);
+    return;
+  }
+  if(x->done < x->size) {
+    send_nrc(can, UDS_SID_REQUEST_XFER_EXIT, UDS_NRC_REQUEST_SEQUENCE_ERROR, resp_id);
+    return;
+  }
+  resp[0] = UDS_SID_REQUEST_XFER_EXIT + 0x40;
+  isotp_send_to(can, resp, 1, resp_id);
+}
+
+/*
+ GM
+*/
+
+// Read DID from ID (GM)
+// For now we are only setting this up to work with the BCM
+// 244   [3]  02 1A 90
+void handle_gm_read_did_by_id(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received GM Read DID by ID Request\n");
+  char resp[300];
+  char buf[256];
+  char *tracenum = "874602RA51950204";
+  unsigned char chksum;
+  int pktsize;
+  switch(frame.data[2]) {
+    case 0x90:  // VIN
+      if(verbose) plog(" + Requested VIN\n");
+      switch(fuzz_level) {
+        case 0:
+          if(verbose) plog("Sending VIN %s\n", vin);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          memcpy(&resp[2], vin, strlen(vin));
+          isotp_send_to(can, resp, 2 + strlen(vin), 0x644);
+          break;
+        case 1:
+          if(verbose) plog("Fuzzing VIN with printable chars\n");
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          gen_data(DATA_ALPHANUM, buf, 17);
+          buf[17] = 0;
+          chksum = calc_vin_checksum(buf, 17);
+          buf[8] = chksum;
+          if(verbose) plog("Using VIN: %s\n", buf);
+          memcpy(&resp[2], buf, 17);
+          isotp_send_to(can, resp, 2 + 17, 0x644);
+          break;
+        case 2:
+        case 3:  // At 3 the ISOTP spec gets flaky
+          pktsize = prng_below(252);
+          if(verbose) plog("Fuzzing big VIN with printable chars\n");
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          gen_data(DATA_ALPHANUM, buf, pktsize);
+          buf[pktsize] = 0;
+          chksum = calc_vin_checksum(buf, pktsize);
+          buf[8] = chksum;
+          if(verbose) plog("Using big VIN (%d chars): %s\n",pktsize, buf);
+          memcpy(&resp[2], buf, pktsize);
+          isotp_send_to(can, resp, 2 + pktsize, 0x644);
+          break;
+        case 4:
+          if(verbose) plog("Fuzzing VIN with binary data\n");
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          gen_data(DATA_BINARY, buf, 17);
+          buf[17] = 0;
+          chksum = calc_vin_checksum(buf, 17);
+          buf[8] = chksum;
+          if(verbose) print_bin(buf, 17);
+          memcpy(&resp[2], buf, 17);
+          isotp_send_to(can, resp, 2 + 17, 0x644);
+          break;
+        case 5:
+        default:
+          pktsize = prng_below(252);
+          if(verbose) plog("Fuzzing VIN with binary data with size %d\n", pktsize);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          gen_data(DATA_BINARY, buf, pktsize);
+          buf[pktsize] = 0;
+          if(verbose) print_bin(buf, pktsize);
+          memcpy(&resp[2], buf, pktsize);
+          isotp_send_to(can, resp, 2 + pktsize, 0x644);
+          break;
+       }
+      break;
+    case 0xA1:  // SDM Primary Key
+      if(verbose) plog(" + Requested SDM Primary Key\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending SDM Key %04X\n", 0x6966);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 0x69;
+          resp[3] = 0x66;
+          isotp_send_to(can, resp, 4, 0x644);
+          break;
+      }
+      break;
+    case 0xB4:  // Traceability Number
+      if(verbose) plog(" + Requested Traceability Number\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending Traceabiliity number %s\n", tracenum);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          memcpy(&resp[2], tracenum, strlen(tracenum));
+          isotp_send_to(can, resp, 2 + strlen(tracenum), 0x644);
+          break;
+      }
+      break;
+    case 0xB7:  // Software Number
+      if(verbose) plog(" + Requested Software Number\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending SW # %d\n", 600);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 0x42;
+          resp[3] = 0xAA;
+          resp[4] = 6;
+          resp[5] = 2; // 600
+          resp[6] = 0x58;
+          isotp_send_to(can, resp, 6, 0x644);
+          break;
+      }
+      break;
+    case 0xCB:  // End Model Part #
+      if(verbose) plog(" + Requested End Model Part Number\n");
+      switch(fuzz_level) {
+        case 0:
+        default:
+          if(verbose) plog("Sending End Model Part Number %d\n", 15804602);
+          resp[0] = frame.data[1] + 0x40;
+          resp[1] = frame.data[2];
+          resp[2] = 0x00;
+          resp[3] = 0xF1;
+          resp[4] = 0x28;
+          resp[5] = 0xBA;
+          isotp_send_to(can, resp, 6, 0x644);
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* GM Read Data via PID */
+/* 244   [5]  04 AA 03 02 07 */
+/* 544#0738408D8B000200 */
+/* 544#02508D8D00000000 */
+void handle_gm_read_data_by_id(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received GM Read Data by ID Request\n");
+  int offset = 0;
+  int i, sub;
+  int datacnt;
+  unsigned char datacpy[8];
+  struct canfd_frame *out;
+  if (frame.data[0] == 0xFE) offset = 1;
+  memcpy(&datacpy, &frame.data, 8);
+  if(frame.can_id == 0x7e0) {
+    frame.can_id = 0x5e8;
+  } else {
+    frame.can_id = 0x500 + (frame.can_id & 0xFF);
+  }
+  frame.len = 8;
+  // The DID list runs from byte 3 to the end of the PCI length
+  sub = frame.data[2 + offset];
+  switch(sub) { // Subfunctions
+    case 0x00:  // Stop
+      if(verbose) plog(" + Stop Data Request\n");
+      memset(frame.data, 0, 8);
+      tx_send_frame(can, &frame);
+      if(datacpy[offset] > 2) {
+        for(i=3+offset; i < datacpy[offset]+offset+1 && i < 8; i++) periodic_stop(PERIODIC_GM, frame.can_id, datacpy[i]);
+      } else {
+        periodic_stop(PERIODIC_GM, frame.can_id, -1);
+      }
+      break;
+    case 0x01:  // One Response
+      if(verbose) plog(" + One Response\n");
+      for(i=3+offset; i < datacpy[offset]+offset+1 && i < 8; i++) {
+        out = tx_frame(frame.can_id);
+        if(!out) break;
+        memcpy(out, &frame, sizeof(frame));
+        out->data[0] = datacpy[i];
+        for(datacnt=1; datacnt < 8; datacnt++) {
+          out->data[datacnt] = (unsigned char)prng_next();
+        }
+      }
+      tx_flush(can);
+      break;
+    case 0x02:  // Slow Rate
+    case 0x03:  // Medium Rate
+    case 0x04:  // Fast Rate
+      if(verbose) plog(" + Periodic data at a %s rate\n", periodic_rate_names[sub - 2]);
+      for(i=3+offset; i < datacpy[offset]+offset+1 && i < 8; i++) {
+        if(periodic_start(PERIODIC_GM, frame.can_id, datacpy[i], sub - 2) < 0) {
+          plog("Periodic table full, not sending DID %02X\n", datacpy[i]);
+        }
+      }
+      break;
+    default:
+      plog("Unknown subfunction timer\n");
+      break;
+  }
+}
+
+/* GM Diag format is either
+     101#FE 03 A9 81 52  (Functional addressing: Where FE is the extended address)
+     7E0#03 A9 81 52 (no extended addressing)
+*/
+void handle_gm_read_diag(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received GM Read Diagnostic Request\n");
+  struct dtc_store *st = cur_req.ecu ? cur_req.ecu->dtcs : NULL;
+  int offset = 0;
+  int i, total, mask;
+  long long due;
+  char resp[150];
+  if(frame.data[0] == 0xFE) offset = 1;
+  switch(frame.data[2 + offset]) { // Subfunctions
+    case UDS_READ_STATUS_BY_MASK:  // Read DTCs by mask
+      if(verbose) {
+        plog(" + Read DTCs by mask\n");
+        if(frame.data[3 + offset] & DTC_SUPPORTED_BY_CALIBRATION) plog("   - Supported By Calibration\n");
+        if(frame.data[3 + offset] & DTC_CURRENT_DTC) plog("   - Current DTC\n");
+        if(frame.data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_CLEARED) plog("   - Tests not passed since DTC cleared\n");
+        if(frame.data[3 + offset] & DTC_TEST_FAILED_SINCE_CLEARED) plog("   - Tests failed since DTC cleared\n");
+        if(frame.data[3 + offset] & DTC_HISTORY) plog("   - DTC History\n");
+        if(frame.data[3 + offset] & DTC_TEST_NOT_PASSED_SINCE_POWER) plog("   - Tests not passed since power up\n");
+        if(frame.data[3 + offset] & DTC_CURRENT_DTC_SINCE_POWER) plog("   - Tests failed since power up\n");
+        if(frame.data[3 + offset] & DTC_WARNING_INDICATOR_STATE) plog("   - Warning Indicator State\n");
+      }
+      if(frame.can_id == 0x7e0) {
+        frame.can_id = 0x5e8;
+      } else {
+        frame.can_id = 0x500 + (frame.can_id & 0xFF);
+      }
+      mask = frame.data[3 + offset];
+      frame.len = 8;
+      frame.data[0] = frame.data[2 + offset];
+      due = now_us();
+      total = 0;
+      if(fuzz_level == 0 && st) {
+        // One frame per stored DTC matching the mask, then the 0 DTC
+        pthread_rwlock_rdlock(&st->lock);
+        total = dtc_list(st, mask, resp_buf, 2, 1, ISOTP_BUF_SIZE / 3);
+        pthread_rwlock_unlock(&st->lock);
+        if(total < 0) total = ISOTP_BUF_SIZE / 3;
+        // Streamed from the deferred queue like the fuzzed list below
+        memset(&frame.data[1], 0, 7);
+        for(i = 0; i < total; i++) {
+          frame.data[1] = resp_buf[i * 3];
+          frame.data[2] = resp_buf[i * 3 + 1];
+          frame.data[4] = resp_buf[i * 3 + 2];
+          if(tx_defer(&frame, due + (long long)i * GM_DTC_INTERVAL_US) < 0) break;
+        }
+        if(i < total) plog("Deferred queue full, only streaming %d of %d DTCs\n", i, total);
+        total = i;
+      } else {
+        frame.data[1] = 0;    // DTC 1st byte
+        frame.data[2] = 0x30; // DTC 2nd byte
+        frame.data[3] = 0;
+        frame.data[4] = 0x6F; // Last Test/ This Ignition/ Last Clear bitflag
+        frame.data[5] = 0;
+        frame.data[6] = 0;
+        frame.data[7] = 0;
+        tx_send_frame(can, &frame);
+        // The rest is streamed from the deferred queue so other requests
+        // keep getting answered while a long DTC list goes out
+        if(fuzz_level == 1) {
+          total = prng_below(1024);
+          if(verbose) plog("Sending %d DTCs\n", total);
+          for(i = 0; i < total; i++) {
+            frame.data[1] = (unsigned char)prng_next();
+            frame.data[2] = prng_below(255) + 1;
+            frame.data[3] = 0;
+            frame.data[4] = 0x6F; // Last DTC
+            if(tx_defer(&frame, due + (long long)i * GM_DTC_INTERVAL_US) < 0) break;
+          }
+          if(i < total) plog("Deferred queue full, only streaming %d of %d DTCs\n", i, total);
+          total = i;
+        }
+      }
+      frame.data[1] = 0; // Last frame must be a 0 DTC
+      frame.data[2] = 0;
+      frame.data[3] = 0;
+      frame.data[4] = 0xFF; // Last DTC
+      if(tx_defer(&frame, due + (long long)total * GM_DTC_INTERVAL_US) < 0) tx_send_frame(can, &frame);
+      break;
+    default:
+      if(verbose) plog(" + Unknown subfunction request %02X\n", frame.data[2 + offset]);
+      break;
+  }
+}
+
+/*
+  Gateway
+*/
+//Pkt: 710#02 10 03 55 55 55 55 55 
+void handle_vcds_dsc(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received VCDS 0x710 gateway request\n");
+  frame.can_id = 0x77A;
+  frame.len = 8;
+  frame.data[0] = 0x06;
+  frame.data[1] = 0x50;
+  frame.data[2] = 0x03;
+  frame.data[3] = 0x00;
+  frame.data[4] = 0x32;
+  frame.data[5] = 0x01;
+  frame.data[6] = 0xF4;
+  frame.data[7] = 0xAA;
+  tx_send_frame(can, &frame);
+}
+
+void handle_vcds_read_data_by_id(int can, struct canfd_frame frame) {
+  if(verbose) plog("Received VCDS 0x710 gateway request\n");
+  char resp[150];
+  if(frame.data[2] == 0xF1) {
+    switch(frame.data[3]) {
+    case 0x87: // VAG Number
+      if(verbose) plog("Read data by ID 0x87\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0x87;
+      resp[3] = 0x35;
+      resp[4] = 0x51;
+      resp[5] = 0x45;
+      resp[6] = 0x39;
+      resp[7] = 0x30;
+      resp[8] = 0x37;
+      resp[9] = 0x35;
+      resp[10] = 0x33;
+      resp[11] = 0x30;
+      resp[12] = 0x43;
+      resp[13] = 0x20; // Note normally this would pad with AA's
+      isotp_send_to(can, resp, 14, 0x77A);
+    break;
+    case 0x89: // VAG Number
+      if(verbose) plog("Read data by ID 0x89\n");
+      frame.can_id = 0x77A;
+      frame.len = 8;
+      frame.data[0] = 0x07;
+      frame.data[1] = 0x62;
+      frame.data[2] = 0xF1;
+      frame.data[3] = 0x89;
+      frame.data[4] = 0x33; //3
+      frame.data[5] = 0x32; //2
+      frame.data[6] = 0x30; //0
+      frame.data[7] = 0x33; //3
+      tx_send_frame(can, &frame);
+    break;
+    case 0x91: // VAG Number
+      if(verbose) plog("Read data by ID 0x91\n");
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0x87;
+      resp[3] = 0x35;
+      resp[4] = 0x51;
+      resp[5] = 0x45;
+      resp[6] = 0x39;
+      resp[7] = 0x30;
+      resp[8] = 0x37;
+      resp[9] = 0x35;
+      resp[10] = 0x33;
+      resp[11] = 0x30;
+      resp[12] = 0x41;
+      resp[13] = 0x20; // Note normally this would pad with AA's
+      isotp_send_to(can, resp, 14, 0x77A);
+    break;
+    default:
+      if(verbose) plog("NOTE: Read data by unknown ID %02X\n", frame.data[3]);
+      resp[0] = frame.data[1] + 0x40;
+      resp[1] = frame.data[2];
+      resp[2] = 0x87;
+      resp[3] = 0x35;
+      resp[4] = 0x51;
+      resp[5] = 0x45;
+      resp[6] = 0x39;
+      resp[7] = 0x30;
+      resp[8] = 0x37;
+      resp[9] = 0x35;
+      resp[10] = 0x33;
+      resp[11] = 0x30;
+      resp[12] = 0x41;
+      resp[13] = 0x20; // Note normally this would pad with AA's
+      isotp_send_to(can, resp, 14, 0x77A);
+    break;
+    }
+  } else {
+    if (verbose) plog("Unknown read data by Identifier %02X\n", frame.data[2]);
+  }
+}
+
+// return Mode/SIDs in english
+char *get_mode_str(struct canfd_frame frame) {
+  switch(frame.data[1]) {
+    case OBD_MODE_SHOW_CURRENT_DATA:
+       return "Show current Data";
+       break;
+    case OBD_MODE_SHOW_FREEZE_FRAME:
+       return "Show freeze frame";
+       break;
+    case OBD_MODE_READ_DTC:
+       return "Read DTCs";
+       break;
+    case OBD_MODE_CLEAR_DTC:
+       return "Clear DTCs";
+       break;
+    case OBD_MODE_TEST_RESULTS_NON_CAN:
+       return "Mode Test Results (Non-CAN)";
+       break;
+    case OBD_MODE_TEST_RESULTS_CAN:
+       return "Mode Test Results (CAN)";
+       break;
+    case OBD_MODE_READ_PENDING_DTC:
+       return "Read Pending DTCs";
+       break;
+    case OBD_MODE_CONTROL_OPERATIONS:
+       return "Control Operations";
+       break;
+    case OBD_MODE_VEHICLE_INFORMATION:
+       return "Vehicle Information";
+       break;
+    case OBD_MODE_READ_PERM_DTC:
+       return "Read Permanent DTCs";
+       break;
+    case UDS_SID_DIAGNOSTIC_CONTROL:
+       return "Diagnostic Control";
+       break;
+    case UDS_SID_ECU_RESET:
+       return "ECU Reset";
+       break;
+    case UDS_SID_CLEAR_DTC:
+       return "UDS Clear DTCs";
+       break;
+    case UDS_SID_READ_DTC:
+       return "UDS Read DTCs";
+       break;
+    case UDS_SID_GM_READ_DID_BY_ID:
+       return "Read DID by ID (GM)";
+       break;
+    case UDS_SID_RESTART_COMMUNICATIONS:
+       return "Restore Normal Commnications";
+       break;
+    case UDS_SID_READ_DATA_BY_ID:
+       return "Read DATA By ID";
+       break;
+    case UDS_SID_READ_MEM_BY_ADDRESS:
+       return "Read Memory By Address";
+       break;
+    case UDS_SID_READ_SCALING_BY_ID:
+       return "Read Scalling Data by ID";
+       break;
+    case UDS_SID_SECURITY_ACCESS:
+       return "Security Access";
+       break;
+    case UDS_SID_COMMUNICATION_CONTROL:
+       return "Communication Control";
+       break;
+    case UDS_SID_READ_DATA_BY_ID_PERIODIC:
+       return "Read DATA By ID Periodically";
+       break;
+    case UDS_SID_DEFINE_DATA_ID:
+       return "Define DATA By ID";
+       break;
+    case UDS_SID_WRITE_DATA_BY_ID:
+       return "Write DATA By ID";
+       break;
+    case UDS_SID_IO_CONTROL_BY_ID:
+       return "Input/Output Control By ID";
+       break;
+    case UDS_SID_ROUTINE_CONTROL:
+       return "Routine Control";
+       break;
+    case UDS_SID_REQUEST_DOWNLOAD:
+       return "Request Download";
+       break;
+    case UDS_SID_REQUEST_UPLOAD:
+       return "Request Upload";
+       break;
+    case UDS_SID_TRANSFER_DATA:
+       return "Transfer DATA";
+       break;
+    case UDS_SID_REQUEST_XFER_EXIT:
+       return "Request Transfer Exit";
+       break;
+    case UDS_SID_REQUEST_XFER_FILE:
+       return "Request Transfer File";
+       break;
+    case UDS_SID_WRITE_MEM_BY_ADDRESS:
+       return "Write Memory By Address";
+       break;
+    case UDS_SID_TESTER_PRESENT:
+       return "Tester Present";
+       break;
+    case UDS_SID_ACCESS_TIMING:
+       return "Access Timing";
+       break;
+    case UDS_SID_SECURED_DATA_TRANS:
+       return "Secured DATA Transfer";
+       break;
+    case UDS_SID_CONTROL_DTC_SETTINGS:
+       return "Control DTC Settings";
+       break;
+    case UDS_SID_RESPONSE_ON_EVENT:
+       return "Response On Event";
+       break;
+    case UDS_SID_LINK_CONTROL:
+       return "Link Control";
+       break;
+    case UDS_SID_GM_PROGRAMMED_STATE:
+       return "Programmed State (GM)";
+       break;
+    case UDS_SID_GM_PROGRAMMING_MODE:
+       return "Programming Mode (GM)";
+       break;
+    case UDS_SID_GM_READ_DIAG_INFO:
+       return "Read Diagnostic Information (GM)";
+       break;
+    case UDS_SID_GM_READ_DATA_BY_ID:
+       return "Read DATA By ID (GM)";
+       break;
+    case UDS_SID_GM_DEVICE_CONTROL:
+       return "Device Control (GM)";
+       break;
+    default:
+       printf("Unknown mode/sid (%02X)\n", frame.data[1]);
+       return "";
+  }
+}
+
+// Prints raw packet in ID#DATA format
+void print_pkt(struct canfd_frame frame) {
+  int i;
+  plog("Pkt: %02X#", frame.can_id);
+  for(i = 0; i < frame.len; i++) {
+    plog("%02X ", frame.data[i]);
+  }
+  plog("\n");
+}
+
+// Prints binary data in hex format
+void print_bin(unsigned char *bin, int size) {
+  int i;
+  for(i = 0; i < size; i++) {
+    plog("%02X ", bin[i]);
+  }
+  plog("\n");
+}
+
+// Handles the incomming CAN Packets
+void handle_pkt(int can, struct canfd_frame frame) {
+  int id = frame.can_id & CAN_SFF_MASK;
+  if(DEBUG) print_pkt(frame);
+  if(isotp_handle_fc(can, frame)) return;
+  // ECUs on another bus don't see it, not even the first frame
+  if(ecu_by_id[id] && !ecu_route(id)) return;
+  if(isotp_handle_rx(can, &frame)) return;
+  handle_request(can, frame);
+}
+
+/*
+ * ECU registry
+ *
+ * Every simulated ECU has a 256 entry SID table and is found through
+ * ecu_by_id, so routing a request costs the same no matter how many
+ * ECUs are registered.
+ */
+struct ecu *ecu_register(char *name, int req_id, int resp_id) {
+  struct ecu *ecu;
+  int i;
+  if(ecu_count >= MAX_ECUS) {
+    plog("Can't register %s, already simulating %d ECUs\n", name, MAX_ECUS);
+    return NULL;
+  }
+  if(ecu_by_id[req_id & CAN_SFF_MASK]) {
+    plog("Can't register %s, %03X is already taken by %s\n", name, req_id, ecu_by_id[req_id & CAN_SFF_MASK]->name);
+    return NULL;
+  }
+  ecu = &ecus[ecu_count++];
+  memset(ecu, 0, sizeof(struct ecu));
+  ecu->name = name;
+  ecu->req_id = req_id;
+  ecu->resp_id = resp_id;
+  for(i = 0; i < MAX_IFACES; i++) {
+    ecu->isotp_fd[i] = -1;
+    ecu->func_fd[i] = -1;
+  }
+  ecu_by_id[req_id & CAN_SFF_MASK] = ecu;
+  if(resp_id) ecu_by_resp[resp_id & CAN_SFF_MASK] = ecu;
+  return ecu;
+}
+
+// Routes another request ID (e.g. a functional address) to an ECU.
+// Several ECUs can share a functional ID, they all get the request.
+void ecu_alias(struct ecu *ecu, int req_id) {
+  struct ecu *head;
+  if(!ecu) return;
+  ecu->func_id = req_id;
+  head = ecu_by_id[req_id & CAN_SFF_MASK];
+  if(head && head->func_id == req_id) {
+    while(head->func_next) head = head->func_next;
+    head->func_next = ecu;
+    return;
+  }
+  ecu_by_id[req_id & CAN_SFF_MASK] = ecu;
+}
+
+// Whether the interface of the calling loop answers for the ECU
+int ecu_on_loop(struct ecu *ecu) {
+  return !ecu->loops || (ecu->loops >> loop_id) & 1;
+}
+
+// First ECU on a request ID that this loop answers for
+struct ecu *ecu_route(int id) {
+  struct ecu *ecu = ecu_by_id[id];
+  while(ecu && !ecu_on_loop(ecu)) ecu = ecu->func_id == id ? ecu->func_next : NULL;
+  return ecu;
+}
+
+int iface_index(char *name, int len, char **ifnames, int count) {
+  int i;
+  for(i = 0; i < count; i++) {
+    if((int)strlen(ifnames[i]) == len && !strncmp(ifnames[i], name, len)) return i;
+  }
+  return -1;
+}
+
+// -b <ecu id>:<interface>, the ECU only answers on the interfaces it is
+// bound to instead of on all of them
+int ecu_bind(char *spec, char **ifnames, int count) {
+  struct ecu *ecu;
+  char *end;
+  long id;
+  int i;
+  id = strtol(spec, &end, 16);
+  ecu = *end == ':' && id >= 0 && id <= CAN_SFF_MASK ? ecu_by_id[id] : NULL;
+  if(!ecu || ecu->req_id != id) {
+    plog("Binding %s: no ECU with that request ID\n", spec);
+    return -1;
+  }
+  i = iface_index(end + 1, strlen(end + 1), ifnames, count);
+  if(i < 0) {
+    plog("Binding %s: %s is not one of the interfaces\n", spec, end + 1);
+    return -1;
+  }
+  ecu->loops |= 1u << i;
+  if(verbose) plog("%s answers on %s\n", ecu->name, ifnames[i]);
+  return 0;
+}
+
+// -g <from>:<to>, a gateway on <from> forwards requests to the ECUs
+// bound to <to>, so they answer on both.  Run after the bindings.
+int gateway_route(char *spec, char **ifnames, int count) {
+  char *sep = strrchr(spec, ':');
+  int from, to, i, routed = 0;
+  from = sep ? iface_index(spec, sep - spec, ifnames, count) : -1;
+  to = sep ? iface_index(sep + 1, strlen(sep + 1), ifnames, count) : -1;
+  if(from < 0 || to < 0 || from == to) {
+    plog("Gateway route %s: expected <from interface>:<to interface>\n", spec);
+    return -1;
+  }
+  for(i = 0; i < ecu_count; i++) {
+    if(!(ecus[i].loops & (1u << to))) continue;
+    ecus[i].loops |= 1u << from;
+    routed++;
+  }
+  if(verbose) plog("Gateway on %s reaches %d ECUs on %s\n", ifnames[from], routed, ifnames[to]);
+  return 0;
+}
+
+void ecu_add_sid(struct ecu *ecu, int sid, sid_handler handler) {
+  if(ecu) ecu->sids[sid & 0xFF] = handler;
+}
+
+void handle_tester_present(int can, struct canfd_frame frame) {
+  if(verbose > 1) plog("Received TesterPresent\n");
+  generic_OK_resp_to(can, frame, cur_req.ecu->resp_id);
+}
+
+// Each ECU that deals with specific controllers a note is
+// given where that info came from.  There could be a lot of overlap
+// and exceptions here. -- Craig
+void register_builtin_ecus() {
+  static char *obd_names[OBD_MAX_ECUS] = { "Engine (OBD/UDS)", "Transmission (OBD)", "ABS (OBD)",
+    "Airbag (OBD)", "Body (OBD)", "Hybrid (OBD)", "Climate (OBD)", "Cluster (OBD)" };
+  struct ecu *ecu;
+  int i;
+
+  ecu = ecu_register("EBCM (GM)", 0x243, 0x643); // Chevy Malibu 2006
+  ecu_add_sid(ecu, UDS_SID_TESTER_PRESENT, handle_tester_present);
+  ecu_add_sid(ecu, UDS_SID_GM_READ_DIAG_INFO, handle_gm_read_diag);
+
+  ecu = ecu_register("Body Control Module (GM)", 0x244, 0x644); // Chevy Malibu 2006
+  ecu_add_sid(ecu, UDS_SID_TESTER_PRESENT, handle_tester_present);
+  ecu_add_sid(ecu, UDS_SID_GM_READ_DIAG_INFO, handle_gm_read_diag);
+  ecu_add_sid(ecu, UDS_SID_GM_READ_DATA_BY_ID, handle_gm_read_data_by_id);
+  ecu_add_sid(ecu, UDS_SID_GM_READ_DID_BY_ID, handle_gm_read_did_by_id);
+
+  ecu_register("Power Steering (GM)", 0x24A, 0x64A); // Chevy Malibu 2006
+
+  ecu_register("Unknown", 0x350, 0); // Unsure.  Seen RTRs to this when requesting VIN
+
+  ecu = ecu_register("VCDS Gateway", 0x710, 0x77A);
+  ecu->log_pkts = 1;
+  ecu_add_sid(ecu, UDS_SID_DIAGNOSTIC_CONTROL, handle_vcds_dsc);
+  ecu_add_sid(ecu, UDS_SID_READ_DATA_BY_ID, handle_vcds_read_data_by_id);
+
+  ecu = ecu_register("Engine (OBD/UDS)", 0x7E0, 0x7E8);
+  ecu->log_pkts = 1;
+  ecu_alias(ecu, OBD_FUNC_ID);
+  ecu_add_sid(ecu, OBD_MODE_SHOW_CURRENT_DATA, handle_current_data);
+  ecu_add_sid(ecu, OBD_MODE_SHOW_FREEZE_FRAME, handle_freeze_frame);
+  ecu_add_sid(ecu, OBD_MODE_READ_DTC, handle_stored_codes);
+  ecu_add_sid(ecu, OBD_MODE_READ_PENDING_DTC, handle_pending_codes);
+  ecu_add_sid(ecu, OBD_MODE_VEHICLE_INFORMATION, handle_vehicle_info);
+  ecu_add_sid(ecu, OBD_MODE_READ_PERM_DTC, handle_perm_codes);
+  ecu_add_sid(ecu, OBD_MODE_CLEAR_DTC, handle_clear_codes);
+  ecu_add_sid(ecu, UDS_SID_READ_DTC, handle_read_dtc_info);
+  ecu_add_sid(ecu, UDS_SID_CLEAR_DTC, handle_clear_dtc);
+  dtc_seed(ecu, dtc_stress);
+  ecu_add_sid(ecu, UDS_SID_DIAGNOSTIC_CONTROL, handle_dsc);
+  ecu_add_sid(ecu, UDS_SID_READ_DATA_BY_ID, handle_read_data_by_id);
+  ecu->dids = engine_dids;
+  ecu->did_count = sizeof(engine_dids) / sizeof(engine_dids[0]);
+  ecu_add_sid(ecu, UDS_SID_READ_DATA_BY_ID_PERIODIC, handle_read_data_by_id_periodic);
+  ecu_add_sid(ecu, UDS_SID_TESTER_PRESENT, handle_tester_present);
+  ecu_add_sid(ecu, UDS_SID_GM_READ_DIAG_INFO, handle_gm_read_diag);
+
+  // With -N the rest of the OBD range answers functional requests too
+  for(i = 1; i < obd_ecus; i++) {
+    ecu = ecu_register(obd_names[i], 0x7E0 + i, 0x7E8 + i);
+    ecu_alias(ecu, OBD_FUNC_ID);
+    ecu_add_sid(ecu, OBD_MODE_SHOW_CURRENT_DATA, handle_current_data);
+    ecu_add_sid(ecu, OBD_MODE_SHOW_FREEZE_FRAME, handle_freeze_frame);
+    ecu_add_sid(ecu, OBD_MODE_READ_DTC, handle_stored_codes);
+    ecu_add_sid(ecu, OBD_MODE_READ_PENDING_DTC, handle_pending_codes);
+    ecu_add_sid(ecu, OBD_MODE_VEHICLE_INFORMATION, handle_vehicle_info);
+    ecu_add_sid(ecu, OBD_MODE_READ_PERM_DTC, handle_perm_codes);
+    ecu_add_sid(ecu, OBD_MODE_CLEAR_DTC, handle_clear_codes);
+    ecu_add_sid(ecu, UDS_SID_TESTER_PRESENT, handle_tester_present);
+    dtc_seed(ecu, 0);
+  }
+}
+
+// Runs a request through one ECU's SID table
+void ecu_dispatch(int can, struct ecu *ecu, struct canfd_frame frame) {
+  sid_handler handler;
+  struct xfer *x;
+  unsigned long sent = tx_sent + isotp_kernel_pdus_tx;
+  cur_req.ecu = ecu;
+  __atomic_fetch_add(&ecu->requests, 1, __ATOMIC_RELAXED);
+  if((x = xfer_find(ecu))) {
+    // Any request keeps a transfer alive, a new session ends it
+    if(frame.data[1] == UDS_SID_DIAGNOSTIC_CONTROL) xfer_abort(x, "session change");
+    else x->last_ms = now_ms();
+  }
+  if(oracle_enabled) {
+    oracle_request(ecu, frame.data[1]);
+    case_fuzz = NULL;
+  }
+  if(rcache_enabled && rcache_send(can, frame)) {
+    // Cached answers are never fuzzed
+  } else if((handler = ecu->sids[frame.data[1]])) {
+    handler(can, frame);
+  } else {
+    if(verbose && !ecu->log_pkts) print_pkt(frame);
+    if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
+  }
+  if(oracle_enabled && tx_sent + isotp_kernel_pdus_tx != sent) oracle_answered(ecu);
+}
+
+// Hands a functional request to one ECU, after a random delay of up to
+// func_jitter_ms so answers from several ECUs don't come in lock step
+void ecu_functional(int can, struct ecu *ecu, struct canfd_frame frame) {
+  long long due;
+  if(func_jitter_ms) {
+    due = now_us() + prng_below(func_jitter_ms * 1000 + 1);
+    if(tx_defer_request(ecu, &frame, due) == 0) return;
+  }
+  ecu_dispatch(can, ecu, frame);
+}
+
+// Handles a complete request
+void handle_request(int can, struct canfd_frame frame) {
+  struct ecu *ecu;
+  int id = frame.can_id & CAN_SFF_MASK;
+  ecu = ecu_route(id);
+  if(!ecu || (frame.can_id & CAN_EFF_FLAG)) {
+    if (DEBUG) print_pkt(frame);
+    if (DEBUG) plog("DEBUG: missed ID %02X\n", frame.can_id);
+    return;
+  }
+  if(frame.can_id & CAN_RTR_FLAG) {
+    if (verbose) plog("Received a RTR at ID %02X\n", id);
+    return;
+  }
+  if(verbose && ecu->log_pkts) print_pkt(frame);
+  if(frame.data[0] == 0 || frame.len == 0) return;
+  if(frame.data[0] > frame.len) return;
+  if(id == ecu->func_id) {
+    // Every ECU on the functional ID answers, each with its own ISO-TP session
+    for(; ecu; ecu = ecu->func_next) {
+      if(ecu_on_loop(ecu)) ecu_functional(can, ecu, frame);
+    }
+    return;
+  }
+  ecu_dispatch(can, ecu, frame);
+}
+
+/*
+ * ECU definition files
+ *
+ * A text file describes extra ECUs (or adds data to built in ones):
+ *
+ *   ecu 7E0 7E8 Engine      request ID, response ID, name
+ *   functional 7DF          also answer this ID
+ *   did F190 "WAUZZZ8V9FA149850"
+ *   did F187 30 34 45 39    hex bytes
+ *   pid 0C 1A F8            OBD mode 01, supported PID bitmaps are filled in
+ *   dtc P0301 08            DTC and status byte (Default: 08, confirmed)
+ *
+ * It is compiled into a flat image that is cached as <file>.img and
+ * mmap()ed on the next start as long as the text hasn't changed size or
+ * modification time since.
+ */
+struct def_did {
+  int ecu, seq;
+  struct image_did d;  // data_off is into the blob while building
+};
+struct def_pid {
+  int ecu, seq;
+  struct image_pid p;
+};
+struct def_dtc {
+  int ecu, seq;
+  struct image_dtc d;
+};
+struct def_builder {
+  char *file;
+  int line;
+  struct image_ecu *ecus;
+  int ecu_count;
+  struct def_did *dids;
+  int did_count, did_alloc;
+  struct def_pid *pids;
+  int pid_count, pid_alloc;
+  struct def_dtc *dtcs;
+  int dtc_count, dtc_alloc;
+  unsigned char *blob;
+  int blob_len, blob_alloc;
+};
+
+int def_error(struct def_builder *b, char *msg) {
+  plog("%s:%d: %s\n", b->file, b->line, msg);
+  return -1;
+}
+
+// Appends to the data blob and returns where it went, -1 if out of memory
+int def_blob(struct def_builder *b, void *data, int len) {
+  unsigned char *blob;
+  int off;
+  if(b->blob_len + len > b->blob_alloc) {
+    blob = realloc(b->blob, (b->blob_len + len) * 2);
+    if(!blob) return def_error(b, "Out of memory");
+    b->blob = blob;
+    b->blob_alloc = (b->blob_len + len) * 2;
+  }
+  off = b->blob_len;
+  memcpy(&b->blob[off], data, len);
+  b->blob_len += len;
+  return off;
+}
+
+// Parses hex bytes or one "quoted string" into buf, returns the length
+int def_bytes(struct def_builder *b, char *p, unsigned char *buf, int max) {
+  char *end;
+  int len = 0;
+  while(*p == ' ' || *p == '\t') p++;
+  if(*p == '"') {
+    end = strrchr(p + 1, '"');
+    if(!end) return def_error(b, "Unterminated string");
+    len = end - p - 1;
+    if(len > max) return def_error(b, "Data too long");
+    memcpy(buf, p + 1, len);
+    return len;
+  }
+  while(*p && *p != '\n' && *p != '#') {
+    if(len == max) return def_error(b, "Data too long");
+    buf[len++] = strtoul(p, &end, 16);
+    if(end == p) return def_error(b, "Bad hex byte");
+    p = end;
+    while(*p == ' ' || *p == '\t' || *p == '\r') p++;
+  }
+  return len;
+}
+
+// P0301 style or plain hex
+int def_dtc_code(char *str) {
+  static const char *systems = "PCBU";
+  char *sys = strchr(systems, str[0]);
+  if(sys && str[0]) return ((sys - systems) << 14) | (strtoul(str + 1, NULL, 16) & 0x3FFF);
+  return strtoul(str, NULL, 16) & 0xFFFF;
+}
+
+// Makes room for one more entry in a growing table, returns -1 from
+// the calling parser function if that fails
+#define DEF_GROW(b, arr, count, alloc) \
+  if(count == alloc) { \
+    void *grown = realloc(arr, (alloc ? alloc * 2 : 64) * sizeof(*arr)); \
+    if(!grown) return def_error(b, "Out of memory"); \
+    arr = grown; \
+    alloc = alloc ? alloc * 2 : 64; \
+  }
+
+int def_add_pid(struct def_builder *b, int ecu, int pid, unsigned char *data, int len) {
+  int off;
+  DEF_GROW(b, b->pids, b->pid_count, b->pid_alloc);
+  off = def_blob(b, data, len);
+  if(off < 0) return -1;
+  b->pids[b->pid_count].ecu = ecu;
+  b->pids[b->pid_count].seq = b->pid_count;
+  b->pids[b->pid_count].p.pid = pid;
+  b->pids[b->pid_count].p.len = len;
+  b->pids[b->pid_count].p.pad = 0;
+  b->pids[b->pid_count].p.data_off = off;
+  b->pid_count++;
+  return 0;
+}
+
+int def_parse_line(struct def_builder *b, char *line) {
+  char kw[16], name[64];
+  unsigned int id, id2;
+  int n, len, off;
+  struct image_ecu *ecu = b->ecu_count ? &b->ecus[b->ecu_count - 1] : NULL;
+  if(sscanf(line, "%15s%n", kw, &n) != 1 || kw[0] == '#') return 0;
+  line += n;
+  if(!strcmp(kw, "ecu")) {
+    if(b->ecu_count == MAX_ECUS) return def_error(b, "Too many ECUs");
+    memset(name, 0, sizeof(name));
+    if(sscanf(line, "%x %x %63[^\r\n]", &id, &id2, name) < 2) return def_error(b, "Expected: ecu <request id> <response id> [name]");
+    if(id > CAN_SFF_MASK || id2 > CAN_SFF_MASK) return def_error(b, "Only 11 bit IDs are supported");
+    ecu = &b->ecus[b->ecu_count++];
+    memset(ecu, 0, sizeof(*ecu));
+    ecu->req_id = id;
+    ecu->resp_id = id2;
+    if(!name[0]) snprintf(name, sizeof(name), "ECU %03X", id);
+    off = def_blob(b, name, strlen(name) + 1);
+    if(off < 0) return -1;
+    ecu->name_off = off;
+    return 0;
+  }
+  if(!ecu) return def_error(b, "Expected an ecu line first");
+  if(!strcmp(kw, "functional")) {
+    if(sscanf(line, "%x", &id) != 1 || id > CAN_SFF_MASK) return def_error(b, "Expected: functional <id>");
+    ecu->func_id = id;
+  } else if(!strcmp(kw, "did")) {
+    if(sscanf(line, "%x%n", &id, &n) != 1 || id > 0xFFFF) return def_error(b, "Expected: did <id> <data>");
+    len = def_bytes(b, line + n, resp_buf, IMAGE_DID_MAX);
+    if(len < 0) return -1;
+    DEF_GROW(b, b->dids, b->did_count, b->did_alloc);
+    off = def_blob(b, resp_buf, len);
+    if(off < 0) return -1;
+    b->dids[b->did_count].ecu = b->ecu_count - 1;
+    b->dids[b->did_count].seq = b->did_count;
+    b->dids[b->did_count].d.did = id;
+    b->dids[b->did_count].d.len = len;
+    b->dids[b->did_count].d.data_off = off;
+    b->did_count++;
+  } else if(!strcmp(kw, "pid")) {
+    if(sscanf(line, "%x%n", &id, &n) != 1 || id > 0xFF) return def_error(b, "Expected: pid <pid> <data>");
+    len = def_bytes(b, line + n, resp_buf, IMAGE_PID_MAX);
+    if(len < 0 || def_add_pid(b, b->ecu_count - 1, id, resp_buf, len) < 0) return -1;
+  } else if(!strcmp(kw, "dtc")) {
+    id2 = 0x08;
+    if(sscanf(line, "%15s %x", name, &id2) < 1) return def_error(b, "Expected: dtc <code> [status]");
+    DEF_GROW(b, b->dtcs, b->dtc_count, b->dtc_alloc);
+    b->dtcs[b->dtc_count].ecu = b->ecu_count - 1;
+    b->dtcs[b->dtc_count].seq = b->dtc_count;
+    b->dtcs[b->dtc_count].d.code = def_dtc_code(name);
+    b->dtcs[b->dtc_count].d.status = id2;
+    b->dtcs[b->dtc_count].d.pad = 0;
+    b->dtc_count++;
+  } else {
+    return def_error(b, "Unknown keyword");
+  }
+  return 0;
+}
+
+// Adds the supported PID bitmaps (00, 20, 40...) an ECU doesn't define
+int def_pid_bitmaps(struct def_builder *b, int ecu) {
+  unsigned char bitmap[8][4];
+  int i, pid, top = -1, defined[8];
+  memset(bitmap, 0, sizeof(bitmap));
+  memset(defined, 0, sizeof(defined));
+  for(i = 0; i < b->pid_count; i++) {
+    if(b->pids[i].ecu != ecu) continue;
+    pid = b->pids[i].p.pid;
+    if(pid % 0x20 == 0) defined[pid / 0x20] = 1;
+    if(pid == 0) continue;
+    bitmap[(pid - 1) / 0x20][((pid - 1) % 0x20) / 8] |= 0x80 >> ((pid - 1) % 8);
+    if((pid - 1) / 0x20 > top) top = (pid - 1) / 0x20;
+  }
+  // Each bitmap also says whether the next one exists
+  for(i = 0; i < top; i++) bitmap[i][3] |= 1;
+  for(i = 0; i <= top; i++) {
+    if(!defined[i] && def_add_pid(b, ecu, i * 0x20, bitmap[i], 4) < 0) return -1;
+  }
+  return 0;
+}
+
+int def_did_cmp(const void *a, const void *b) {
+  const struct def_did *x = a, *y = b;
+  if(x->ecu != y->ecu) return x->ecu - y->ecu;
+  if(x->d.did != y->d.did) return x->d.did - y->d.did;
+  return x->seq - y->seq;
+}
+
+int def_pid_cmp(const void *a, const void *b) {
+  const struct def_pid *x = a, *y = b;
+  if(x->ecu != y->ecu) return x->ecu - y->ecu;
+  if(x->p.pid != y->p.pid) return x->p.pid - y->p.pid;
+  return x->seq - y->seq;
+}
+
+int def_dtc_cmp(const void *a, const void *b) {
+  const struct def_dtc *x = a, *y = b;
+  if(x->ecu != y->ecu) return x->ecu - y->ecu;
+  return x->seq - y->seq;
+}
+
+// Lays the parsed file out as an image.  Repeated DIDs and PIDs are
+// dropped, the first definition wins.
+unsigned char *def_compile(struct def_builder *b, uint32_t *size) {
+  struct image_header *hdr;
+  struct image_ecu *ecus;
+  unsigned char *img;
+  uint32_t off, blob_off;
+  int e, i;
+  for(e = 0; e < b->ecu_count; e++) {
+    if(def_pid_bitmaps(b, e) < 0) return NULL;
+  }
+  qsort(b->dids, b->did_count, sizeof(struct def_did), def_did_cmp);
+  qsort(b->pids, b->pid_count, sizeof(struct def_pid), def_pid_cmp);
+  qsort(b->dtcs, b->dtc_count, sizeof(struct def_dtc), def_dtc_cmp);
+
+  off = sizeof(struct image_header) + b->ecu_count * sizeof(struct image_ecu);
+  blob_off = off + b->did_count * sizeof(struct image_did) + b->pid_count * sizeof(struct image_pid) +
+             b->dtc_count * sizeof(struct image_dtc);
+  blob_off = (blob_off + 7) & ~7;
+  img = calloc(1, blob_off + b->blob_len);
+  if(!img) {
+    def_error(b, "Out of memory");
+    return NULL;
+  }
+  hdr = (struct image_header *)img;
+  memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+  hdr->version = IMAGE_VERSION;
+  hdr->ecu_count = b->ecu_count;
+  hdr->ecu_off = sizeof(struct image_header);
+  ecus = (struct image_ecu *)(img + hdr->ecu_off);
+  memcpy(ecus, b->ecus, b->ecu_count * sizeof(struct image_ecu));
+
+  for(e = 0; e < b->ecu_count; e++) {
+    ecus[e].name_off += blob_off;
+    ecus[e].did_off = off;
+    for(i = 0; i < b->did_count; i++) {
+      if(b->dids[i].ecu != e) continue;
+      if(ecus[e].did_count && ((struct image_did *)(img + off))[-1].did == b->dids[i].d.did) continue;
+      memcpy(img + off, &b->dids[i].d, sizeof(struct image_did));
+      ((struct image_did *)(img + off))->data_off += blob_off;
+      off += sizeof(struct image_did);
+      ecus[e].did_count++;
+    }
+  }
+  for(e = 0; e < b->ecu_count; e++) {
+    ecus[e].pid_off = off;
+    for(i = 0; i < b->pid_count; i++) {
+      if(b->pids[i].ecu != e) continue;
+      if(ecus[e].pid_count && ((struct image_pid *)(img + off))[-1].pid == b->pids[i].p.pid) continue;
+      memcpy(img + off, &b->pids[i].p, sizeof(struct image_pid));
+      ((struct image_pid *)(img + off))->data_off += blob_off;
+      off += sizeof(struct image_pid);
+      ecus[e].pid_count++;
+    }
+  }
+  for(e = 0; e < b->ecu_count; e++) {
+    ecus[e].dtc_off = off;
+    for(i = 0; i < b->dtc_count; i++) {
+      if(b->dtcs[i].ecu != e) continue;
+      memcpy(img + off, &b->dtcs[i].d, sizeof(struct image_dtc));
+      off += sizeof(struct image_dtc);
+      ecus[e].dtc_count++;
+    }
+  }
+  memcpy(img + blob_off, b->blob, b->blob_len);
+  hdr->size = blob_off + b->blob_len;
+  *size = hdr->size;
+  return img;
+}
+
+long long stat_mtime_ns(struct stat *st) {
+  return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// Parses a definition file and compiles it, NULL on errors
+unsigned char *def_build(char *file, uint32_t *size) {
+  struct def_builder b;
+  struct stat st;
+  unsigned char *img = NULL;
+  FILE *fp;
+  char *line = NULL;
+  size_t alloc = 0;
+  fp = fopen(file, "r");
+  if(!fp) {
+    perror(file);
+    return NULL;
+  }
+  memset(&b, 0, sizeof(b));
+  b.file = file;
+  b.ecus = calloc(MAX_ECUS, sizeof(struct image_ecu));
+  while(b.ecus && getline(&line, &alloc, fp) > 0) {
+    b.line++;
+    if(def_parse_line(&b, line) < 0) break;
+  }
+  if(feof(fp)) img = def_compile(&b, size);
+  if(img && fstat(fileno(fp), &st) == 0) {
+    ((struct image_header *)img)->src_size = st.st_size;
+    ((struct image_header *)img)->src_mtime = stat_mtime_ns(&st);
+  }
+  fclose(fp);
+  free(line);
+  free(b.ecus);
+  free(b.dids);
+  free(b.pids);
+  free(b.dtcs);
+  free(b.blob);
+  return img;
+}
+
+// Sanity checks an image from disk before anything points into it
+int image_valid(unsigned char *img, uint32_t size) {
+  struct image_header *hdr = (struct image_header *)img;
+  struct image_ecu *ecus;
+  struct image_did *dids;
+  struct image_pid *pids;
+  struct image_dtc *dtcs;
+  uint32_t i, j;
+  if(size < sizeof(*hdr) || memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic))) return 0;
+  if(hdr->version != IMAGE_VERSION || hdr->size != size || hdr->ecu_count > MAX_ECUS) return 0;
+  if(hdr->ecu_off + (uint64_t)hdr->ecu_count * sizeof(struct image_ecu) > size) return 0;
+  ecus = (struct image_ecu *)(img + hdr->ecu_off);
+  for(i = 0; i < hdr->ecu_count; i++) {
+    // IDs index the routing tables
+    if(ecus[i].req_id > CAN_SFF_MASK || ecus[i].resp_id > CAN_SFF_MASK || ecus[i].func_id > CAN_SFF_MASK) return 0;
+    if(ecus[i].name_off >= size || !memchr(img + ecus[i].name_off, 0, size - ecus[i].name_off)) return 0;
+    if(ecus[i].did_off + (uint64_t)ecus[i].did_count * sizeof(struct image_did) > size) return 0;
+    if(ecus[i].pid_off + (uint64_t)ecus[i].pid_count * sizeof(struct image_pid) > size) return 0;
+    if(ecus[i].dtc_off + (uint64_t)ecus[i].dtc_count * sizeof(struct image_dtc) > size) return 0;
+    // Tables are read in place, so they have to be aligned too
+    if(ecus[i].did_off % 4 || ecus[i].pid_off % 4 || ecus[i].dtc_off % 4) return 0;
+    dids = (struct image_did *)(img + ecus[i].did_off);
+    for(j = 0; j < ecus[i].did_count; j++) {
+      if(dids[j].len > IMAGE_DID_MAX || dids[j].data_off + (uint64_t)dids[j].len > size) return 0;
+    }
+    pids = (struct image_pid *)(img + ecus[i].pid_off);
+    for(j = 0; j < ecus[i].pid_count; j++) {
+      if(pids[j].len > IMAGE_PID_MAX || pids[j].data_off + (uint64_t)pids[j].len > size) return 0;
+    }
+    dtcs = (struct image_dtc *)(img + ecus[i].dtc_off);
+    for(j = 0; j < ecus[i].dtc_count; j++) {
+      if(dtcs[j].pad) return 0;
+    }
+  }
+  return 1;
+}
+
+// Maps the cached image if it was built from the text file as it is now
+unsigned char *image_map(char *path, char *file, uint32_t *size) {
+  struct image_header *hdr;
+  struct stat text, st;
+  unsigned char *img;
+  int fd;
+  if(stat(file, &text) < 0) return NULL;
+  fd = open(path, O_RDONLY);
+  if(fd < 0) return NULL;
+  if(fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > UINT32_MAX) {
+    close(fd);
+    return NULL;
+  }
+  img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(img == MAP_FAILED) return NULL;
+  hdr = (struct image_header *)img;
+  if(!image_valid(img, st.st_size) || hdr->src_size != (uint64_t)text.st_size || hdr->src_mtime != stat_mtime_ns(&text)) {
+    munmap(img, st.st_size);
+    return NULL;
+  }
+  *size = st.st_size;
+  return img;
+}
+
+// Lookups, binary search over the ECU's sorted entries
+struct image_did *image_find_did(struct image_ecu *def, int did) {
+  struct image_did *dids = (struct image_did *)(ecu_image + def->did_off);
+  int lo = 0, hi = def->did_count - 1, mid;
+  while(lo <= hi) {
+    mid = (lo + hi) / 2;
+    if(dids[mid].did == did) return &dids[mid];
+    if(dids[mid].did < did) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return NULL;
+}
+
+struct image_pid *image_find_pid(struct image_ecu *def, int pid) {
+  struct image_pid *pids = (struct image_pid *)(ecu_image + def->pid_off);
+  int lo = 0, hi = def->pid_count - 1, mid;
+  while(lo <= hi) {
+    mid = (lo + hi) / 2;
+    if(pids[mid].pid == pid) return &pids[mid];
+    if(pids[mid].pid < pid) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return NULL;
+}
+
+// Finds a DID in the ECU's definition file, then in its built in table
+unsigned char *ecu_find_did(struct ecu *ecu, int did, int *len) {
+  struct image_did *d;
+  int lo = 0, hi = ecu->did_count - 1, mid;
+  if(ecu->def && (d = image_find_did(ecu->def, did))) {
+    *len = d->len;
+    return ecu_image + d->data_off;
+  }
+  while(lo <= hi) {
+    mid = (lo + hi) / 2;
+    if(ecu->dids[mid].did == did) {
+      *len = ecu->dids[mid].len;
+      return (unsigned char *)ecu->dids[mid].data;
+    }
+    if(ecu->dids[mid].did < did) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return NULL;
+}
+
+void handle_image_current_data(int can, struct canfd_frame frame) {
+  struct ecu *ecu = cur_req.ecu;
+  struct image_pid *p;
+  if(cur_req.len < 2) return;
+  p = image_find_pid(ecu->def, cur_req.data[1]);
+  if(!p) {
+    if(ecu->pid_fallback) ecu->pid_fallback(can, frame);
+    else if(verbose) plog("PID %02X not supported\n", cur_req.data[1]);
+    return;
+  }
+  if(p->len > IMAGE_PID_MAX) return; // image_valid already rejects these
+  resp_buf[0] = 0x41;
+  resp_buf[1] = p->pid;
+  memcpy(&resp_buf[2], ecu_image + p->data_off, p->len);
+  isotp_send_to(can, (char *)resp_buf, 2 + p->len, ecu->resp_id);
+}
+
+// Registers the ECUs from a definition file.  An ECU whose request ID
+// is already simulated keeps its built in handlers and just gets the
+// file's data on top.
+int ecu_defs_load(char *file) {
+  struct image_header *hdr;
+  struct image_ecu *defs;
+  struct image_dtc *dtcs;
+  struct ecu *ecu;
+  char path[PATH_MAX];
+  long long start = now_us();
+  uint32_t i, j;
+  int fd, cached = 1;
+  snprintf(path, sizeof(path), "%s%s", file, IMAGE_SUFFIX);
+  ecu_image = image_map(path, file, &ecu_image_size);
+  if(!ecu_image) {
+    cached = 0;
+    ecu_image = def_build(file, &ecu_image_size);
+    if(!ecu_image) return -1;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || write(fd, ecu_image, ecu_image_size) != ecu_image_size) {
+      if(verbose) plog("Couldn't cache the compiled image in %s\n", path);
+    }
+    if(fd >= 0) close(fd);
+  }
+  hdr = (struct image_header *)ecu_image;
+  defs = (struct image_ecu *)(ecu_image + hdr->ecu_off);
+  for(i = 0; i < hdr->ecu_count; i++) {
+    ecu = ecu_by_id[defs[i].req_id];
+    if(!ecu || ecu->req_id != defs[i].req_id) {
+      ecu = ecu_register((char *)ecu_image + defs[i].name_off, defs[i].req_id, defs[i].resp_id);
+      if(!ecu) continue;
+      ecu_add_sid(ecu, UDS_SID_TESTER_PRESENT, handle_tester_present);
+    }
+    ecu->def = &defs[i];
+    if(defs[i].func_id && ecu->func_id != defs[i].func_id) ecu_alias(ecu, defs[i].func_id);
+    if(defs[i].did_count) {
+      if(ecu->sids[UDS_SID_READ_DATA_BY_ID] != handle_read_data_by_id) ecu->did_fallback = ecu->sids[UDS_SID_READ_DATA_BY_ID];
+      ecu_add_sid(ecu, UDS_SID_READ_DATA_BY_ID, handle_read_data_by_id);
+    }
+    if(defs[i].pid_count) {
+      if(ecu->sids[OBD_MODE_SHOW_CURRENT_DATA] != handle_image_current_data) ecu->pid_fallback = ecu->sids[OBD_MODE_SHOW_CURRENT_DATA];
+      ecu_add_sid(ecu, OBD_MODE_SHOW_CURRENT_DATA, handle_image_current_data);
+    }
+    if(defs[i].dtc_count) {
+      // The file's DTCs replace the made up ones
+      dtc_reset(ecu);
+      dtcs = (struct image_dtc *)(ecu_image + defs[i].dtc_off);
+      for(j = 0; j < defs[i].dtc_count; j++) dtc_add(ecu, dtcs[j].code << 8, dtcs[j].status);
+      ecu_add_sid(ecu, OBD_MODE_READ_DTC, handle_stored_codes);
+      ecu_add_sid(ecu, OBD_MODE_READ_PENDING_DTC, handle_pending_codes);
+      ecu_add_sid(ecu, OBD_MODE_READ_PERM_DTC, handle_perm_codes);
+      ecu_add_sid(ecu, OBD_MODE_CLEAR_DTC, handle_clear_codes);
+      ecu_add_sid(ecu, UDS_SID_READ_DTC, handle_read_dtc_info);
+      ecu_add_sid(ecu, UDS_SID_CLEAR_DTC, handle_clear_dtc);
+    }
+  }
+  if(verbose) plog("%s ECU definitions from %s: %u ECUs, %u byte image in %lld us\n", cached ? "Mapped" : "Compiled",
+                   cached ? path : file, hdr->ecu_count, ecu_image_size, now_us() - start);
+  return 0;
+}
+
+/*
+ * Memory images
+ *
+ * -m <ecu id>:<address>:<file> maps a file read-only so that it shows
+ * up at that address for ReadMemoryByAddress.  Reads are sent straight
+ * from the mapping, so a full flash dump costs no more than the bus.
+ */
+int mem_region_load(char *spec) {
+  struct mem_region *r;
+  struct ecu *ecu;
+  struct stat st;
+  char *p, *end;
+  long id;
+  int fd;
+  if(mem_region_count == MEM_REGIONS_MAX) {
+    plog("Too many memory images, max %d\n", MEM_REGIONS_MAX);
+    return -1;
+  }
+  r = &mem_regions[mem_region_count];
+  id = strtol(spec, &end, 16);
+  ecu = *end == ':' && id >= 0 && id <= CAN_SFF_MASK ? ecu_by_id[id] : NULL;
+  if(!ecu || ecu->req_id != id || !ecu->resp_id) {
+    plog("Memory image %s: no ECU with that request ID\n", spec);
+    return -1;
+  }
+  p = end + 1;
+  r->base = strtoull(p, &end, 0);
+  if(end == p || *end != ':') {
+    plog("Memory image %s: expected <ecu id>:<address>:<file>\n", spec);
+    return -1;
+  }
+  fd = open(end + 1, O_RDONLY);
+  if(fd < 0) {
+    perror(end + 1);
+    return -1;
+  }
+  if(fstat(fd, &st) < 0 || st.st_size == 0) {
+    plog("Memory image %s is empty\n", end + 1);
+    close(fd);
+    return -1;
+  }
+  r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(r->map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(r->map, st.st_size, MADV_SEQUENTIAL); // Dumps read front to back
+  r->size = st.st_size;
+  r->ecu = ecu;
+  mem_region_count++;
+  ecu_add_sid(ecu, UDS_SID_READ_MEM_BY_ADDRESS, handle_read_mem_by_address);
+  ecu_add_sid(ecu, UDS_SID_REQUEST_UPLOAD, handle_request_upload);
+  ecu_add_sid(ecu, UDS_SID_TRANSFER_DATA, handle_transfer_data);
+  ecu_add_sid(ecu, UDS_SID_REQUEST_XFER_EXIT, handle_request_xfer_exit);
+  if(verbose) plog("%s memory %08llX-%08llX from %s\n", ecu->name, (unsigned long long)r->base,
+                   (unsigned long long)(r->base + r->size - 1), end + 1);
+  return 0;
+}
+
+// Finds the image holding all of [addr, addr + size)
+struct mem_region *mem_find(struct ecu *ecu, uint64_t addr, uint64_t size) {
+  int i;
+  for(i = 0; i < mem_region_count; i++) {
+    if(mem_regions[i].ecu != ecu || addr < mem_regions[i].base) continue;
+    if(addr - mem_regions[i].base + size <= mem_regions[i].size) return &mem_regions[i];
+  }
+  return NULL;
+}
+
+// Starts the writers and lets every ECU take downloads
+int downloads_start() {
+  int i;
+  crc32_init();
+  for(i = 0; i < XFER_BUFS; i++) xfer_free[xfer_free_count++] = i;
+  for(i = 0; i < XFER_WRITERS; i++) {
+    pthread_mutex_init(&writers[i].lock, NULL);
+    pthread_cond_init(&writers[i].ready, NULL);
+    pthread_cond_init(&writers[i].room, NULL);
+    if(pthread_create(&writers[i].thread, NULL, writer_run, &writers[i]) != 0) {
+      perror("pthread_create");
+      return -1;
+    }
+  }
+  for(i = 0; i < ecu_count; i++) {
+    if(!ecus[i].resp_id) continue;
+    ecu_add_sid(&ecus[i], UDS_SID_REQUEST_DOWNLOAD, handle_request_download);
+    ecu_add_sid(&ecus[i], UDS_SID_TRANSFER_DATA, handle_transfer_data);
+    ecu_add_sid(&ecus[i], UDS_SID_REQUEST_XFER_EXIT, handle_request_xfer_exit);
+  }
+  if(verbose) plog("Saving downloads to %s\n", download_dir);
+  return 0;
+}
+
+// Lets the writers finish what is queued and waits for them
+void downloads_stop() {
+  int i;
+  for(i = 0; i < XFER_WRITERS; i++) {
+    pthread_mutex_lock(&writers[i].lock);
+    writers[i].stop = 1;
+    pthread_cond_signal(&writers[i].ready);
+    pthread_mutex_unlock(&writers[i].lock);
+  }
+  for(i = 0; i < XFER_WRITERS; i++) pthread_join(writers[i].thread, NULL);
+}
+
+/*
+ * Response cache
+ *
+ * Before the event loops start every likely request (OBD modes 01 and
+ * 09, GM 1A, the F1xx/06xx DIDs and every DID from a definition file)
+ * is run through its ECU's handler twice with different random seeds,
+ * with the transmit path capturing instead of sending.  If both runs
+ * produce the same single PDU or the same raw frames, the answer is
+ * segmented into its final frame sequence once and kept.  A hit then
+ * goes straight to sendmmsg() without any handler or ISO-TP work.
+ */
+struct rcache_pattern {
+  int sid;
+  int prefix;  // Byte before the one that runs 00-FF, -1 for none
+} rcache_patterns[] = {
+  { OBD_MODE_SHOW_CURRENT_DATA, -1 },
+  { OBD_MODE_VEHICLE_INFORMATION, -1 },
+  { UDS_SID_GM_READ_DID_BY_ID, -1 },
+  { UDS_SID_READ_DATA_BY_ID, 0xF1 },
+  { UDS_SID_READ_DATA_BY_ID, 0x06 },
+};
+
+void rcache_capture_pdu(int dest, int ext, char *data, int size) {
+  if(rcache_cap->pdus++ || rcache_cap->raw || ext >= 0 || size > ISOTP_BUF_SIZE) {
+    rcache_cap->bad = 1;
+    return;
+  }
+  rcache_cap->dest = dest;
+  rcache_cap->len = size;
+  memcpy(rcache_cap->pdu, data, size);
+}
+
+void rcache_capture_frames(int count) {
+  if(rcache_cap->pdus || rcache_cap->raw + count > TX_BATCH_MAX) {
+    rcache_cap->bad = 1;
+    return;
+  }
+  memcpy(&rcache_cap->frames[rcache_cap->raw], tx_frames, count * sizeof(struct canfd_frame));
+  rcache_cap->raw += count;
+}
+
+unsigned int rcache_hash(struct ecu *ecu, int req_id, unsigned char *key, int len) {
+  unsigned int h = (2166136261u ^ (ecu - ecus)) * 16777619u ^ req_id;
+  int i;
+  for(i = 0; i < len; i++) h = (h ^ key[i]) * 16777619u;
+  h = (h ^ len) * 16777619u;
+  return h & rcache_mask;
+}
+
+struct rcache_entry *rcache_find(struct ecu *ecu, int req_id, unsigned char *key, int len) {
+  struct rcache_entry *e;
+  unsigned int slot = rcache_hash(ecu, req_id, key, len);
+  while(rcache_slots[slot]) {
+    e = &rcache[rcache_slots[slot] - 1];
+    if(e->ecu == ecu && e->req_id == req_id && e->key_len == len && !memcmp(e->key, key, len)) return e;
+    slot = (slot + 1) & rcache_mask;
+  }
+  return NULL;
+}
+
+// Appends an empty frame to the pool, which may move it
+struct canfd_frame *rcache_new_frame(int dest) {
+  if(rcache_frames_len == rcache_frames_alloc) {
+    rcache_frames_alloc = rcache_frames_alloc ? rcache_frames_alloc * 2 : 1024;
+    rcache_frames = realloc(rcache_frames, rcache_frames_alloc * sizeof(struct canfd_frame));
+  }
+  memset(&rcache_frames[rcache_frames_len], 0, sizeof(struct canfd_frame));
+  rcache_frames[rcache_frames_len].can_id = dest;
+  return &rcache_frames[rcache_frames_len++];
+}
+
+// Runs one request through the handler with the transmit path captured
+void rcache_run(struct ecu *ecu, int req_id, unsigned char *req, int len, struct rcache_capture *cap) {
+  struct canfd_frame frame;
+  cap->bad = cap->pdus = cap->raw = 0;
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = req_id;
+  frame.len = CAN_MAX_DLEN;
+  frame.data[0] = len;
+  memcpy(&frame.data[1], req, len);
+  cur_req.id = req_id;
+  cur_req.ecu = ecu;
+  cur_req.data = &frame.data[1];
+  cur_req.len = len;
+  rcache_cap = cap;
+  ecu->sids[req[0]](-1, frame);
+}
+
+int rcache_same(struct rcache_capture *a, struct rcache_capture *b) {
+  if(a->bad || b->bad || a->pdus != b->pdus || a->raw != b->raw) return 0;
+  if(a->pdus) return a->dest == b->dest && a->len == b->len && !memcmp(a->pdu, b->pdu, a->len);
+  return a->raw && !memcmp(a->frames, b->frames, a->raw * sizeof(struct canfd_frame));
+}
+
+void rcache_add(struct ecu *ecu, int req_id, unsigned char *req, int len) {
+  struct rcache_capture *cap = &rcache_caps[0];
+  struct rcache_entry *e;
+  unsigned int slot;
+  int offset, chunk, sn;
+  if(len > RCACHE_KEY_MAX || !ecu->sids[req[0]] || rcache_find(ecu, req_id, req, len)) return;
+  prng_seed(1);
+  rcache_run(ecu, req_id, req, len, &rcache_caps[0]);
+  prng_seed(2);
+  rcache_run(ecu, req_id, req, len, &rcache_caps[1]);
+  if(!rcache_same(&rcache_caps[0], &rcache_caps[1])) return;
+  // Negative responses are cheap to build again and most of the pattern
+  // bytes only get one, they'd take up most of the cache
+  if(cap->pdus ? cap->pdu[0] == 0x7F : cap->raw == 1 && cap->frames[0].data[0] <= 7 && cap->frames[0].data[1] == 0x7F) return;
+  if(rcache_count == rcache_alloc) {
+    rcache_full++;
+    return;
+  }
+  e = &rcache[rcache_count];
+  memset(e, 0, sizeof(*e));
+  e->ecu = ecu;
+  e->req_id = req_id;
+  e->key_len = len;
+  memcpy(e->key, req, len);
+  e->frame_off = rcache_frames_len;
+  if(cap->pdus) {
+    e->dest = cap->dest;
+    e->pdu_len = cap->len;
+    if(rcache_pdus_len + cap->len > rcache_pdus_alloc) {
+      rcache_pdus_alloc = (rcache_pdus_len + cap->len) * 2;
+      rcache_pdus = realloc(rcache_pdus, rcache_pdus_alloc);
+    }
+    e->pdu_off = rcache_pdus_len;
+    memcpy(&rcache_pdus[e->pdu_off], cap->pdu, cap->len);
+    rcache_pdus_len += cap->len;
+    e->first = isotp_first_frame(rcache_new_frame(e->dest), (char *)cap->pdu, cap->len, -1);
+    for(offset = e->first, sn = 1; offset < cap->len; offset += chunk, sn++) {
+      chunk = cap->len - offset;
+      if(chunk > isotp_dl() - 1) chunk = isotp_dl() - 1;
+      isotp_fill_cf(rcache_new_frame(e->dest), cap->pdu + offset, chunk, sn, -1);
+    }
+  } else {
+    e->dest = cap->frames[0].can_id;
+    for(offset = 0; offset < cap->raw; offset++) {
+      memcpy(rcache_new_frame(e->dest), &cap->frames[offset], sizeof(struct canfd_frame));
+    }
+  }
+  e->frame_count = rcache_frames_len - e->frame_off;
+  slot = rcache_hash(ecu, req_id, req, len);
+  while(rcache_slots[slot]) slot = (slot + 1) & rcache_mask;
+  rcache_slots[slot] = ++rcache_count;
+}
+
+// Caches a request both on the ECU's physical and functional ID
+void rcache_add_ecu(struct ecu *ecu, unsigned char *req, int len) {
+  rcache_add(ecu, ecu->req_id, req, len);
+  if(ecu->func_id) rcache_add(ecu, ecu->func_id, req, len);
+}
+
+// Most answers rcache_build() can add: every pattern byte and DID of
+// every ECU, twice when it has a functional ID too
+int rcache_bound() {
+  struct rcache_pattern *pat;
+  int e, n, total = 0;
+  for(e = 0; e < ecu_count; e++) {
+    n = 0;
+    for(pat = rcache_patterns; pat < rcache_patterns + sizeof(rcache_patterns) / sizeof(rcache_patterns[0]); pat++) {
+      if(ecus[e].sids[pat->sid]) n += 256;
+    }
+    if(ecus[e].sids[UDS_SID_READ_DATA_BY_ID] == handle_read_data_by_id) {
+      n += ecus[e].did_count;
+      if(ecus[e].def) n += ecus[e].def->did_count;
+    }
+    total += ecus[e].func_id ? n * 2 : n;
+  }
+  return total;
+}
+
+void rcache_build() {
+  struct rcache_pattern *pat;
+  struct image_did *dids;
+  struct ecu *ecu;
+  unsigned char req[3];
+  long long start = now_us();
+  int saved_verbose = verbose;
+  uint64_t saved_prng[4];
+  uint32_t n;
+  int e, i;
+  if(fuzz_level || mutate_rate || tp_rate) return;
+  rcache_alloc = rcache_bound();
+  for(rcache_mask = 1; rcache_mask < (unsigned int)rcache_alloc * 2; rcache_mask <<= 1);
+  rcache = calloc(rcache_alloc ? rcache_alloc : 1, sizeof(struct rcache_entry));
+  rcache_slots = calloc(rcache_mask, sizeof(int));
+  rcache_mask--;
+  if(!rcache || !rcache_slots) {
+    perror("rcache_build");
+    free(rcache);
+    free(rcache_slots);
+    rcache_alloc = 0;
+    return;
+  }
+  memcpy(saved_prng, prng_s, sizeof(saved_prng));
+  verbose = 0;
+  rcache_capturing = 1;
+  for(e = 0; e < ecu_count; e++) {
+    ecu = &ecus[e];
+    for(pat = rcache_patterns; pat < rcache_patterns + sizeof(rcache_patterns) / sizeof(rcache_patterns[0]); pat++) {
+      if(!ecu->sids[pat->sid]) continue;
+      req[0] = pat->sid;
+      req[1] = pat->prefix;
+      for(i = 0; i < 256; i++) {
+        req[pat->prefix < 0 ? 1 : 2] = i;
+        rcache_add_ecu(ecu, req, pat->prefix < 0 ? 2 : 3);
+      }
+    }
+    if(ecu->sids[UDS_SID_READ_DATA_BY_ID] != handle_read_data_by_id) continue;
+    req[0] = UDS_SID_READ_DATA_BY_ID;
+    for(i = 0; i < ecu->did_count; i++) {
+      req[1] = ecu->dids[i].did >> 8;
+      req[2] = ecu->dids[i].did & 0xFF;
+      rcache_add_ecu(ecu, req, 3);
+    }
+    if(!ecu->def) continue;
+    dids = (struct image_did *)(ecu_image + ecu->def->did_off);
+    for(n = 0; n < ecu->def->did_count; n++) {
+      req[1] = dids[n].did >> 8;
+      req[2] = dids[n].did & 0xFF;
+      rcache_add_ecu(ecu, req, 3);
+    }
+  }
+  rcache_capturing = 0;
+  verbose = saved_verbose;
+  memcpy(prng_s, saved_prng, sizeof(prng_s));
+  rcache_enabled = 1;
+  if(verbose) plog("Response cache: %d answers in %u frames, built in %lld us\n", rcache_count, rcache_frames_len, now_us() - start);
+  if(rcache_full) plog("Response cache full, %lu static answers are built on every request\n", rcache_full);
+}
+
+// Sends the cached answer to the request being handled.  Returns 0 if
+// there is none.
+int rcache_send(int can, struct canfd_frame frame) {
+  struct rcache_entry *e = NULL;
+  struct isotp_session *sess;
+  struct canfd_frame *frames, *out;
+  uint32_t i;
+  if(cur_req.len <= RCACHE_KEY_MAX) e = rcache_find(cur_req.ecu, frame.can_id & CAN_SFF_MASK, cur_req.data, cur_req.len);
+  if(!e) {
+    rcache_misses++;
+    return 0;
+  }
+  rcache_hits++;
+  frames = &rcache_frames[e->frame_off];
+  if(e->pdu_len && isotp_backend == ISOTP_KERNEL &&
+     isotp_kernel_send(e->dest, (char *)&rcache_pdus[e->pdu_off], e->pdu_len) == 0) return 1;
+  if(tx_count > 0) tx_flush(can);
+  if(e->pdu_len && e->frame_count > 1) {
+    sess = isotp_session_get(isotp_rx_id(e->dest), e->dest, -1);
+    if(!sess) return 1;
+    out = tx_frame(e->dest);
+    memcpy(out, &frames[0], sizeof(struct canfd_frame));
+    sess->cfs = &frames[1];
+    isotp_session_start(can, sess, e->pdu_len, e->first);
+    return 1;
+  }
+  for(i = 0; i < e->frame_count; i++) {
+    out = tx_frame(e->dest);
+    if(!out) {
+      tx_flush(can);
+      out = tx_frame(e->dest);
+    }
+    memcpy(out, &frames[i], sizeof(struct canfd_frame));
+  }
+  if(tx_flush(can) == 1 && e->pdu_len) {
+    isotp_tx_bytes += e->pdu_len;
+    isotp_tx_frames++;
+  }
+  return 1;
+}
+
+/*
+ * Kernel ISO-TP backend
+ *
+ * Every ECU that answers over ISO-TP gets a CAN_ISOTP socket for its
+ * physical request ID (and one for its functional ID), so segmentation,
+ * flow control and STmin are all done by the kernel and the handlers
+ * only ever see whole PDUs.  Anything that isn't ISO-TP still goes out
+ * on the raw socket.
+ */
+// Newer kernels make the largest PDU a module parameter
+void isotp_kernel_limits() {
+  FILE *fp = fopen("/sys/module/can_isotp/parameters/max_pdu_size", "r");
+  int max;
+  if(!fp) return;
+  if(fscanf(fp, "%d", &max) == 1 && max > 0) isotp_kernel_pdu_max = max;
+  fclose(fp);
+  if(verbose) plog("CAN_ISOTP sends up to %d byte PDUs\n", isotp_kernel_pdu_max);
+}
+
+int isotp_kernel_open(int ifindex, int rx_id, int tx_id) {
+  struct sockaddr_can addr;
+  struct can_isotp_fc_options fc;
+  struct can_isotp_ll_options ll;
+  int fd;
+  fd = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK, CAN_ISOTP);
+  if(fd < 0) return -1;
+  memset(&fc, 0, sizeof(fc));
+  fc.bs = ISOTP_RX_BS;
+  fc.stmin = ISOTP_RX_STMIN;
+  setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc, sizeof(fc));
+  if(can_fd) {
+    memset(&ll, 0, sizeof(ll));
+    ll.mtu = CANFD_MTU;
+    ll.tx_dl = CANFD_MAX_DLEN;
+    ll.tx_flags = CANFD_BRS;
+    if(setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &ll, sizeof(ll)) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifindex;
+  addr.can_addr.tp.rx_id = rx_id;
+  addr.can_addr.tp.tx_id = tx_id;
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
   }
+  return fd;
 }
 
-// Prints raw packet in ID#DATA format
-void print_pkt(struct canfd_frame frame) {
+// Returns 0 on success.  On failure nothing is left open and the raw
+// socket backend has to be used.
+int isotp_kernel_init(int ifindex) {
+  struct ecu *ecu;
   int i;
-  plog("Pkt: %02X#", frame.can_id);
-  for(i = 0; i < frame.len; i++) {
-    plog("%02X ", frame.data[i]);
+  for(i = 0; i < ecu_count; i++) {
+    ecu = &ecus[i];
+    if(!ecu->resp_id || !ecu_on_loop(ecu)) continue;
+    ecu->isotp_fd[loop_id] = isotp_kernel_open(ifindex, ecu->req_id, ecu->resp_id);
+    if(ecu->isotp_fd[loop_id] >= 0 && ecu->func_id) {
+      ecu->func_fd[loop_id] = isotp_kernel_open(ifindex, ecu->func_id, ecu->resp_id);
+    }
+    if(ecu->isotp_fd[loop_id] < 0 || (ecu->func_id && ecu->func_fd[loop_id] < 0)) {
+      perror("CAN_ISOTP");
+      isotp_kernel_close();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void isotp_kernel_close() {
+  int i;
+  for(i = 0; i < ecu_count; i++) {
+    if(ecus[i].isotp_fd[loop_id] >= 0) close(ecus[i].isotp_fd[loop_id]);
+    if(ecus[i].func_fd[loop_id] >= 0) close(ecus[i].func_fd[loop_id]);
+    ecus[i].isotp_fd[loop_id] = -1;
+    ecus[i].func_fd[loop_id] = -1;
+  }
+}
+
+// Returns -1 if there is no kernel socket for dest and the raw socket
+// has to be used instead
+int isotp_kernel_send(int dest, char *data, int size) {
+  struct iovec iov = { data, size };
+  return isotp_kernel_sendv(dest, &iov, 1);
+}
+
+int isotp_kernel_sendv(int dest, struct iovec *iov, int count) {
+  struct ecu *ecu = ecu_by_resp[dest & CAN_SFF_MASK];
+  int i, size = 0;
+  unsigned char nrc[3];
+  struct iovec nrc_iov = { nrc, 3 };
+  if(!ecu || ecu->isotp_fd[loop_id] < 0) return -1;
+  for(i = 0; i < count; i++) size += iov[i].iov_len;
+  if(size > isotp_kernel_pdu_max) {
+    // The kernel refuses it and the raw socket can't take over for an
+    // ID it leaves to CAN_ISOTP, so at least tell the tester
+    plog("ISOTP: %d byte response from %03X is too long for CAN_ISOTP\n", size, dest);
+    nrc[0] = 0x7F;
+    nrc[1] = ((unsigned char *)iov[0].iov_base)[0] - 0x40;
+    nrc[2] = UDS_NRC_RESPONSE_TOO_LONG;
+    iov = &nrc_iov;
+    count = 1;
+    size = 3;
+  }
+  if(writev(ecu->isotp_fd[loop_id], iov, count) < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      isotp_kernel_busy++;
+      plog("ISOTP: %03X is still sending, dropping %d byte response\n", dest, size);
+    } else {
+      perror("CAN_ISOTP write");
+    }
+    return 0;
+  }
+  isotp_kernel_pdus_tx++;
+  isotp_tx_bytes += size;
+  return 0;
+}
+
+// Reads a whole PDU from an ECU's socket and runs it through the handlers
+void isotp_kernel_rx(int can, struct ecu *ecu, int functional) {
+  struct canfd_frame frame;
+  int len;
+  len = read(functional ? ecu->func_fd[loop_id] : ecu->isotp_fd[loop_id], isotp_kernel_buf, ISOTP_BUF_SIZE);
+  if(len <= 0) {
+    if(len < 0 && errno != EAGAIN) perror("CAN_ISOTP read");
+    return;
+  }
+  isotp_kernel_pdus_rx++;
+  case_id++;
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = functional ? ecu->func_id : ecu->req_id;
+  frame.data[0] = len < CANFD_MAX_DLEN - 1 ? len : CANFD_MAX_DLEN - 1;
+  frame.len = frame.data[0] + 1;
+  memcpy(&frame.data[1], isotp_kernel_buf, frame.data[0]);
+  cur_req.id = frame.can_id;
+  cur_req.data = isotp_kernel_buf;
+  cur_req.len = len;
+  if(functional) {
+    // Every ECU on a functional ID has its own socket, so no fan-out here
+    if(verbose && ecu->log_pkts) print_pkt(frame);
+    ecu_functional(can, ecu, frame);
+  } else {
+    handle_request(can, frame);
+  }
+}
+
+/*
+ * Record and replay
+ *
+ * -R writes every frame we receive and send to a file: a header with
+ * the seed and fuzz settings, then one record per frame.  A record has
+ * the microseconds since the previous record of the same loop, the CAN
+ * ID, a byte with the loop number and direction, the length and the
+ * data.  Records are collected per thread and written out in blocks.
+ *
+ * -P drives a recording back at the tester instead of simulating: each
+ * frame it sends is matched against the next recorded one (a case) and
+ * the frames that followed it in the recording go out again, after their
+ * recorded delays or right away with -X.  -P <file>:<cases> stops after
+ * that many cases, which is enough to bisect a crash.
+ */
+#define REC_MAGIC      "UDSR"
+#define REC_VERSION    1
+#define REC_TX         0x80 // Direction bit in the info byte, the rest is the loop
+#define REC_HDR_LEN    10
+#define REC_BUF_SIZE   65536
+#define REPLAY_AHEAD   16   // Recorded requests searched for a match
+
+struct rec_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t seed;
+  uint8_t fuzz_level;
+  uint8_t mutate_rate;
+  uint8_t tp_rate;
+  uint8_t can_fd;
+  uint32_t loops;
+};
+struct replay_rec {
+  long long us;   // Since the first record of the loop
+  int tx;
+  struct canfd_frame frame;
+};
+struct replay_stream {
+  struct replay_rec *recs;
+  int count;
+  int alloc;
+};
+pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread unsigned char *rec_buf;
+__thread int rec_len = 0;
+__thread long long rec_last_us = 0;
+struct replay_stream replay_streams[MAX_IFACES];
+unsigned long replay_limit = 0; // Cases to replay, 0 for all
+int replay_fast = 0;
+__thread int replay_pos = 0;
+__thread unsigned long replay_case = 0;
+__thread unsigned long replay_unmatched = 0;
+
+int rec_open(char *file, int loops) {
+  struct rec_header h;
+  recfp = fopen(file, "w");
+  if(!recfp) {
+    perror(file);
+    return -1;
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, REC_MAGIC, 4);
+  h.version = REC_VERSION;
+  h.seed = fuzz_seed;
+  h.fuzz_level = fuzz_level;
+  h.mutate_rate = mutate_rate;
+  h.tp_rate = tp_rate;
+  h.can_fd = can_fd;
+  h.loops = loops;
+  fwrite(&h, sizeof(h), 1, recfp);
+  if(verbose) plog("Recording to %s\n", file);
+  return 0;
+}
+
+void rec_flush() {
+  if(!rec_len) return;
+  pthread_mutex_lock(&rec_lock);
+  fwrite(rec_buf, 1, rec_len, recfp);
+  pthread_mutex_unlock(&rec_lock);
+  rec_len = 0;
+}
+
+void rec_frames(struct canfd_frame *frames, int count, int tx) {
+  long long now = now_us();
+  unsigned char *p;
+  uint32_t delta;
+  int i;
+  delta = !rec_last_us ? 0 : now - rec_last_us > 0xFFFFFFFF ? 0xFFFFFFFF : now - rec_last_us;
+  rec_last_us = now;
+  for(i = 0; i < count; i++) {
+    if(rec_len + REC_HDR_LEN + CANFD_MAX_DLEN > REC_BUF_SIZE) rec_flush();
+    p = &rec_buf[rec_len];
+    memcpy(p, &delta, 4);
+    memcpy(p + 4, &frames[i].can_id, 4);
+    p[8] = loop_id | (tx ? REC_TX : 0);
+    p[9] = frames[i].len;
+    memcpy(p + REC_HDR_LEN, frames[i].data, frames[i].len);
+    rec_len += REC_HDR_LEN + frames[i].len;
+    delta = 0;
+  }
+}
+
+int replay_load(char *arg) {
+  struct rec_header h;
+  struct replay_stream *st;
+  struct replay_rec *r;
+  long long clock[MAX_IFACES];
+  struct stat sb;
+  unsigned char *map, *p, *end;
+  char spec[PATH_MAX];
+  char *colon;
+  uint32_t delta;
+  int fd, loop, frames = 0;
+  if(snprintf(spec, sizeof(spec), "%s", arg) >= (int)sizeof(spec)) {
+    plog("Recording %s: name too long\n", arg);
+    return -1;
+  }
+  // Only a trailing :<digits> is the case count, other colons are part
+  // of the file name, and so is the suffix if the whole thing exists
+  colon = strrchr(spec, ':');
+  if(colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1) && access(spec, F_OK) < 0) {
+    *colon = 0;
+    replay_limit = strtoul(colon + 1, NULL, 10);
+  }
+  fd = open(spec, O_RDONLY);
+  if(fd < 0) {
+    perror(spec);
+    return -1;
+  }
+  if(fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(h)) {
+    plog("Recording %s is empty\n", spec);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  memcpy(&h, map, sizeof(h));
+  if(memcmp(h.magic, REC_MAGIC, 4) || h.version != REC_VERSION) {
+    plog("%s is not a recording\n", spec);
+    munmap(map, sb.st_size);
+    return -1;
+  }
+  if(h.can_fd != can_fd) {
+    plog("%s was recorded %s CAN FD, replay it %s -f\n", spec, h.can_fd ? "with" : "without", h.can_fd ? "with" : "without");
+    munmap(map, sb.st_size);
+    return -1;
+  }
+  memset(clock, 0, sizeof(clock));
+  end = map + sb.st_size;
+  for(p = map + sizeof(h); p + REC_HDR_LEN <= end && p + REC_HDR_LEN + p[9] <= end; p += REC_HDR_LEN + p[9]) {
+    loop = p[8] & ~REC_TX;
+    if(loop >= MAX_IFACES || p[9] > CANFD_MAX_DLEN) break;
+    st = &replay_streams[loop];
+    if(st->count == st->alloc) {
+      st->alloc = st->alloc ? st->alloc * 2 : 1024;
+      st->recs = realloc(st->recs, st->alloc * sizeof(struct replay_rec));
+    }
+    r = &st->recs[st->count++];
+    memcpy(&delta, p, 4);
+    clock[loop] += delta;
+    r->us = clock[loop];
+    r->tx = p[8] & REC_TX;
+    memset(&r->frame, 0, sizeof(r->frame));
+    memcpy(&r->frame.can_id, p + 4, 4);
+    r->frame.len = p[9];
+    memcpy(r->frame.data, p + REC_HDR_LEN, p[9]);
+    frames++;
+  }
+  if(p != end) plog("Recording %s is cut short, replaying the first %d frames\n", spec, frames);
+  munmap(map, sb.st_size);
+  plog("Replaying %d frames from %s (seed %llu, fuzz level %d, -M %d, -T %d)\n", frames, spec,
+       (unsigned long long)h.seed, h.fuzz_level, h.mutate_rate, h.tp_rate);
+  return 0;
+}
+
+// Takes the place of handle_pkt() while replaying
+void replay_rx(int can, struct canfd_frame *frame) {
+  struct replay_stream *st = &replay_streams[loop_id];
+  struct canfd_frame *out;
+  struct replay_rec *r = NULL;
+  long long base, now;
+  int pos, skipped = 0;
+  if(replay_limit && replay_case >= replay_limit) return;
+  for(pos = replay_pos; pos < st->count && skipped < REPLAY_AHEAD; pos++) {
+    r = &st->recs[pos];
+    if(r->tx) continue;
+    if(r->frame.can_id == frame->can_id && r->frame.len == frame->len && !memcmp(r->frame.data, frame->data, frame->len)) break;
+    skipped++;
+  }
+  if(pos == st->count || skipped == REPLAY_AHEAD) {
+    replay_unmatched++;
+    if(verbose) plog("Replay: %03X#%02X... doesn't match the recording\n", frame->can_id, frame->data[0]);
+    return;
+  }
+  replay_case += skipped + 1;
+  if(verbose) plog("Replay: case %lu\n", replay_case);
+  base = r->us;
+  now = now_us();
+  if(tx_count > 0) tx_flush(can);
+  for(pos++; pos < st->count && st->recs[pos].tx; pos++) {
+    r = &st->recs[pos];
+    if(!replay_fast && r->us > base && tx_defer(&r->frame, now + r->us - base) == 0) continue;
+    out = tx_frame(r->frame.can_id);
+    if(!out) {
+      tx_flush(can);
+      out = tx_frame(r->frame.can_id);
+    }
+    memcpy(out, &r->frame, sizeof(struct canfd_frame));
   }
+  if(tx_count > 0) tx_flush(can);
+  replay_pos = pos;
+  if(replay_limit && replay_case >= replay_limit) plog("Replay: stopped after case %lu\n", replay_case);
+}
+
+void print_replay_stats() {
+  plog("Replay: %lu of %d recorded frames used, %lu cases", (unsigned long)replay_pos,
+       replay_streams[loop_id].count, replay_case);
+  if(replay_unmatched) plog(", %lu frames didn't match", replay_unmatched);
   plog("\n");
 }
 
-// Prints binary data in hex format
-void print_bin(unsigned char *bin, int size) {
+/*
+ * Receive engine
+ *
+ * Frames are drained with recvmmsg() into the preallocated rx_frames
+ * array, up to rx_batch per wakeup, and then handed to the handlers as
+ * one batch.  epoll is level triggered so anything left over wakes us
+ * right back up.
+ */
+void rx_init() {
   int i;
-  for(i = 0; i < size; i++) {
-    plog("%02X ", bin[i]);
+  for(i = 0; i < ISOTP_RX_POOL; i++) isotp_rxs[i].buf = isotp_rx_bufs[i];
+  for(i = 0; i < ISOTP_MAX_SESSIONS; i++) isotp_sessions[i].buf = isotp_tx_bufs[i];
+  memset(rx_msgs, 0, RX_BATCH_MAX * sizeof(struct mmsghdr));
+  memset(rx_hist, 0, sizeof(rx_hist));
+  for(i = 0; i < RX_BATCH_MAX; i++) {
+    rx_iov[i].iov_base = &rx_frames[i];
+    rx_iov[i].iov_len = sizeof(struct canfd_frame);
+    rx_msgs[i].msg_hdr.msg_name = &rx_addr[i];
+    rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+    rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    rx_msgs[i].msg_hdr.msg_control = &rx_ctrl[i];
+  }
+}
+
+void handle_batch(int can, struct canfd_frame *frames, int count) {
+  struct cmsghdr *cmsg;
+  int i;
+  // The drop counter is cumulative, the newest frame has the latest one
+  for(cmsg = CMSG_FIRSTHDR(&rx_msgs[count - 1].msg_hdr); cmsg;
+      cmsg = CMSG_NXTHDR(&rx_msgs[count - 1].msg_hdr, cmsg)) {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&rx_overflows, CMSG_DATA(cmsg), sizeof(__u32));
+    }
+  }
+  for(i = 0; i < count; i++) {
+    if(rx_msgs[i].msg_len != CAN_MTU && !(can_fd && rx_msgs[i].msg_len == CANFD_MTU)) {
+      rx_bad++;
+      if(verbose) plog("read: incomplete CAN frame (%d bytes)\n", rx_msgs[i].msg_len);
+      continue;
+    }
+    case_id++;
+    if(recfp) rec_frames(&frames[i], 1, 0);
+    if(replay_file) replay_rx(can, &frames[i]);
+    else handle_pkt(can, frames[i]);
+  }
+}
+
+// Returns the number of frames handled or -1 on a socket error
+int rx_drain(int can) {
+  int i, cnt;
+  for(i = 0; i < rx_batch; i++) {
+    // The kernel overwrites these on every call
+    rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_can);
+    rx_msgs[i].msg_hdr.msg_controllen = sizeof(rx_ctrl[i]);
+    rx_msgs[i].msg_hdr.msg_flags = 0;
+  }
+  cnt = recvmmsg(can, rx_msgs, rx_batch, MSG_DONTWAIT, NULL);
+  if(cnt < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+    perror("recvmmsg");
+    return -1;
+  }
+  if(cnt == 0) return 0;
+  rx_wakeups++;
+  rx_total += cnt;
+  rx_hist[cnt]++;
+  if(verbose > 2) plog("RX: wakeup handled %d frames\n", cnt);
+  handle_batch(can, rx_frames, cnt);
+  return cnt;
+}
+
+// Frames the interface received, from sysfs
+unsigned long iface_rx_packets(char *ifname) {
+  char path[128];
+  unsigned long packets = 0;
+  FILE *fp;
+  snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets", ifname);
+  fp = fopen(path, "r");
+  if(!fp) return 0;
+  if(fscanf(fp, "%lu", &packets) != 1) packets = 0;
+  fclose(fp);
+  return packets;
+}
+
+// Only the request IDs of registered ECUs make it to userspace, the
+// rest of the bus is dropped by the kernel
+void install_filters(int can) {
+  struct can_filter filters[RX_FILTER_MAX];
+  struct ecu *ecu;
+  int i, count = 0;
+  for(i = 0; i <= (int)CAN_SFF_MASK; i++) {
+    ecu = ecu_route(i);
+    if(!ecu) continue;
+    if(ecu->isotp_fd[loop_id] >= 0) continue; // CAN_ISOTP socket takes these
+    if(count == RX_FILTER_MAX) {
+      plog("More than %d request IDs, not filtering in the kernel\n", RX_FILTER_MAX);
+      return;
+    }
+    filters[count].can_id = i;
+    filters[count].can_mask = CAN_EFF_FLAG | CAN_SFF_MASK; // RTRs still pass
+    count++;
   }
+  if(setsockopt(can, SOL_CAN_RAW, CAN_RAW_FILTER, filters, count * sizeof(struct can_filter)) < 0) {
+    perror("CAN_RAW_FILTER");
+    return;
+  }
+  rx_filters = count;
+  if(verbose) plog("Installed %d kernel receive filters\n", count);
+}
+
+void print_rx_stats() {
+  unsigned long seen;
+  int i;
+  plog("RX: %lu frames in %lu wakeups", rx_total, rx_wakeups);
+  if(rx_wakeups) plog(" (%.2f frames/wakeup)", (double)rx_total / rx_wakeups);
+  if(rx_bad) plog(", %lu bad frames", rx_bad);
+  if(rx_overflows) plog(", %lu lost to socket overflow", rx_overflows);
   plog("\n");
+  seen = iface_rx_packets(can_ifname) - iface_rx_start;
+  if(rx_filters && seen >= rx_total) {
+    plog("RX: %s saw %lu frames, %lu delivered, %lu filtered by the kernel (%d filters)\n",
+         can_ifname, seen, rx_total, seen - rx_total, rx_filters);
+  }
+  if(!verbose || !rx_wakeups) return;
+  plog("RX: frames per wakeup histogram\n");
+  for(i = 1; i <= rx_batch; i++) {
+    if(rx_hist[i]) plog("  %3d: %lu\n", i, rx_hist[i]);
+  }
 }
 
-// Handles the incomming CAN Packets
-// Each ID that deals with specific controllers a note is
-// given where that info came from.  There could be a lot of overlap
-// and exceptions here. -- Craig
-void handle_pkt(int can, struct canfd_frame frame) {
-  if(DEBUG) print_pkt(frame);
-  switch(frame.can_id) {
-    case 0x243: // EBCM / GM / Chevy Malibu 2006
-      switch(frame.data[1]) {
-        case UDS_SID_TESTER_PRESENT:
-          if(verbose > 1) plog("Received TesterPresent\n");
-          generic_OK_resp_to(can, frame, 0x643);
-          break;
-        case UDS_SID_GM_READ_DIAG_INFO:
-          handle_gm_read_diag(can, frame);
-          break;
-        
-        default:
-          if(verbose) print_pkt(frame);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    case 0x244: // Body Control Module / GM / Chevy Malibu 2006
-      if(frame.data[0] == 0x30) { // Flow control
-        flow_control_push_to(can, 0x644);
-        return;
-      }
-      switch(frame.data[1]) {
-        case UDS_SID_TESTER_PRESENT:
-          if(verbose > 1) plog("Received TesterPresent\n");
-          generic_OK_resp_to(can, frame, 0x644);
-          break;
-        case UDS_SID_GM_READ_DIAG_INFO:
-          handle_gm_read_diag(can, frame);
-          break;
-        case UDS_SID_GM_READ_DATA_BY_ID:
-          handle_gm_read_data_by_id(can, frame);
-          break;
-        case UDS_SID_GM_READ_DID_BY_ID:
-          handle_gm_read_did_by_id(can, frame);
-          break;
-        default:
-          if(verbose) print_pkt(frame);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    case 0x24A: // Power Steering / GM / Chevy Malibu 2006
-      switch(frame.data[1]) {
-        default:
-          if(verbose) print_pkt(frame);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
-          break;
-      }
-      break;
-    case 0x350: // Unsure.  Seen RTRs to this when requesting VIN
-      if (frame.can_id & CAN_RTR_FLAG) {
-        if (verbose) plog("Received a RTR at ID %02X\n", frame.can_id);
-      }
-      break;
-    case 0x710: // VCDS
-      if(verbose) print_pkt(frame);
-      handle_vcds_710(can, frame);
-      break;
-    case 0x7df:
-    case 0x7e0:  // Sometimes flow control comes here
-      if(verbose) print_pkt(frame);
-      if(frame.data[0] == 0x30 && gBufLengthRemaining > 0) flow_control_push(can);
-      if(frame.data[0] == 0 || frame.len == 0) return;
-      if(frame.data[0] > frame.len) return;
-      switch (frame.data[1]) {
-        case OBD_MODE_SHOW_CURRENT_DATA:
-          handle_current_data(can, frame);
-          break;
-        case OBD_MODE_SHOW_FREEZE_FRAME: 
-          handle_freeze_frame(can, frame);
-          break;
-        case OBD_MODE_READ_DTC:
-          handle_stored_codes(can, frame);
-          break;
-        case OBD_MODE_READ_PENDING_DTC:
-          handle_pending_codes(can, frame);
-          break;
-        case OBD_MODE_VEHICLE_INFORMATION:
-          handle_vehicle_info(can, frame);
-          break;
-        case OBD_MODE_READ_PERM_DTC:
-          handle_perm_codes(can, frame);
-          break;
-        case UDS_SID_DIAGNOSTIC_CONTROL: // DSC
-          handle_dsc(can, frame);
+int ev_add(int epfd, int fd, int type, int idx) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = EV_KEY(type, idx);
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Event loops
+ *
+ * Every interface gets its own thread running the loop below, with its
+ * own sockets, ISO-TP sessions, timers and statistics.  The ECU table is
+ * built before the threads start and only read afterwards, so requests
+ * for any ECU can arrive on any bus without locking.  ECUs bound with -b
+ * only answer on their own bus and the buses routed to it with -g.
+ */
+// Buffers and tables of one loop, a few MB that used to be TLS
+struct loop_state {
+  unsigned char isotp_tx_bufs[ISOTP_MAX_SESSIONS][ISOTP_BUF_SIZE];
+  struct isotp_session isotp_sessions[ISOTP_MAX_SESSIONS];
+  unsigned char isotp_kernel_buf[ISOTP_BUF_SIZE];
+  unsigned char isotp_rx_bufs[ISOTP_RX_POOL][ISOTP_BUF_SIZE];
+  struct isotp_rx isotp_rxs[ISOTP_RX_POOL];
+  unsigned char resp_buf[ISOTP_BUF_SIZE];
+  struct xfer xfers[XFER_MAX];
+  struct canfd_frame tx_frames[TX_BATCH_MAX];
+  struct mmsghdr tx_msgs[TX_BATCH_MAX];
+  struct iovec tx_iov[TX_BATCH_MAX];
+  struct deferred_frame tx_defer_heap[TX_DEFER_MAX];
+  struct canfd_frame tx_backlog[TX_DEFER_MAX];
+  struct periodic_sub periodic_subs[PERIODIC_MAX];
+  int wheel_l0[WHEEL_SLOTS];
+  int wheel_l1[WHEEL_L1_SLOTS];
+  struct canfd_frame rx_frames[RX_BATCH_MAX];
+  struct mmsghdr rx_msgs[RX_BATCH_MAX];
+  struct iovec rx_iov[RX_BATCH_MAX];
+  struct sockaddr_can rx_addr[RX_BATCH_MAX];
+  char rx_ctrl[RX_BATCH_MAX][CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+  struct oracle_ecu oracle_ecus[MAX_ECUS];
+  struct oracle_finding oracle_findings[ORACLE_FINDINGS_MAX];
+  unsigned char mut_buf[ISOTP_BUF_SIZE];
+  struct canfd_frame tp_trains[ISOTP_MAX_SESSIONS][TP_TRAIN_MAX];
+  unsigned char rec_buf[REC_BUF_SIZE];
+};
+
+struct can_loop {
+  int id;
+  char *ifname;
+  int cpu;          // Core to pin to, -1 lets the scheduler decide
+  pthread_t thread;
+  struct loop_state *state;
+};
+struct can_loop loops[MAX_IFACES];
+int loop_count = 0;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+int shutdown_logged = 0;
+
+// Points the calling thread's tables at a loop's state
+void loop_state_use(struct loop_state *st) {
+  isotp_tx_bufs = st->isotp_tx_bufs;
+  isotp_sessions = st->isotp_sessions;
+  isotp_kernel_buf = st->isotp_kernel_buf;
+  isotp_rx_bufs = st->isotp_rx_bufs;
+  isotp_rxs = st->isotp_rxs;
+  resp_buf = st->resp_buf;
+  xfers = st->xfers;
+  tx_frames = st->tx_frames;
+  tx_msgs = st->tx_msgs;
+  tx_iov = st->tx_iov;
+  tx_defer_heap = st->tx_defer_heap;
+  tx_backlog = st->tx_backlog;
+  periodic_subs = st->periodic_subs;
+  wheel_l0 = st->wheel_l0;
+  wheel_l1 = st->wheel_l1;
+  rx_frames = st->rx_frames;
+  rx_msgs = st->rx_msgs;
+  rx_iov = st->rx_iov;
+  rx_addr = st->rx_addr;
+  rx_ctrl = st->rx_ctrl;
+  oracle_ecus = st->oracle_ecus;
+  oracle_findings = st->oracle_findings;
+  mut_buf = st->mut_buf;
+  tp_trains = st->tp_trains;
+  rec_buf = st->rec_buf;
+}
+
+void *can_loop_run(void *arg) {
+  struct can_loop *loop = arg;
+  int opt, ret;
+  int can, epfd;
+  int i;
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  struct epoll_event events[16];
+  unsigned long long expirations;
+  unsigned int idx;
+  cpu_set_t cpus;
+
+  loop_id = loop->id;
+  can_ifname = loop->ifname;
+  loop_state_use(loop->state);
+  prng_seed(fuzz_seed + loop_id);
+  if(loop->cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(loop->cpu, &cpus);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if(ret) plog("Couldn't pin %s to core %d: %s\n", can_ifname, loop->cpu, strerror(ret));
+    else if(verbose) plog("Serving %s on core %d\n", can_ifname, loop->cpu);
+  }
+
+  // Create a new raw CAN socket
+  can = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(can < 0) {
+    perror("Couldn't create raw socket");
+    exit(1);
+  }
+
+  addr.can_family = AF_CAN;
+  memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
+  strncpy(ifr.ifr_name, can_ifname, IFNAMSIZ - 1);
+  if (verbose) plog("Using CAN interface %s\n", ifr.ifr_name);
+  if (ioctl(can, SIOCGIFINDEX, &ifr) < 0) {
+    perror("SIOCGIFINDEX");
+    exit(1);
+  }
+  addr.can_ifindex = ifr.ifr_ifindex;
+
+  if (can_fd && setsockopt(can, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &can_fd, sizeof(can_fd)) < 0) {
+    perror("CAN_RAW_FD_FRAMES");
+    exit(1);
+  }
+
+  if(use_kernel_isotp) {
+    if(isotp_kernel_init(addr.can_ifindex) < 0) {
+      plog("Kernel ISO-TP not available on %s, using the raw socket backend\n", can_ifname);
+    } else {
+      isotp_backend = ISOTP_KERNEL;
+      if(verbose) plog("Using kernel CAN_ISOTP sockets on %s\n", can_ifname);
+    }
+  }
+  if(rx_filter || isotp_backend == ISOTP_KERNEL) install_filters(can);
+  opt = 1;
+  setsockopt(can, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt));
+
+  if (bind(can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+  }
+  iface_rx_start = iface_rx_packets(can_ifname);
+
+  rx_init();
+  tx_init();
+  epfd = epoll_create1(0);
+  if(epfd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  tx_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  periodic_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if(tx_timer_fd < 0 || periodic_timer_fd < 0) {
+    perror("timerfd_create");
+    exit(1);
+  }
+  periodic_init();
+  ret = ev_add(epfd, can, EV_CAN, 0) | ev_add(epfd, tx_timer_fd, EV_TX_TIMER, 0);
+  ret |= ev_add(epfd, periodic_timer_fd, EV_PERIODIC, 0);
+  for(i = 0; i < ecu_count; i++) {
+    if(ecus[i].isotp_fd[loop_id] >= 0) ret |= ev_add(epfd, ecus[i].isotp_fd[loop_id], EV_ISOTP, i);
+    if(ecus[i].func_fd[loop_id] >= 0) ret |= ev_add(epfd, ecus[i].func_fd[loop_id], EV_ISOTP_FUNC, i);
+  }
+  if(ret < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+
+  while(running) {
+    ret = epoll_wait(epfd, events, 16, EPOLL_TIMEOUT);
+    if(ret < 0) {
+      if(errno != EINTR) perror("epoll_wait");
+      running = 0;
+      continue;
+    }
+
+    for(i = 0; i < ret; i++) {
+      idx = events[i].data.u64 & 0xFFFFFFFF;
+      switch(events[i].data.u64 >> 32) {
+        case EV_CAN:
+          if(rx_drain(can) < 0) running = 0;
           break;
-        case UDS_SID_READ_DATA_BY_ID:
-          handle_read_data_by_id(can, frame);
+        case EV_TX_TIMER:
+          if(read(tx_timer_fd, &expirations, sizeof(expirations)) > 0) tx_timer_armed = 0;
+          // The backlog goes first so sessions waiting on it can follow
+          tx_defer_service(can);
+          isotp_service(can);
           break;
-        case UDS_SID_TESTER_PRESENT:
-          if(verbose > 1) plog("Received TesterPresent\n");
-          generic_OK_resp(can, frame);
+        case EV_ISOTP:
+          isotp_kernel_rx(can, &ecus[idx], 0);
           break;
-        case UDS_SID_GM_READ_DIAG_INFO:
-          handle_gm_read_diag(can, frame);
+        case EV_ISOTP_FUNC:
+          isotp_kernel_rx(can, &ecus[idx], 1);
           break;
-        default:
-          //if(verbose) plog("Unhandled mode/sid: %02X\n", frame.data[1]);
-          if(verbose) plog("Unhandled mode/sid: %s\n", get_mode_str(frame));
+        case EV_PERIODIC:
+          if(read(periodic_timer_fd, &expirations, sizeof(expirations)) > 0) periodic_timer_armed = 0;
+          periodic_service(can);
           break;
       }
-      break;
-    default:
-      if (DEBUG) print_pkt(frame);
-      if (DEBUG) plog("DEBUG: missed ID %02X\n", frame.can_id);
-      break;
+    }
+
+    isotp_check_timeouts();
+    xfer_check_timeouts();
+    if(oracle_enabled) oracle_check();
+    tx_schedule();
+    periodic_schedule();
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  if(!shutdown_logged++) plog("Got Interrupt.  Shutting down gracefully\n");
+  if(loop_count > 1) plog("== %s ==\n", can_ifname);
+  print_rx_stats();
+  print_tx_stats();
+  print_periodic_stats();
+  if(replay_file) print_replay_stats();
+  if(oracle_enabled) print_oracle_stats();
+  pthread_mutex_unlock(&stats_lock);
+  if(recfp) rec_flush();
+  xfer_abort_all("shutting down");
+  isotp_kernel_close();
+  close(tx_timer_fd);
+  close(periodic_timer_fd);
+  close(epfd);
+  close(can);
+  return NULL;
+}
+
+// Requests per ECU across all interfaces
+void print_ecu_stats() {
+  int i;
+  for(i = 0; i < ecu_count; i++) {
+    if(ecus[i].requests) plog("ECU %s: %lu requests\n", ecus[i].name, ecus[i].requests);
   }
 }
 
 int main(int argc, char *argv[]) {
-  int opt, ret;
-  int can;
-  int nbytes;
-  struct ifreq ifr;
-  struct sockaddr_can addr;
-  struct iovec iov;
-  struct msghdr msg;
-  struct canfd_frame frame;
-  char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+  int opt, ret = 0;
+  int i;
+  int cpus[MAX_IFACES], cpu_count = 0;
+  char *cpu_list = NULL, *p, *end;
+  char *def_file = NULL;
+  char *rec_file = NULL;
+  char *mem_specs[MEM_REGIONS_MAX];
+  int mem_spec_count = 0;
+  char *bind_specs[MAX_ECUS], *route_specs[MAX_IFACES * MAX_IFACES];
+  int bind_count = 0, route_count = 0;
+  struct loop_state *main_state;
   struct sigaction act;
-  struct timeval timeo;
-  fd_set rdfs;
 
   verbose = 0;
+  memset(&act, 0, sizeof(act));
   act.sa_handler = intHandler;
   sigaction(SIGINT, &act, NULL);
   sigaction(SIGHUP, &act, NULL);
-  srand(time(NULL));
+  fuzz_seed = time(NULL) ^ ((uint64_t)getpid() << 32);
 
-  while ((opt = getopt(argc, argv, "cV:zl:vFh?")) != -1) {
+  while ((opt = getopt(argc, argv, "cV:zl:vFB:fAIC:N:J:e:m:b:g:d:D:S:M:W:T:R:P:XO:h?")) != -1) {
     switch(opt) {
         case 'c':
           keep_spec = 1;
@@ -1438,6 +5981,82 @@ int main(int argc, char *argv[]) {
         case 'z':
           fuzz_level++;
           break;
+        case 'B':
+          rx_batch = atoi(optarg);
+          if(rx_batch < 1 || rx_batch > RX_BATCH_MAX) usage(argv[0], "Invalid batch size");
+          break;
+        case 'f':
+          can_fd = 1;
+          break;
+        case 'A':
+          rx_filter = 0;
+          break;
+        case 'I':
+          use_kernel_isotp = 1;
+          break;
+        case 'C':
+          cpu_list = optarg;
+          break;
+        case 'N':
+          obd_ecus = atoi(optarg);
+          if(obd_ecus < 1 || obd_ecus > OBD_MAX_ECUS) usage(argv[0], "Invalid number of OBD ECUs");
+          break;
+        case 'J':
+          func_jitter_ms = atoi(optarg);
+          if(func_jitter_ms < 0 || func_jitter_ms > 1000) usage(argv[0], "Invalid response jitter");
+          break;
+        case 'e':
+          def_file = optarg;
+          break;
+        case 'm':
+          if(mem_spec_count == MEM_REGIONS_MAX) usage(argv[0], "Too many memory images");
+          mem_specs[mem_spec_count++] = optarg;
+          break;
+        case 'b':
+          if(bind_count == MAX_ECUS) usage(argv[0], "Too many bindings");
+          bind_specs[bind_count++] = optarg;
+          break;
+        case 'g':
+          if(route_count == MAX_IFACES * MAX_IFACES) usage(argv[0], "Too many gateway routes");
+          route_specs[route_count++] = optarg;
+          break;
+        case 'd':
+          download_dir = optarg;
+          break;
+        case 'D':
+          dtc_stress = atoi(optarg);
+          if(dtc_stress < 0 || dtc_stress > DTC_STRESS_MAX) usage(argv[0], "Invalid number of DTCs");
+          break;
+        case 'S':
+          fuzz_seed = strtoull(optarg, NULL, 0);
+          break;
+        case 'M':
+          mutate_rate = atoi(optarg);
+          if(mutate_rate < 0 || mutate_rate > 100) usage(argv[0], "Invalid mutation rate");
+          break;
+        case 'W':
+          if(mut_set_weights(optarg) < 0) usage(argv[0], "Invalid mutation weights");
+          break;
+        case 'T':
+          tp_rate = atoi(optarg);
+          if(tp_rate < 0 || tp_rate > 100) usage(argv[0], "Invalid ISOTP fuzzing rate");
+          break;
+        case 'R':
+          rec_file = optarg;
+          break;
+        case 'P':
+          replay_file = optarg;
+          break;
+        case 'X':
+          replay_fast = 1;
+          break;
+        case 'O':
+          oraclefp = fopen(optarg, "a");
+          if(!oraclefp) {
+            perror(optarg);
+            exit(1);
+          }
+          break;
         case 'h':
         case '?':
         default:
@@ -1447,68 +6066,82 @@ int main(int argc, char *argv[]) {
   }
 
   if (optind >= argc) usage(argv[0], "You must specify at least one can device");
+  if (argc - optind > MAX_IFACES) usage(argv[0], "Too many can devices");
 
-  // Create a new raw CAN socket
-  can = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-  if(can < 0) usage(argv[0], "Couldn't create raw socket");
+  for(p = cpu_list; p && cpu_count < MAX_IFACES; p = *end == ',' ? end + 1 : NULL) {
+    cpus[cpu_count] = strtol(p, &end, 10);
+    if(end == p || cpus[cpu_count] < 0 || cpus[cpu_count] >= CPU_SETSIZE) usage(argv[0], "Invalid core list");
+    cpu_count++;
+  }
 
-  addr.can_family = AF_CAN;
-  memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
-  strncpy(ifr.ifr_name, argv[optind], strlen(argv[optind]));
-  if (verbose) plog("Using CAN interface %s\n", ifr.ifr_name);
-  if (ioctl(can, SIOCGIFINDEX, &ifr) < 0) {
-    perror("SIOCGIFINDEX");
+  // The response cache is captured on this thread before the loops start
+  main_state = calloc(1, sizeof(struct loop_state));
+  if(!main_state) {
+    perror("calloc");
     exit(1);
   }
-  addr.can_ifindex = ifr.ifr_ifindex;
-
-  if (bind(can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        return 1;
+  loop_state_use(main_state);
+  gen_data_init();
+  prng_seed(fuzz_seed);
+  register_builtin_ecus();
+  if(def_file && ecu_defs_load(def_file) < 0) exit(1);
+  for(i = 0; i < mem_spec_count; i++) {
+    if(mem_region_load(mem_specs[i]) < 0) exit(1);
   }
-
-  iov.iov_base = &frame;
-  iov.iov_len = sizeof(frame);
-  msg.msg_name = &addr;
-  msg.msg_namelen = sizeof(addr);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = &ctrlmsg;
-  msg.msg_controllen = sizeof(ctrlmsg);
-  msg.msg_flags = 0;
+  for(i = 0; i < bind_count; i++) {
+    if(ecu_bind(bind_specs[i], argv + optind, argc - optind) < 0) exit(1);
+  }
+  for(i = 0; i < route_count; i++) {
+    if(gateway_route(route_specs[i], argv + optind, argc - optind) < 0) exit(1);
+  }
+  if(download_dir && downloads_start() < 0) exit(1);
+  if(replay_file && replay_load(replay_file) < 0) exit(1);
+  if(rec_file && rec_open(rec_file, argc - optind) < 0) exit(1);
+  rcache_build();
+  oracle_enabled = fuzz_level || mutate_rate || tp_rate || oraclefp;
+  if(oraclefp) fprintf(oraclefp, "# time\tinterface\tecu\tfinding\tcase\tfuzz\tms\tusual ms (seed %llu)\n", (unsigned long long)fuzz_seed);
+  if(verbose) plog("Simulating %d ECUs\n", ecu_count);
+  if(use_kernel_isotp && ((fuzz_level > 2 && !keep_spec) || tp_rate || recfp || replay_file || no_flow_control)) {
+    // The kernel won't break the spec or skip flow control for us
+    plog("ISOTP spec fuzzing, -T, -R, -P and -F need the raw socket backend, ignoring -I\n");
+    use_kernel_isotp = 0;
+  }
+  if(use_kernel_isotp) isotp_kernel_limits();
 
   if(verbose) plog("Fuzz level set to: %d\n", fuzz_level);
-  gettimeofday(&start_tv, NULL);
+  if(fuzz_level || mutate_rate || tp_rate || verbose) plog("Random seed: %llu (-S %llu repeats this run)\n", (unsigned long long)fuzz_seed, (unsigned long long)fuzz_seed);
+  if(verbose) plog("Draining up to %d frames per wakeup\n", rx_batch);
   running = 1;
-  while(running) {
-    FD_ZERO(&rdfs);
-    FD_SET(can, &rdfs);
-  
-    timeo.tv_sec  = 0;
-    timeo.tv_usec = 10000 * 20; // 20 ms  
-
-    if ((ret = select(can+1, &rdfs, NULL, NULL, &timeo)) < 0) {
+  loop_count = argc - optind;
+  for(i = 0; i < loop_count; i++) {
+    loops[i].id = i;
+    loops[i].ifname = argv[optind + i];
+    loops[i].cpu = cpu_count ? cpus[i % cpu_count] : -1;
+    loops[i].state = calloc(1, sizeof(struct loop_state));
+    if(!loops[i].state) {
+      perror("calloc");
+      ret = 1;
       running = 0;
-      continue;
+      break;
     }
-
-    if (FD_ISSET(can, &rdfs)) {
-      nbytes = recvmsg(can, &msg, 0);
-      if (nbytes < 0) {
-        perror("read");
-        return 1;
-      }
-      if ((size_t)nbytes != CAN_MTU) {
-        fprintf(stderr, "read: incomplete CAN frame\n");
-        return 1;
-      }
-      handle_pkt(can, frame);
+    ret = pthread_create(&loops[i].thread, NULL, can_loop_run, &loops[i]);
+    if(ret) {
+      plog("Couldn't start a thread for %s: %s\n", loops[i].ifname, strerror(ret));
+      free(loops[i].state);
+      running = 0;
+      break;
     }
-
-    handle_pending_data(can);
   }
+  while(--i >= 0) {
+    pthread_join(loops[i].thread, NULL);
+    free(loops[i].state);
+  }
+  free(main_state);
+  if(download_dir) downloads_stop();
 
-  plog("Got Interrupt.  Shutting down gracefully\n");
+  if(verbose && loop_count > 1) print_ecu_stats();
+  if(recfp) fclose(recfp);
+  if(oraclefp) fclose(oraclefp);
   if(plogfp) fclose(plogfp);
-
+  return ret ? 1 : 0;
 }
@@ -56,6 +56,24 @@
 
 /* GM READ DIAG SUB FUNCS */
 #define UDS_READ_STATUS_BY_MASK           0x81
+
+/* READ DTC INFORMATION SUB FUNCS */
+#define UDS_DTC_REPORT_NUMBER_BY_MASK     0x01
+#define UDS_DTC_REPORT_BY_MASK            0x02
+#define UDS_DTC_REPORT_SUPPORTED          0x0A
+
+/* Negative response codes */
+#define UDS_NRC_SUB_FUNCTION_NOT_SUPPORTED   0x12
+#define UDS_NRC_INCORRECT_LENGTH             0x13
+#define UDS_NRC_RESPONSE_TOO_LONG            0x14
+#define UDS_NRC_BUSY_REPEAT_REQUEST          0x21
+#define UDS_NRC_CONDITIONS_NOT_CORRECT       0x22
+#define UDS_NRC_REQUEST_SEQUENCE_ERROR       0x24
+#define UDS_NRC_REQUEST_OUT_OF_RANGE         0x31
+#define UDS_NRC_UPLOAD_DOWNLOAD_NOT_ACCEPTED 0x70
+#define UDS_NRC_GENERAL_PROGRAMMING_FAILURE  0x72
+#define UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER 0x73
+
 /* DTC MASK Bitflags */
 #define DTC_SUPPORTED_BY_CALIBRATION      1
 #define DTC_CURRENT_DTC                   2
@@ -66,6 +84,3 @@
 #define DTC_CURRENT_DTC_SINCE_POWER       64
 #define DTC_WARNING_INDICATOR_STATE       128
 
-/* Periodic Data Message types */
-#define PENDING_READ_DATA_BY_ID_GM         1
-